@@ -1,2 +1,2 @@
 #!/bin/bash
-g++ -o Z80_Simulator -O3 -I include src/Z80_Simulator.cpp -lpng
+g++ -o Z80_Simulator -O3 -mavx2 -pthread -I include src/Z80_Simulator.cpp -lpng -lz
@@ -10,17 +10,32 @@
 // Adapted to Z80 CPU Simulator on 26.9.2013
 // Ported to Linux/g++ by Dave Banks 29.8.2018
 
+#include <ctype.h>
 #include <inttypes.h>
 #include <locale.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include <png++/png.hpp>
+#include <zlib.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -47,9 +62,135 @@ uint64_t GetTickCount()
    return  tv.tv_sec * 1000LL + tv.tv_usec / 1000;
 }
 
-#ifdef DMB_THREAD
-unsigned int thread_count = 3;
-#endif
+// Persistent pool of worker threads used by the parallel engines
+// the calling thread takes part in every job as thread 0
+// Run() starts the job on all threads and returns when all of them have finished it
+// Barrier() synchronises all threads between the phases inside one job
+
+class ThreadPool
+{
+public:
+   ThreadPool();
+   void Start(unsigned int threadcount);
+   void Stop();
+   void Run(void (*newjob)(unsigned int));
+   void Barrier();
+   unsigned int count;
+private:
+   void Worker(unsigned int id, unsigned int seen);
+   vector<std::thread> workers;
+   void (*job)(unsigned int);
+   std::atomic<unsigned int> generation;
+   std::atomic<unsigned int> arrived;
+   std::atomic<unsigned int> barriergeneration;
+   std::atomic<bool> quit;
+};
+
+ThreadPool::ThreadPool()
+{
+   count = 1;
+   job = NULL;
+   generation = 0;
+   arrived = 0;
+   barriergeneration = 0;
+   quit = false;
+}
+
+// busy waiting is fine when every thread has its own core, but we must give way when the cores are shared
+inline void WaitSpin(unsigned int &spins)
+{
+   if (++spins > 64)
+      std::this_thread::yield();
+}
+
+void ThreadPool::Start(unsigned int threadcount)
+{
+   Stop();
+   count = threadcount ? threadcount : 1;
+   quit = false;
+   for (unsigned int t = 1; t < count; t++)
+      workers.push_back(std::thread(&ThreadPool::Worker, this, t, generation.load()));
+}
+
+void ThreadPool::Stop()
+{
+   quit = true;
+   for (unsigned int t = 0; t < workers.size(); t++)
+      workers[t].join();
+   workers.clear();
+   count = 1;
+}
+
+void ThreadPool::Worker(unsigned int id, unsigned int seen)
+{
+   while (true)
+   {
+      unsigned int spins = 0;
+      while (generation.load() == seen)
+      {
+         if (quit)
+            return;
+         WaitSpin(spins);
+      }
+      seen++;
+      job(id);
+      Barrier();
+   }
+}
+
+void ThreadPool::Run(void (*newjob)(unsigned int))
+{
+   if (count < 2)
+   {
+      newjob(0);
+      return;
+   }
+   job = newjob;
+   generation.fetch_add(1);
+   newjob(0);
+   Barrier();
+}
+
+void ThreadPool::Barrier()
+{
+   if (count < 2)
+      return;
+   unsigned int pomgeneration = barriergeneration.load();
+   if (arrived.fetch_add(1) + 1 == count)
+   {
+      arrived.store(0);
+      barriergeneration.fetch_add(1);
+   }
+   else
+   {
+      unsigned int spins = 0;
+      while (barriergeneration.load() == pomgeneration)
+         WaitSpin(spins);
+   }
+}
+
+ThreadPool pool;
+
+// simulation engines - see SimulateIteration()
+
+#define ENGINE_DENSE 0 // the original serial sweep, charge is moved into neighbours in place (only homogenization is parallel)
+#define ENGINE_THREADED 1 // two-phase (compute / homogenize) sweep, deterministic for any number of threads
+#define ENGINE_NODE 2 // charge is kept once per signal (node) - no homogenization needed
+#define ENGINE_FIXED 3 // node engine in fixed point integers - bit exact on every machine
+#define ENGINE_CSR 4 // node engine as a gated sparse matrix-vector product, nodes gather their flows in CSR
+#define ENGINE_SELL 5 // the same with the matrix in SELL-C-sigma and SIMD kernel
+#define ENGINE_COLORED 6 // in place Simulate() as the dense engine, non conflicting transistors (one color) in parallel
+#define ENGINE_BLOCKED 7 // node engine running several iterations on one cache sized region before moving to the next one
+#define ENGINE_FUSED 8 // the threaded engine in a single pass over the signals, terminal charges kept ordered by signal
+#define ENGINE_COUNT 9
+
+const char *enginenames[ENGINE_COUNT] = { "dense", "threaded", "node", "fixed", "csr", "sell", "colored", "blocked", "fused" };
+
+int engine = ENGINE_DENSE;
+unsigned int threads = 1;
+float relaxation = 1.0f; // the charge moved in an iteration gets scaled by this (over-relaxation above 1)
+bool sorsweep = false; // the node engine sweeps Gauss-Seidel instead of Jacobi
+bool calibrate = false; // the fixed point engine runs along the node engine and they get compared
 
 unsigned int DIVISOR = 600; // the lower the faster is clock, 1000 is lowest value I achieved
 #define MINSHAPESIZE 25 // if a shape is smaller than this it gets reported
@@ -187,6 +328,9 @@ class Signal
 public:
    Signal();
    void Homogenize();
+   void HomogenizeNormalize();
+   float SumCharge(unsigned int first, unsigned int last);
+   void SpreadCharge(float pomcharge, unsigned int first, unsigned int last, bool normalize);
    vector<Connection> connections;
    float signalarea;
    bool ignore;
@@ -200,6 +344,66 @@ Signal::Signal()
 
 vector<Signal> signals;
 
+// State of the node engine - as every iteration ends by homogenization the charge of a terminal is always
+// (charge of its signal) * (area of the transistor) / (area of the signal), so it is enough to keep the charge
+// once per signal (node). The capacitance of a node is the area of all the transistor terminals connected to it.
+// nodemap says what the node is driven to - SIG_VCC / SIG_GND when a pad drives it, otherwise the node itself
+
+vector<float> nodecharge;
+const float *nodearea = NULL; // these two are read only - they point to nodeareas or into the netlist of the run farm
+const float *nodegatearea = NULL; // area of the gates connected to the node - these get pinned when a pad drives the node
+vector<float> nodeareas, nodegateareas;
+vector<float> nodedelta; // charge moved to the node during the current iteration
+vector<int> nodemap;
+
+// State of the fused engine - charges of the terminals in one array, the terminals of a signal next to each other
+// the terminal of transistor t is fusedcharge[fusedslots[3 * t + terminal - 1]]
+vector<float> fusedcharge;
+vector<unsigned int> fusedslots;
+
+// State of the fixed point node engine - charges are integers in 1 / CHARGESCALE of the float charge, ratios are
+// in 1 / 65536. Only integer arithmetic is used, so the results are the same on every machine and with every compiler.
+
+#define CHARGESHIFT 8
+#define CHARGESCALE (1 << CHARGESHIFT)
+#define RATIOSHIFT 16
+#define RECIPSHIFT 40
+#define FIXEDDEFLATOR 59578 // 65536 / PULLUPDEFLATOR
+#define FIXEDMAXQUANTUM (int32_t(MAXQUANTUM) * CHARGESCALE)
+
+vector<int32_t> nodefixed;
+vector<int32_t> nodefixeddelta;
+vector<int32_t> nodefixedarea;
+vector<int32_t> nodefixedgatearea;
+vector<int32_t> nodekeep; // part of the charge which stays when the gates get pinned by a pad
+vector<int32_t> noderatio; // charge / capacitance i.e. gatecharge / area of every gate on the node
+vector<int64_t> noderecip; // 2^RECIPSHIFT / capacitance
+
+inline bool NodeState()
+{
+   return engine == ENGINE_NODE || engine == ENGINE_FIXED || engine == ENGINE_CSR || engine == ENGINE_SELL || engine == ENGINE_BLOCKED;
+}
+
+// charge of the node in the units of the float engines
+inline float NodeCharge(int node)
+{
+   if (engine == ENGINE_FIXED)
+      return float(nodefixed[node]) / float(CHARGESCALE);
+   return nodecharge[node];
+}
+
+// is the gate driven by the node open?
+inline bool NodeIsOn(int node)
+{
+   if (nodemap[node] == SIG_VCC)
+      return true;
+   if (nodemap[node] == SIG_GND)
+      return false;
+   if (engine == ENGINE_FIXED)
+      return nodefixed[node] > 0;
+   return nodecharge[node] > 0.0f;
+}
+
 #define PAD_INPUT 1
 #define PAD_OUTPUT 2
 #define PAD_BIDIRECTIONAL 3
@@ -237,11 +441,13 @@ public:
    bool IsOn();
    int IsOnAnalog();
    void Simulate();
+   void SimulateLocal();
    void Normalize();
    int Valuate();
 
    int x, y;
    int gate, source, drain;
+   int origgate, origsource, origdrain; // signals as extracted - gate, source and drain get changed by pads
    int sourcelen, drainlen, otherlen;
    float area;
    bool depletion;
@@ -260,6 +466,7 @@ Transistor::Transistor()
 {
    x = y = 0;
    gate = source = drain = 0;
+   origgate = origsource = origdrain = 0;
    sourcelen = drainlen = otherlen = 0;
    area = 0.0f;
    depletion = false;
@@ -269,8 +476,14 @@ Transistor::Transistor()
    chargetobeon = pomchargetogo = 0.0f;
 }
 
+vector<Transistor> transistors;
+
 inline bool Transistor::IsOn()
 {
+   if (NodeState())
+      return NodeIsOn(origgate);
+   if (engine == ENGINE_FUSED)
+      return fusedcharge[fusedslots[3 * (this - &transistors[0]) + GATE - 1]] > 0.0f;
    if (gatecharge > 0.0f)
       return true;
    return false;
@@ -298,29 +511,23 @@ inline int Transistor::Valuate()
    return 4;
 }
 
-vector<Transistor> transistors;
-
-#ifdef DMB_THREAD
-DWORD WINAPI ThreadSimulateTransistors(LPVOID thread_id)
+// charge of the terminal of the connection in the terminal engines
+inline float TerminalCharge(const Connection &pomconn)
 {
-   printf("*** Thread: %d started @%d\n", thread_id, GetTickCount());
-   for (unsigned int pogo = 0; pogo < 1000; pogo++)
-   for (unsigned int j = (unsigned int) thread_id; j < transistors.size(); j += thread_count)
-   {
-      transistors[j].Simulate();
-   // printf("*** Thread: %d transistor: %04d\n", thread_id, j);
-   }
-   printf("*** Thread: %d finished @%d\n", thread_id, GetTickCount());
-   return NULL;
+   if (engine == ENGINE_FUSED)
+      return fusedcharge[fusedslots[3 * pomconn.index + pomconn.terminal - 1]];
+   if (pomconn.terminal == GATE)
+      return transistors[pomconn.index].gatecharge;
+   if (pomconn.terminal == SOURCE)
+      return transistors[pomconn.index].sourcecharge;
+   return transistors[pomconn.index].draincharge;
 }
 
-HANDLE *threadList = NULL;
-#endif
-
-void Signal::Homogenize()
+// sums the charge of connections first .. last - 1
+float Signal::SumCharge(unsigned int first, unsigned int last)
 {
    float pomcharge = 0.0f;
-   for (unsigned int i = 0; i < connections.size(); i++)
+   for (unsigned int i = first; i < last; i++)
    {
       if (connections[i].terminal == GATE)
          pomcharge += transistors[connections[i].index].gatecharge;
@@ -329,18 +536,44 @@ void Signal::Homogenize()
       else if (connections[i].terminal == DRAIN)
          pomcharge += transistors[connections[i].index].draincharge;
    }
+   return pomcharge;
+}
 
-   for (unsigned int i = 0; i < connections.size(); i++)
+// spreads the charge of the whole signal to connections first .. last - 1 proportionally by area
+// if normalize is set the clamping of Normalize() is done while the charge is at hand
+void Signal::SpreadCharge(float pomcharge, unsigned int first, unsigned int last, bool normalize)
+{
+   for (unsigned int i = first; i < last; i++)
    {
+      Transistor &pomtran = transistors[connections[i].index];
+      float pomvalue = pomcharge * connections[i].proportion;
+      if (normalize)
+      {
+         if (pomvalue < -pomtran.area)
+            pomvalue = -pomtran.area;
+         if (pomvalue > pomtran.area)
+            pomvalue = pomtran.area;
+      }
       if (connections[i].terminal == GATE)
-         transistors[connections[i].index].gatecharge = pomcharge * connections[i].proportion;
+         pomtran.gatecharge = pomvalue;
       else if (connections[i].terminal == SOURCE)
-         transistors[connections[i].index].sourcecharge = pomcharge * connections[i].proportion;
+         pomtran.sourcecharge = pomvalue;
       else if (connections[i].terminal == DRAIN)
-         transistors[connections[i].index].draincharge = pomcharge * connections[i].proportion;
+         pomtran.draincharge = pomvalue;
    }
 }
 
+void Signal::Homogenize()
+{
+   SpreadCharge(SumCharge(0, connections.size()), 0, connections.size(), false);
+}
+
+// Homogenize() and Normalize() in one go
+void Signal::HomogenizeNormalize()
+{
+   SpreadCharge(SumCharge(0, connections.size()), 0, connections.size(), true);
+}
+
 void Transistor::Simulate()
 {
    if (gate == SIG_GND)
@@ -473,6 +706,69 @@ void Transistor::Simulate()
    }
 }
 
+// Same as Simulate() but the charge is moved only into the own terminals of the transistor
+// the following homogenization spreads it over the whole signal anyway - pull-ups and pull-downs
+// put it to their source / drain, which belongs to the same signal as source / drain connections
+// As no other transistor is touched all transistors can be simulated in parallel
+void Transistor::SimulateLocal()
+{
+   if (gate == SIG_GND)
+      gatecharge = 0.0f;
+   else if (gate == SIG_VCC)
+      gatecharge = area;
+
+   if (!depletion && !IsOn())
+      return;
+
+   if (drain == SIG_VCC)
+   {
+      float chargetogo = pomchargetogo;
+      if (!depletion)
+         chargetogo *= gatecharge / area;
+      chargetogo /= PULLUPDEFLATOR;
+
+      if (sourceconnections.size())
+         sourcecharge += chargetogo;
+   }
+   else if (source == SIG_GND)
+   {
+      float chargetogo = pomchargetogo;
+      if (!depletion)
+         chargetogo *= gatecharge / area;
+
+      if (drainconnections.size())
+         draincharge -= chargetogo;
+   }
+   else
+   {
+      float pomsourcecharge = 0.0f, pomdraincharge = 0.0f;
+
+      pomsourcecharge = sourcecharge;
+      if (pomsourcecharge > 0.0f)
+         pomsourcecharge /= PULLUPDEFLATOR;
+
+      pomdraincharge = draincharge;
+      if (pomdraincharge > 0.0f)
+         pomdraincharge /= PULLUPDEFLATOR;
+
+      float chargetogo = ((pomsourcecharge - pomdraincharge) / resist) / PULLUPDEFLATOR;
+      float pomsign = 1.0;
+      if (chargetogo < 0.0f)
+      {
+         pomsign = -1.0;
+         chargetogo = -chargetogo;
+      }
+      if (chargetogo > MAXQUANTUM)
+         chargetogo = MAXQUANTUM;
+      if (!depletion)
+         chargetogo *= gatecharge / area;
+      chargetogo *= pomsign;
+
+      sourcecharge -= chargetogo;
+      draincharge += chargetogo;
+   }
+}
+
 void Transistor::Normalize()
 {
    if (gatecharge < -area)
@@ -532,22 +828,27 @@ void Pad::SetInputSignal(int signal)
             transistors[connections[i].index].drain = origsignal;
       }
    }
+   if (nodemap.size())
+      nodemap[origsignal] = (signal != SIG_FLOATING) ? signal : origsignal;
 }
 
 float Pad::ReadOutput()
 {
    float shouldbe = 0.0f, reallywas = 0.0f;
+   if (NodeState())
+   {
+      for (unsigned int i = 0; i < connections.size(); i++)
+         if (connections[i].terminal == SOURCE || connections[i].terminal == DRAIN)
+            shouldbe += transistors[connections[i].index].area;
+      reallywas = shouldbe * NodeCharge(origsignal) / nodearea[origsignal];
+      return reallywas / shouldbe;
+   }
    for (unsigned int i = 0; i < connections.size(); i++)
    {
-      if (connections[i].terminal == SOURCE)
-      {
-         shouldbe += transistors[connections[i].index].area;
-         reallywas += transistors[connections[i].index].sourcecharge;
-      }
-      else if (connections[i].terminal == DRAIN)
+      if (connections[i].terminal == SOURCE || connections[i].terminal == DRAIN)
       {
          shouldbe += transistors[connections[i].index].area;
-         reallywas += transistors[connections[i].index].draincharge;
+         reallywas += TerminalCharge(connections[i]);
       }
    }
 
@@ -566,540 +867,5690 @@ int Pad::ReadOutputStatus()
    return SIG_FLOATING;
 }
 
-int GetPixelFromBitmapData(png::image<png::rgb_pixel>& image, int x, int y)
-{
-   if (x < 0)
-      return 0;
-   if (y < 0)
-      return 0;
-   if (x >= size_x)
-      return 0;
-   if (y >= size_y)
-      return 0;
+// Pad driver - the main loop gives the levels of all the input pads as bitmasks by signal and only the pads
+// whose level changed since the previous call get SetInputSignal(), the others keep their connections as they are.
 
-   png::rgb_pixel pixel = image[y][x];
+#define PADBIT(signal) (uint64_t(1) << (signal))
 
-   return pixel.red + (pixel.green << 8) + (pixel.blue << 16);
+class PadDriver
+{
+public:
+   PadDriver();
+   void Setup();
+   void Drive(uint64_t high, uint64_t driven);
+   vector<int> padofsignal; // index into pads, -1 - no pad
+   uint64_t inputs; // signals of the pads the driver sets
+   uint64_t lasthigh, lastdriven;
+   bool valid;
+   uint64_t changes;
+};
+
+PadDriver::PadDriver()
+{
+   inputs = lasthigh = lastdriven = changes = 0;
+   valid = false;
 }
 
+void PadDriver::Setup()
+{
+   padofsignal.assign(64, -1);
+   inputs = 0;
+   for (unsigned int j = 0; j < pads.size(); j++)
+   {
+      int pomsignal = pads[j].origsignal;
+      if (pomsignal < 0 || pomsignal >= 64)
+         continue;
+      bool pomcontrol = pomsignal == PAD__RESET || pomsignal == PAD_CLK || pomsignal == PAD__WAIT || pomsignal == PAD__INT
+         || pomsignal == PAD__NMI || pomsignal == PAD__BUSRQ;
+      bool pomdata = pomsignal >= PAD_D0 && pomsignal <= PAD_D7;
+      if ((pads[j].type == PAD_INPUT && pomcontrol) || (pads[j].type == PAD_BIDIRECTIONAL && pomdata))
+      {
+         padofsignal[pomsignal] = j;
+         inputs |= PADBIT(pomsignal);
+      }
+   }
+   valid = false;
+}
 
-bool SetPixelToBitmapData(png::image<png::rgba_pixel>& image, int x, int y, int barva)
+// driven bits get SIG_VCC where high is set and SIG_GND elsewhere, the other pads float
+void PadDriver::Drive(uint64_t high, uint64_t driven)
 {
-   if (x < 0)
-      return false;
-   if (y < 0)
-      return false;
-   if (x >= size_x)
-      return false;
-   if (y >= size_y)
-      return false;
+   high &= driven;
+   uint64_t pomchanged = inputs;
+   if (valid)
+      pomchanged &= (high ^ lasthigh) | (driven ^ lastdriven);
+   while (pomchanged)
+   {
+      int pomsignal = __builtin_ctzll(pomchanged);
+      pomchanged &= pomchanged - 1;
+      int pomlevel = !(driven & PADBIT(pomsignal)) ? SIG_FLOATING : (high & PADBIT(pomsignal)) ? SIG_VCC : SIG_GND;
+      pads[padofsignal[pomsignal]].SetInputSignal(pomlevel);
+      changes++;
+   }
+   lasthigh = high;
+   lastdriven = driven;
+   valid = true;
+}
 
-   if (barva)
-      image[y][x] = png::rgba_pixel((barva >> 16) & 0xff, (barva >> 8) & 0xff, barva & 0xff, 0xff);
-   else
-      image[y][x] = png::rgba_pixel();
+PadDriver paddriver;
 
-   return true;
-}
+// Output streams - the trace, the bus log, the VCD, the console output of -outfile and the sample lines on stdout
+// get written by one output thread, so a slow disk or terminal doesn't hold up the simulation. Every stream has its own single producer (the simulation)
+// single consumer (the output thread) ring of OUTPUTRING bytes, the thread takes the bytes out in blocks of at least
+// OUTPUTBLOCK (or whatever is there after OUTPUTWAITS idle rounds of a millisecond) and compresses them with zlib
+// when the name ends with .gz. A full ring makes the simulation wait for the thread.
 
-// These functions are very poorly implemented - they use recursive flood algorithm which is very slow and time consuming
-// should be reimplemented
+#define OUTPUTRING (1 << 22)
+#define OUTPUTBLOCK (1 << 20)
+#define OUTPUTWAITS 100
+#define OUTPUTSTREAMS 8
 
-bool FillObject(int x, int y)
+class OutputStream
 {
-   if (pombuf[y * size_x + x] & type || !GetPixelFromBitmapData(bd, x, y)) {
-      return false;
-   }
-   stack_x[0] = x;
-   stack_y[0] = y;
-   int stack_ptr = 1;
-
-   while (stack_ptr > 0) {
+public:
+   OutputStream();
+   ~OutputStream();
+   bool Open(const char *filename);
+   bool Open(int fd);
+   bool Start();
+   void Write(const void *data, unsigned int length);
+   bool Drain();
+   void Close();
+   string name;
+   vector<char> ring;
+   std::atomic<uint64_t> head, tail; // free running counters, head is written by Write(), tail by Drain()
+   std::atomic<bool> closing, closed;
+   bool active;
+   FILE *file;
+   gzFile gzfile;
+   unsigned int waits;
+   uint64_t bytes, stalls;
+};
 
-      stack_ptr--;
-      x = stack_x[stack_ptr];
-      y = stack_y[stack_ptr];
+class OutputWriter
+{
+public:
+   OutputWriter();
+   ~OutputWriter();
+   void Add(OutputStream *stream);
+   void Run();
+   void Stop();
+   OutputStream *streams[OUTPUTSTREAMS];
+   std::atomic<unsigned int> count;
+   std::atomic<bool> done;
+   std::thread writer;
+};
 
-      pombuf[y * size_x + x] |= type;
-      shapesize++;
+OutputWriter::OutputWriter()
+{
+   count = 0;
+   done = false;
+}
 
-      for (int i = 0; i < 4; i++) {
-         int nx;
-         int ny;
-         switch (i) {
-         case 0: nx = x - 1; ny = y    ; break;
-         case 1: nx = x    ; ny = y - 1; break;
-         case 2: nx = x + 1; ny = y    ; break;
-         case 3: nx = x    ; ny = y + 1; break;
-         }
-         if (nx >= 0 && nx < size_x && ny >= 0 && ny < size_y) {
-            if (!(pombuf[ny * size_x + nx] & type) && GetPixelFromBitmapData(bd, nx, ny)) {
-               if (stack_ptr < FILL_STACK_SIZE) {
-                  stack_x[stack_ptr] = nx;
-                  stack_y[stack_ptr] = ny;
-                  stack_ptr++;
-               } else {
-                  printf("Fill stack overflow in FillObject()\n");
-                  ::exit(1);
-               }
-            }
-         }
-      }
-   }
-   return true;
+OutputWriter::~OutputWriter()
+{
+   Stop();
 }
 
+// the thread starts with the first stream, the streams opened later are seen by the next round
+void OutputWriter::Add(OutputStream *stream)
+{
+   unsigned int pomcount = count.load(std::memory_order_relaxed);
+   streams[pomcount] = stream;
+   count.store(pomcount + 1, std::memory_order_release);
+   if (!pomcount)
+      writer = std::thread(&OutputWriter::Run, this);
+}
 
-bool FillStructure(int x, int y)
+void OutputWriter::Run()
 {
-   if ((pombuf[y * size_x + x] & type) || (pombuf[y * size_x + x] & type2) != type3) {
-      return false;
+   for (;;)
+   {
+      bool pomdone = done.load(std::memory_order_acquire);
+      bool pomidle = true, pomopen = false;
+      unsigned int pomcount = count.load(std::memory_order_acquire);
+      for (unsigned int k = 0; k < pomcount; k++)
+      {
+         if (streams[k]->closed.load(std::memory_order_acquire))
+            continue;
+         pomopen = true;
+         if (streams[k]->Drain())
+            pomidle = false;
+      }
+      if (pomdone && !pomopen)
+         break;
+      if (pomidle)
+         usleep(1000);
    }
-   stack_x[0] = x;
-   stack_y[0] = y;
-   int stack_ptr = 1;
+}
 
-   while (stack_ptr > 0) {
+void OutputWriter::Stop()
+{
+   if (!writer.joinable())
+      return;
+   done.store(true, std::memory_order_release);
+   writer.join();
+}
 
-      stack_ptr--;
-      x = stack_x[stack_ptr];
-      y = stack_y[stack_ptr];
+OutputWriter outputwriter;
 
-      pombuf[y * size_x + x] |= type;
-      shapesize++;
+OutputStream::OutputStream()
+{
+   head = tail = 0;
+   closing = closed = false;
+   active = false;
+   file = NULL;
+   gzfile = NULL;
+   waits = 0;
+   bytes = stalls = 0;
+}
 
-      for (int i = 0; i < 4; i++) {
-         int nx;
-         int ny;
-         switch (i) {
-         case 0: nx = x - 1; ny = y    ; break;
-         case 1: nx = x    ; ny = y - 1; break;
-         case 2: nx = x + 1; ny = y    ; break;
-         case 3: nx = x    ; ny = y + 1; break;
-         }
-         if (nx >= 0 && nx < size_x && ny >= 0 && ny < size_y) {
-            if (!(pombuf[ny * size_x + nx] & type) && (pombuf[ny * size_x + nx] & type2) == type3) {
-               if (stack_ptr < FILL_STACK_SIZE) {
-                  stack_x[stack_ptr] = nx;
-                  stack_y[stack_ptr] = ny;
-                  stack_ptr++;
-               } else {
-                  printf("Fill stack overflow in FillStructure()\n");
-                  ::exit(1);
-               }
-            }
-         }
-      }
-   }
-   return true;
+OutputStream::~OutputStream()
+{
+   Close();
 }
 
+bool OutputStream::Open(const char *filename)
+{
+   if (active || outputwriter.count.load(std::memory_order_relaxed) == OUTPUTSTREAMS)
+      return false;
+   unsigned int pomlength = strlen(filename);
+   if (pomlength > 3 && !strcmp(filename + pomlength - 3, ".gz"))
+      gzfile = gzopen(filename, "wb6");
+   else
+      file = ::fopen(filename, "wb");
+   if (!file && !gzfile)
+      return false;
+   name = filename;
+   return Start();
+}
 
-bool FillStructureCheck(int x, int y)
+// a copy of the descriptor (stdout), such stream has no name and gets no summary line
+bool OutputStream::Open(int fd)
 {
-   if ((pombuf[y * size_x + x] & type) || (pombuf[y * size_x + x] & type2) != type2) {
+   if (active || outputwriter.count.load(std::memory_order_relaxed) == OUTPUTSTREAMS)
+      return false;
+   int pomfd = dup(fd);
+   file = (pomfd < 0) ? NULL : fdopen(pomfd, "wb");
+   if (!file)
+   {
+      if (pomfd >= 0)
+         close(pomfd);
       return false;
    }
-   stack_x[0] = x;
-   stack_y[0] = y;
-   int stack_ptr = 1;
-
-   while (stack_ptr > 0) {
-
-      stack_ptr--;
-      x = stack_x[stack_ptr];
-      y = stack_y[stack_ptr];
+   name.clear();
+   return Start();
+}
 
-      pombuf[y * size_x + x] |= type;
+bool OutputStream::Start()
+{
+   ring.resize(OUTPUTRING);
+   active = true;
+   outputwriter.Add(this);
+   return true;
+}
 
-      if ((pombuf[y * size_x + x] & type3)) {
-         objectfound = true;
+void OutputStream::Write(const void *data, unsigned int length)
+{
+   const char *pomdata = (const char *) data;
+   uint64_t pomhead = head.load(std::memory_order_relaxed);
+   bytes += length;
+   while (length)
+   {
+      uint64_t pomfree = OUTPUTRING - (pomhead - tail.load(std::memory_order_acquire));
+      if (!pomfree)
+      {
+         stalls++;
+         while (pomhead - tail.load(std::memory_order_acquire) >= OUTPUTRING)
+            std::this_thread::yield();
+         continue;
       }
+      unsigned int pomchunk = min(uint64_t(length), min(pomfree, uint64_t(OUTPUTRING - pomhead % OUTPUTRING)));
+      memcpy(&ring[pomhead % OUTPUTRING], pomdata, pomchunk);
+      pomhead += pomchunk;
+      pomdata += pomchunk;
+      length -= pomchunk;
+      head.store(pomhead, std::memory_order_release);
+   }
+}
 
-      for (int i = 0; i < 4; i++) {
-         int nx;
-         int ny;
-         switch (i) {
-         case 0: nx = x - 1; ny = y    ; break;
-         case 1: nx = x    ; ny = y - 1; break;
-         case 2: nx = x + 1; ny = y    ; break;
-         case 3: nx = x    ; ny = y + 1; break;
-         }
-         if (nx >= 0 && nx < size_x && ny >= 0 && ny < size_y) {
-            if (!(pombuf[ny * size_x + nx] & type) && (pombuf[ny * size_x + nx] & type2) == type2) {
-               if (stack_ptr < FILL_STACK_SIZE) {
-                  stack_x[stack_ptr] = nx;
-                  stack_y[stack_ptr] = ny;
-                  stack_ptr++;
-               } else {
-                  printf("Fill stack overflow in FillCheckStructure()\n");
-                  ::exit(1);
-               }
-            }
-         }
-      }
+// output thread - writes out the ring if there is enough in it, returns whether it wrote anything
+bool OutputStream::Drain()
+{
+   // closing is read before head, so everything written before Close() gets out
+   bool pomclosing = closing.load(std::memory_order_acquire);
+   uint64_t pomtail = tail.load(std::memory_order_relaxed);
+   uint64_t pomhead = head.load(std::memory_order_acquire);
+   if (pomhead - pomtail < OUTPUTBLOCK && !pomclosing && (pomhead == pomtail || ++waits < OUTPUTWAITS))
+      return false;
+   waits = 0;
+   bool pomwritten = pomhead != pomtail;
+   while (pomtail != pomhead)
+   {
+      // up to the end of the ring at once
+      unsigned int pomchunk = min(pomhead - pomtail, uint64_t(OUTPUTRING - pomtail % OUTPUTRING));
+      if (gzfile)
+         gzwrite(gzfile, &ring[pomtail % OUTPUTRING], pomchunk);
+      else
+         fwrite(&ring[pomtail % OUTPUTRING], 1, pomchunk, file);
+      pomtail += pomchunk;
+      tail.store(pomtail, std::memory_order_release);
    }
-   return true;
+   if (pomclosing)
+   {
+      if (gzfile)
+         gzclose(gzfile);
+      else
+         ::fclose(file);
+      closed.store(true, std::memory_order_release);
+   }
+   return pomwritten;
 }
 
-void ClearTemporary()
+void OutputStream::Close()
 {
-   for (int y = 0; y < size_y; y++)
-      for (int x = 0; x < size_x; x++)
-         pombuf[y * size_x + x] &= ~TEMPORARY;
+   if (!active)
+      return;
+   closing.store(true, std::memory_order_release);
+   while (!closed.load(std::memory_order_acquire))
+      usleep(1000);
+   active = false;
+   file = NULL;
+   gzfile = NULL;
+   if (name.empty())
+      return;
+   struct stat pomstat;
+   uint64_t pomdisk = stat(name.c_str(), &pomstat) ? 0 : pomstat.st_size;
+   printf("Output %s: %" PRIu64 " bytes, %" PRIu64 " on disk, the simulation waited for the writer %" PRIu64 " times\n",
+      name.c_str(), bytes, pomdisk, stalls);
 }
 
-// opens the respective file and copies its content to pombuff which holds the layers
-void CheckFile(char *firstpart, int ltype)
+// Memory and I/O devices - the bus of the main loop goes thru a page table of 256 byte memory pages and a table
+// of the 256 ports, every entry points to the device which serves it. A read calls the device once per access
+// (the value is latched until the address or the strobe changes), a write once when the write strobe goes up,
+// with the last data seen on the bus. Devices may ask for the _INT, _NMI and _WAIT pads and get Clock() once per
+// clock cycle. In the interrupt acknowledge cycle (M1 and IORQ low) the first device asking for _INT gets
+// Acknowledge() and puts the vector it returns on the data bus (IM 0 and IM 2), 0xff if no device asks. The default map is RAM in memory[], port latches in ports[] and the console on port 0, -device
+// specs get mapped over it in order:
+//    ram:ssss-eeee    rom:ssss-eeee (memory[] is the contents, writes are ignored)
+//    console:pp       (writes go to -outfile, reads give the last byte written)
+//    timer:pp:cycles[:nmi|:vv]  (_INT with the vector vv - 0xff if not given, or a one cycle pulse of _NMI,
+//                     every cycles clock cycles - the interrupt acknowledge cycle, reading or writing the port
+//                     acknowledges _INT, reading gives the ticks)
+
+class Device
 {
-   type = ltype;
+public:
+   Device(const char *pomname);
+   virtual ~Device() {}
+   virtual uint8_t Read(uint16_t address) = 0;
+   virtual void Write(uint16_t address, uint8_t data) = 0;
+   virtual void Clock(unsigned int) {}
+   virtual uint8_t Acknowledge() { intrequest = false; return 0xff; } // the vector for _INT
+   virtual uint32_t State() { return 0; } // anything which is not in memory[] or ports[], for the steady state hash
+   const char *name;
+   bool intrequest, nmirequest, waitrequest;
+   uint64_t reads, writes;
+};
 
-   char filename[256];
-   if (type == VIAS)
-      sprintf(filename, "%s%s", firstpart, "_vias.png");
-   if (type == METAL)
-      sprintf(filename, "%s%s", firstpart, "_metal.png");
-   if (type == PADS)
-      sprintf(filename, "%s%s", firstpart, "_pads.png");
-   if (type == POLYSILICON)
-      sprintf(filename, "%s%s", firstpart, "_polysilicon.png");
-   if (type == DIFFUSION)
-      sprintf(filename, "%s%s", firstpart, "_diffusion.png");
-   if (type == BURIED)
-      sprintf(filename, "%s%s", firstpart, "_buried.png");
-   if (type == ION_IMPLANTS)
-      sprintf(filename, "%s%s", firstpart, "_ions.png");
-   if (verbous)
-      printf("%s", filename);
+Device::Device(const char *pomname)
+{
+   name = pomname;
+   intrequest = nmirequest = waitrequest = false;
+   reads = writes = 0;
+}
 
-   try {
+class RamDevice : public Device
+{
+public:
+   RamDevice() : Device("ram") {}
+   uint8_t Read(uint16_t address) { return memory[address]; }
+   void Write(uint16_t address, uint8_t data) { memory[address] = data; }
+};
 
-      png::image<png::rgb_pixel> bitmapa(filename);
+class RomDevice : public Device
+{
+public:
+   RomDevice() : Device("rom") {}
+   uint8_t Read(uint16_t address) { return memory[address]; }
+   void Write(uint16_t, uint8_t) {}
+};
 
-      size_x = bitmapa.get_width();
-      size_y = bitmapa.get_height();
+class PortDevice : public Device
+{
+public:
+   PortDevice() : Device("ports") {}
+   uint8_t Read(uint16_t address) { return ports[address & 0xff]; }
+   void Write(uint16_t address, uint8_t data) { ports[address & 0xff] = data; }
+};
 
-      if (verbous)
-         printf(" size x: %d, y: %d\n", size_x, size_y);
+#define CONSOLERECENT 128
 
-      if (!pombuf)
-      {
-         pombuf = new uint16_t[size_x * size_y];
-         ZeroMemory(&pombuf[0], size_x * size_y * sizeof(uint16_t));
-      }
+unsigned int consoleoutput = 0; // bytes written to all the consoles
+string consolerecent; // the last of them, CONSOLERECENT bytes at least
 
-      // Assign global variable, used by FillObject
-      bd = bitmapa;
+class ConsoleDevice : public Device
+{
+public:
+   ConsoleDevice(OutputStream *pomstream) : Device("console") { stream = pomstream; }
+   uint8_t Read(uint16_t address) { return ports[address & 0xff]; }
+   void Write(uint16_t address, uint8_t data);
+   OutputStream *stream;
+};
 
-      int bitmap_room = 0;
-      for (int y = 0; y < size_y; y++)
-         for (int x = 0; x < size_x; x++)
-            if (GetPixelFromBitmapData(bitmapa, x, y))
-               bitmap_room++;
-      if (verbous)
-         printf("Percentage: %.2f%%\n", 100.0 * bitmap_room / size_x / size_y);
+void ConsoleDevice::Write(uint16_t address, uint8_t data)
+{
+   ports[address & 0xff] = data;
+   consoleoutput++;
+   consolerecent += char(data);
+   if (consolerecent.size() > 2 * CONSOLERECENT)
+      consolerecent.erase(0, CONSOLERECENT);
+   if (stream)
+      stream->Write(&data, 1);
+}
 
-      int bitmap_count = 0;
-      for (int y = 0; y < size_y; y++)
-         for (int x = 0; x < size_x; x++)
-            if (shapesize = 0, FillObject(x, y))
-            {
-               bitmap_count++;
-               if (shapesize < MINSHAPESIZE)
-                  if (verbous)
-                     printf("Object at %d, %d is too small.\n", x, y);
-            }
-      if (verbous)
-      {
-         printf("Count: %d\n", bitmap_count);
-         printf("---------------------\n");
-      }
+OutputStream consolestream; // -outfile of the simulation, the batch lanes write their own files
 
-   } catch (png::std_error e) {
-      printf("\nCannot open file: %s\n", filename);
-      ::exit(1);
-   }
+class TimerDevice : public Device
+{
+public:
+   TimerDevice(unsigned int pomperiod, bool pomnmi, uint8_t pomvector);
+   uint8_t Read(uint16_t address);
+   void Write(uint16_t address, uint8_t data);
+   void Clock(unsigned int cycle);
+   uint8_t Acknowledge() { intrequest = false; return vector; }
+   uint32_t State() { return ticks << 8 | countdown << 2 | intrequest << 1 | nmirequest; }
+   unsigned int period, countdown, ticks;
+   bool nmi;
+   uint8_t vector;
+};
+
+TimerDevice::TimerDevice(unsigned int pomperiod, bool pomnmi, uint8_t pomvector) : Device("timer")
+{
+   period = countdown = pomperiod;
+   ticks = 0;
+   nmi = pomnmi;
+   vector = pomvector;
 }
 
+uint8_t TimerDevice::Read(uint16_t)
+{
+   intrequest = false;
+   return ticks;
+}
 
-// routes the signal thru all the layers - necessary for numbering the signals
-void RouteSignal(int x, int y, int sig_num, int layer)
+void TimerDevice::Write(uint16_t, uint8_t)
 {
-   stack_x[0] = x;
-   stack_y[0] = y;
-   stack_layer[0] = layer;
-   int stack_ptr = 1;
+   intrequest = false;
+}
 
-   while (stack_ptr > 0) {
+void TimerDevice::Clock(unsigned int)
+{
+   nmirequest = false;
+   if (--countdown)
+      return;
+   countdown = period;
+   ticks++;
+   if (nmi)
+      nmirequest = true;
+   else
+      intrequest = true;
+}
 
-      stack_ptr--;
-      x = stack_x[stack_ptr];
-      y = stack_y[stack_ptr];
-      layer = stack_layer[stack_ptr];
+class Bus
+{
+public:
+   Bus();
+   ~Bus();
+   bool Add(const char *spec, OutputStream *console);
+   void Setup(const vector<string> &specs, OutputStream *console);
+   uint8_t Read(bool io, uint16_t address);
+   uint8_t Acknowledge();
+   void EndRead();
+   void Write(bool io, uint16_t address, uint8_t data);
+   void EndWrite();
+   void Clock(unsigned int cycle);
+   void UpdateLines();
+   uint64_t Hash(uint64_t pomhash);
+   void PrintSummary();
+   Device *pages[256], *iomap[256];
+   vector<Device *> devices;
+   bool latched, pending; // a read value is latched, a write waits for the strobe to go up
+   bool latchio, latchack, pendingio;
+   uint16_t latchaddress, pendingaddress;
+   uint8_t latchdata, pendingdata;
+   bool intline, nmiline, waitline;
+};
 
-      switch (layer) {
-      case METAL:
-         if (!(pombuf[y * size_x + x] & METAL)) {
-            continue;
-         }
-         break;
-      case POLYSILICON:
-         if (!(pombuf[y * size_x + x] & POLYSILICON)) {
-            continue;
-         }
-         break;
-      case DIFFUSION:
-         if (!(pombuf[y * size_x + x] & REAL_DIFFUSION)) {
-            continue;
-         }
-         break;
-      }
+Bus::Bus()
+{
+   for (int k = 0; k < 256; k++)
+      pages[k] = iomap[k] = NULL;
+   latched = pending = latchio = latchack = pendingio = false;
+   latchaddress = pendingaddress = 0;
+   latchdata = pendingdata = 0;
+   intline = nmiline = waitline = false;
+}
 
-      int pomsig = 0;
-      switch (layer) {
-      case METAL:
-         pomsig = signals_metal[y * size_x + x];
-         break;
-      case POLYSILICON:
-         pomsig = signals_poly[y * size_x + x];
-         break;
-      case DIFFUSION:
-         pomsig = signals_diff[y * size_x + x];
-         break;
-      }
-      if (pomsig) {
-         if (pomsig != sig_num) {
-            if (verbous) {
-               printf("Signal mismatch %d vs %d at %d, %d\n", sig_num, pomsig, x, y);
-            }
-         }
-         continue;
-      }
+Bus::~Bus()
+{
+   for (unsigned int k = 0; k < devices.size(); k++)
+      delete devices[k];
+}
 
-      switch (layer) {
-      case METAL:
-         signals_metal[y * size_x + x] = sig_num;
-         break;
-      case POLYSILICON:
-         signals_poly[y * size_x + x] = sig_num;
-         break;
-      case DIFFUSION:
-         signals_diff[y * size_x + x] = sig_num;
+bool Bus::Add(const char *spec, OutputStream *console)
+{
+   unsigned int pomfirst, pomlast, pomport, pomperiod;
+   char pomnmi[8] = "";
+   if (sscanf(spec, "ram:%x-%x", &pomfirst, &pomlast) == 2 || sscanf(spec, "rom:%x-%x", &pomfirst, &pomlast) == 2)
+   {
+      if (pomfirst > pomlast || pomlast > 0xffff || (pomfirst & 0xff) || (pomlast & 0xff) != 0xff)
+         return false;
+      if (spec[1] == 'a')
+         devices.push_back(new RamDevice());
+      else
+         devices.push_back(new RomDevice());
+      for (unsigned int p = pomfirst >> 8; p <= pomlast >> 8; p++)
+         pages[p] = devices.back();
+      return true;
+   }
+   if (sscanf(spec, "console:%x", &pomport) == 1)
+   {
+      if (pomport > 0xff)
+         return false;
+      devices.push_back(new ConsoleDevice(console));
+      iomap[pomport] = devices.back();
+      return true;
+   }
+   if (sscanf(spec, "timer:%x:%u:%7s", &pomport, &pomperiod, pomnmi) >= 2)
+   {
+      unsigned int pomvector = 0xff;
+      if (pomport > 0xff || !pomperiod || (pomnmi[0] && strcmp(pomnmi, "nmi") && (sscanf(pomnmi, "%x", &pomvector) != 1 || pomvector > 0xff)))
+         return false;
+      devices.push_back(new TimerDevice(pomperiod, !strcmp(pomnmi, "nmi"), pomvector));
+      iomap[pomport] = devices.back();
+      return true;
+   }
+   return false;
+}
+
+void Bus::Setup(const vector<string> &specs, OutputStream *console)
+{
+   Add("ram:0000-ffff", console);
+   devices.push_back(new PortDevice());
+   for (int k = 0; k < 256; k++)
+      iomap[k] = devices.back();
+   Add("console:00", console);
+   for (unsigned int k = 0; k < specs.size(); k++)
+      if (!Add(specs[k].c_str(), console))
+         printf("Wrong device %s (ram:ssss-eeee, rom:ssss-eeee on whole pages, console:pp, timer:pp:cycles[:nmi|:vv]).\n", specs[k].c_str());
+}
+
+uint8_t Bus::Read(bool io, uint16_t address)
+{
+   if (latched && !latchack && latchio == io && latchaddress == address)
+      return latchdata;
+   Device *pomdevice = io ? iomap[address & 0xff] : pages[address >> 8];
+   latchdata = pomdevice ? pomdevice->Read(address) : 0xff;
+   if (pomdevice)
+      pomdevice->reads++;
+   latched = true;
+   latchack = false;
+   latchio = io;
+   latchaddress = address;
+   UpdateLines();
+   return latchdata;
+}
+
+// interrupt acknowledge - the vector of the first device asking for _INT, once per cycle
+uint8_t Bus::Acknowledge()
+{
+   if (latched && latchack)
+      return latchdata;
+   latchdata = 0xff;
+   for (unsigned int k = 0; k < devices.size(); k++)
+   {
+      if (devices[k]->intrequest)
+      {
+         latchdata = devices[k]->Acknowledge();
          break;
       }
+   }
+   latched = latchack = true;
+   UpdateLines();
+   return latchdata;
+}
 
-      for (int i = 0; i < 4; i++) {
-         int nx;
-         int ny;
-         switch (i) {
-         case 0: nx = x - 1; ny = y    ; break;
-         case 1: nx = x    ; ny = y - 1; break;
-         case 2: nx = x + 1; ny = y    ; break;
-         case 3: nx = x    ; ny = y + 1; break;
-         }
-         if (nx >= 0 && nx < size_x && ny >= 0 && ny < size_y) {
-            if (stack_ptr < FILL_STACK_SIZE) {
-               stack_x[stack_ptr] = nx;
-               stack_y[stack_ptr] = ny;
-               stack_layer[stack_ptr] = layer;
-               stack_ptr++;
-            } else {
-               printf("Fill stack overflow in RouteSignal()\n");
-               ::exit(1);
-            }
-         }
+void Bus::EndRead()
+{
+   latched = false;
+}
+
+void Bus::Write(bool io, uint16_t address, uint8_t data)
+{
+   if (pending && (pendingio != io || pendingaddress != address))
+      EndWrite();
+   pending = true;
+   pendingio = io;
+   pendingaddress = address;
+   pendingdata = data;
+}
+
+void Bus::EndWrite()
+{
+   if (!pending)
+      return;
+   pending = false;
+   Device *pomdevice = pendingio ? iomap[pendingaddress & 0xff] : pages[pendingaddress >> 8];
+   if (!pomdevice)
+      return;
+   pomdevice->Write(pendingaddress, pendingdata);
+   pomdevice->writes++;
+   UpdateLines();
+}
+
+void Bus::Clock(unsigned int cycle)
+{
+   for (unsigned int k = 0; k < devices.size(); k++)
+      devices[k]->Clock(cycle);
+   UpdateLines();
+}
+
+void Bus::UpdateLines()
+{
+   intline = nmiline = waitline = false;
+   for (unsigned int k = 0; k < devices.size(); k++)
+   {
+      intline |= devices[k]->intrequest;
+      nmiline |= devices[k]->nmirequest;
+      waitline |= devices[k]->waitrequest;
+   }
+}
+
+uint64_t Bus::Hash(uint64_t pomhash)
+{
+   uint32_t pomstate[] = { pending, pendingio, pendingaddress, pendingdata };
+   for (unsigned int k = 0; k < sizeof(pomstate) / sizeof(pomstate[0]); k++)
+      pomhash = (pomhash ^ pomstate[k]) * 1099511628211ULL;
+   for (unsigned int k = 0; k < devices.size(); k++)
+      pomhash = (pomhash ^ devices[k]->State()) * 1099511628211ULL;
+   return pomhash;
+}
+
+void Bus::PrintSummary()
+{
+   for (unsigned int k = 0; k < devices.size(); k++)
+      if (devices[k]->reads || devices[k]->writes)
+         printf("Device %s: %" PRIu64 " reads, %" PRIu64 " writes\n", devices[k]->name, devices[k]->reads, devices[k]->writes);
+}
+
+Bus bus;
+
+// the bus and the devices alone, without the chip - accesses per second thru the page tables
+int BenchmarkBus(unsigned int accesses, const vector<string> &specs)
+{
+   bus.Setup(specs, NULL);
+   uint32_t pomrandom = 12345;
+   uint32_t pomsum = 0;
+   int64_t pomstart = GetTickCount();
+   for (unsigned int k = 0; k < accesses; k++)
+   {
+      pomrandom = pomrandom * 1664525 + 1013904223;
+      bool pomio = !(pomrandom & 0x0f000000);
+      uint16_t pomaddress = pomrandom >> 8;
+      if (pomrandom & 0x80000000)
+      {
+         bus.Write(pomio, pomaddress, pomrandom);
+         bus.EndWrite();
+      }
+      else
+      {
+         pomsum += bus.Read(pomio, pomaddress);
+         bus.EndRead();
+      }
+      if (!(k & 0xff))
+         bus.Clock(k >> 8);
+   }
+   int64_t pomduration = GetTickCount() - pomstart;
+   printf("Bus: %u accesses in %" PRId64 "ms, %.1f million accesses per second (checksum %02x)\n", accesses, pomduration,
+      accesses / 1000.0 / double(pomduration ? pomduration : 1), pomsum & 0xff);
+   bus.PrintSummary();
+   return 0;
+}
+
+// High fan-out nets - the clock and the buses reach hundreds of terminals, the threads homogenize them together
+// by chunks (see LARGESIGNAL), here is just the report of where the dense engine spends its work
+
+#define FANOUTBINS 12 // 1, 2-3, 4-7 .. 1024-2047, 2048 and more
+#define FANOUTTOP 8
+
+// transistors which scatter into the whole signal when they are on - pull-ups to their source, pull-downs to their drain
+int ScatterSignal(const Transistor &pomtran)
+{
+   if (pomtran.origdrain == SIG_VCC && pomtran.origsource > SIG_VCC)
+      return pomtran.origsource;
+   if (pomtran.origsource == SIG_GND && pomtran.origdrain > SIG_VCC)
+      return pomtran.origdrain;
+   return -1;
+}
+
+bool CompareFanoutDown(unsigned int a, unsigned int b)
+{
+   return signals[a].connections.size() > signals[b].connections.size();
+}
+
+// histogram of the fan-out and the nets with the largest one - the terminal updates of the dense engine per iteration
+// are 2 per terminal for the homogenization and the fan-out for every pull-up / pull-down which scatters into the net
+void PrintFanout()
+{
+   unsigned int pomnets[FANOUTBINS] = { 0 }, pomterminals[FANOUTBINS] = { 0 };
+   vector<unsigned int> pomscatters(signals.size(), 0);
+   for (unsigned int t = 0; t < transistors.size(); t++)
+      if (ScatterSignal(transistors[t]) >= 0)
+         pomscatters[ScatterSignal(transistors[t])]++;
+
+   uint64_t pomtotal = 0, pomallterminals = 0;
+   vector<unsigned int> pomorder;
+   for (unsigned int i = 0; i < signals.size(); i++)
+   {
+      unsigned int pomfanout = signals[i].connections.size();
+      if (signals[i].ignore || !pomfanout)
+         continue;
+      unsigned int pombin = 0;
+      while (pombin + 1 < FANOUTBINS && (2u << pombin) <= pomfanout)
+         pombin++;
+      pomnets[pombin]++;
+      pomterminals[pombin] += pomfanout;
+      pomallterminals += pomfanout;
+      pomtotal += uint64_t(pomfanout) * (2 + pomscatters[i]);
+      pomorder.push_back(i);
+   }
+
+   printf("Fan-out histogram (without VCC and GND):\n");
+   for (unsigned int b = 0; b < FANOUTBINS; b++)
+   {
+      if (!pomnets[b])
+         continue;
+      if (b + 1 == FANOUTBINS)
+         printf("  %4u+     : %5u nets, %5.1f%% of the terminals\n", 1u << b, pomnets[b], 100.0 * pomterminals[b] / pomallterminals);
+      else
+         printf("  %4u-%-4u : %5u nets, %5.1f%% of the terminals\n", 1u << b, (2u << b) - 1, pomnets[b], 100.0 * pomterminals[b] / pomallterminals);
+   }
+
+   std::sort(pomorder.begin(), pomorder.end(), CompareFanoutDown);
+   printf("Largest nets (share of the terminal updates of the dense engine per iteration):\n");
+   for (unsigned int k = 0; k < FANOUTTOP && k < pomorder.size(); k++)
+   {
+      unsigned int i = pomorder[k];
+      uint64_t pomupdates = uint64_t(signals[i].connections.size()) * (2 + pomscatters[i]);
+      printf("  signal %5u%s: fan-out %4u, %3u pull-ups / pull-downs, %5.1f%%\n", i, (i < FIRST_SIGNAL) ? " (pad)" : "      ",
+         (unsigned int) signals[i].connections.size(), pomscatters[i], 100.0 * pomupdates / pomtotal);
+   }
+}
+
+// time of the work on the FANOUTTOP largest nets - their homogenization and Simulate() of the transistors scattering into them
+uint64_t TimeTopNets(unsigned int iterations)
+{
+   vector<unsigned int> pomorder;
+   for (unsigned int i = 0; i < signals.size(); i++)
+      if (!signals[i].ignore && signals[i].connections.size())
+         pomorder.push_back(i);
+   std::sort(pomorder.begin(), pomorder.end(), CompareFanoutDown);
+   pomorder.resize(min((unsigned int) pomorder.size(), (unsigned int) FANOUTTOP));
+
+   vector<unsigned int> pomscatterers;
+   for (unsigned int t = 0; t < transistors.size(); t++)
+      if (std::find(pomorder.begin(), pomorder.end(), (unsigned int) ScatterSignal(transistors[t])) != pomorder.end())
+         pomscatterers.push_back(t);
+
+   uint64_t pomduration = GetTickCount();
+   for (unsigned int i = 0; i < iterations; i++)
+   {
+      for (unsigned int t = 0; t < pomscatterers.size(); t++)
+         transistors[pomscatterers[t]].Simulate();
+      for (unsigned int k = 0; k < pomorder.size(); k++)
+         signals[pomorder[k]].Homogenize();
+   }
+   return GetTickCount() - pomduration;
+}
+
+#define LARGESIGNAL 128 // signals with more connections (i.e. clock) are homogenized by all threads together
+#define SIGNALCHUNK 64 // each thread takes chunks of this many connections of such signal
+
+// chunk of a large signal - the charge of the signal is the sum of its chunks taken always in the same order
+class SignalChunk
+{
+public:
+   SignalChunk();
+   int signal;
+   unsigned int first, last;
+   unsigned int firstchunk, lastchunk;
+   float charge;
+};
+
+SignalChunk::SignalChunk()
+{
+   signal = 0;
+   first = last = firstchunk = lastchunk = 0;
+   charge = 0.0f;
+}
+
+vector<SignalChunk> largechunks;
+vector<vector<unsigned int> > threadsignals; // small signals homogenized by the respective thread
+
+bool CompareFanout(unsigned int a, unsigned int b)
+{
+   if (signals[a].connections.size() != signals[b].connections.size())
+      return signals[a].connections.size() > signals[b].connections.size();
+   return a < b;
+}
+
+// splits the homogenization among the threads of the pool - large signals are cut to chunks taken round robin,
+// small signals are dealt from the largest one always to the least loaded thread so that every thread
+// gets about the same number of connections
+// a signal is always summed the same way so the result does not depend on the number of threads
+void BuildSignalPartitions()
+{
+   threadsignals.assign(pool.count, vector<unsigned int>());
+   largechunks.clear();
+   vector<unsigned int> load(pool.count, 0);
+   vector<unsigned int> smallsignals;
+
+   for (unsigned int i = 0; i < signals.size(); i++)
+   {
+      if (signals[i].ignore)
+         continue;
+      unsigned int pomsize = signals[i].connections.size();
+      if (pomsize > LARGESIGNAL)
+      {
+         unsigned int firstchunk = largechunks.size();
+         for (unsigned int first = 0; first < pomsize; first += SIGNALCHUNK)
+         {
+            SignalChunk pomchunk;
+            pomchunk.signal = i;
+            pomchunk.first = first;
+            pomchunk.last = std::min(first + SIGNALCHUNK, pomsize);
+            pomchunk.firstchunk = firstchunk;
+            largechunks.push_back(pomchunk);
+         }
+         for (unsigned int k = firstchunk; k < largechunks.size(); k++)
+            largechunks[k].lastchunk = largechunks.size();
+      }
+      else
+      {
+         smallsignals.push_back(i);
+      }
+   }
+
+   for (unsigned int k = 0; k < largechunks.size(); k++)
+      load[k % pool.count] += largechunks[k].last - largechunks[k].first;
+
+   std::sort(smallsignals.begin(), smallsignals.end(), CompareFanout);
+   for (unsigned int i = 0; i < smallsignals.size(); i++)
+   {
+      unsigned int t = std::min_element(load.begin(), load.end()) - load.begin();
+      threadsignals[t].push_back(smallsignals[i]);
+      load[t] += signals[smallsignals[i]].connections.size() + 1;
+   }
+
+   // going thru the signals in order is kinder to the cache
+   for (unsigned int t = 0; t < pool.count; t++)
+      std::sort(threadsignals[t].begin(), threadsignals[t].end());
+}
+
+void StartThreads(unsigned int count)
+{
+   pool.Start(count);
+   BuildSignalPartitions();
+}
+
+// homogenizes the share of signals of the thread - large signals are first summed by chunks
+// and after all threads are done the sum of the chunks is spread back
+void HomogenizeSignals(unsigned int id, bool normalize)
+{
+   vector<unsigned int> &pomsignals = threadsignals[id];
+   for (unsigned int j = 0; j < pomsignals.size(); j++)
+   {
+      if (normalize)
+         signals[pomsignals[j]].HomogenizeNormalize();
+      else
+         signals[pomsignals[j]].Homogenize();
+   }
+
+   for (unsigned int k = id; k < largechunks.size(); k += pool.count)
+      largechunks[k].charge = signals[largechunks[k].signal].SumCharge(largechunks[k].first, largechunks[k].last);
+
+   pool.Barrier();
+
+   for (unsigned int k = id; k < largechunks.size(); k += pool.count)
+   {
+      float pomcharge = 0.0f;
+      for (unsigned int c = largechunks[k].firstchunk; c < largechunks[k].lastchunk; c++)
+         pomcharge += largechunks[c].charge;
+      signals[largechunks[k].signal].SpreadCharge(pomcharge, largechunks[k].first, largechunks[k].last, normalize);
+   }
+}
+
+// homogenization and normalization of the dense engine - Simulate() moves the charge in place so it stays serial
+// with one thread every signal is summed in one pass as ever, so the dense engine stays the reference
+void DenseHomogenizeNormalize(unsigned int id)
+{
+   if (pool.count == 1)
+   {
+      for (unsigned int j = 0; j < signals.size(); j++)
+         if (!signals[j].ignore)
+            signals[j].Homogenize();
+   }
+   else
+      HomogenizeSignals(id, false);
+
+   pool.Barrier();
+
+   unsigned int first = transistors.size() * id / pool.count;
+   unsigned int last = transistors.size() * (id + 1) / pool.count;
+   for (unsigned int j = first; j < last; j++)
+      transistors[j].Normalize();
+}
+
+// one iteration of the threaded engine - every thread simulates its share of transistors from the state
+// of the previous iteration, waits for the others and then homogenizes its share of signals
+// every transistor and every signal is always computed the same way in the same order,
+// so the result is bit identical for any number of threads
+void ThreadedIteration(unsigned int id)
+{
+   unsigned int first = transistors.size() * id / pool.count;
+   unsigned int last = transistors.size() * (id + 1) / pool.count;
+   for (unsigned int j = first; j < last; j++)
+      transistors[j].SimulateLocal();
+
+   pool.Barrier();
+
+   HomogenizeSignals(id, true);
+}
+
+// Fused engine - the threaded engine in one pass. The charges of the terminals are kept in one array ordered
+// by signal. The pass goes thru the signals in order, at each signal it first does SimulateLocal() of the transistors
+// whose first signal it is (their other signals come later, so all their terminals are still as the previous
+// iteration left them) and then sums the terminals of the signal, spreads the sum back and clamps it while it is
+// in registers. Every terminal is read and written once per iteration, the result is bit identical to the threaded
+// engine (large signals are summed by SIGNALCHUNK as there).
+
+class FusedDevice
+{
+public:
+   FusedDevice();
+   unsigned int gateslot, sourceslot, drainslot;
+   int gate, source, drain; // signals as extracted - nodemap says where the pads drive them
+   float area, resist, pomchargetogo;
+   bool depletion, hassource, hasdrain;
+};
+
+FusedDevice::FusedDevice()
+{
+   gateslot = sourceslot = drainslot = 0;
+   gate = source = drain = 0;
+   area = resist = pomchargetogo = 0.0f;
+   depletion = hassource = hasdrain = false;
+}
+
+vector<FusedDevice> fuseddevices;
+vector<unsigned int> fuseddevicestarts; // devices simulated at signal s are fuseddevices[fuseddevicestarts[s]] .. [fuseddevicestarts[s + 1] - 1]
+vector<unsigned int> fusedstarts; // terminals of signal s are fusedcharge[fusedstarts[s]] .. [fusedstarts[s + 1] - 1]
+vector<float> fusedproportion, fusedarea;
+vector<uint8_t> fusedhomogenize;
+
+void BuildFusedNetlist()
+{
+   fusedslots.assign(3 * transistors.size(), 0xffffffff);
+   fusedstarts.resize(signals.size() + 1);
+   fusedproportion.clear();
+   fusedarea.clear();
+   fusedhomogenize.resize(signals.size());
+   for (unsigned int i = 0; i < signals.size(); i++)
+   {
+      fusedstarts[i] = fusedproportion.size();
+      fusedhomogenize[i] = !signals[i].ignore;
+      for (unsigned int j = 0; j < signals[i].connections.size(); j++)
+      {
+         const Connection &pomconn = signals[i].connections[j];
+         fusedslots[3 * pomconn.index + pomconn.terminal - 1] = fusedproportion.size();
+         fusedproportion.push_back(pomconn.proportion);
+         fusedarea.push_back(transistors[pomconn.index].area);
+      }
+   }
+   fusedstarts[signals.size()] = fusedproportion.size();
+
+   // terminals missing in the connections of their signal get a slot of their own which is never homogenized
+   for (unsigned int k = 0; k < fusedslots.size(); k++)
+   {
+      if (fusedslots[k] != 0xffffffff)
+         continue;
+      fusedslots[k] = fusedproportion.size();
+      fusedproportion.push_back(0.0f);
+      fusedarea.push_back(transistors[k / 3].area);
+   }
+   fusedcharge.assign(fusedproportion.size(), 0.0f);
+
+   // transistors get sorted by their first signal which gets homogenized
+   vector<unsigned int> pomfirst(transistors.size(), 0);
+   fuseddevicestarts.assign(signals.size() + 1, 0);
+   for (unsigned int t = 0; t < transistors.size(); t++)
+   {
+      int terminals[3] = { transistors[t].origgate, transistors[t].origsource, transistors[t].origdrain };
+      unsigned int pomsignal = 0xffffffff;
+      for (int k = 0; k < 3; k++)
+         if (!signals[terminals[k]].ignore)
+            pomsignal = min(pomsignal, (unsigned int) terminals[k]);
+      pomfirst[t] = (pomsignal == 0xffffffff) ? 0 : pomsignal;
+      fuseddevicestarts[pomfirst[t] + 1]++;
+   }
+   for (unsigned int i = 0; i < signals.size(); i++)
+      fuseddevicestarts[i + 1] += fuseddevicestarts[i];
+
+   fuseddevices.resize(transistors.size());
+   vector<unsigned int> pomnext(fuseddevicestarts.begin(), fuseddevicestarts.end() - 1);
+   for (unsigned int t = 0; t < transistors.size(); t++)
+   {
+      const Transistor &pomtran = transistors[t];
+      FusedDevice &pomdevice = fuseddevices[pomnext[pomfirst[t]]++];
+      pomdevice.gateslot = fusedslots[3 * t + GATE - 1];
+      pomdevice.sourceslot = fusedslots[3 * t + SOURCE - 1];
+      pomdevice.drainslot = fusedslots[3 * t + DRAIN - 1];
+      pomdevice.gate = pomtran.origgate;
+      pomdevice.source = pomtran.origsource;
+      pomdevice.drain = pomtran.origdrain;
+      pomdevice.area = pomtran.area;
+      pomdevice.resist = pomtran.resist;
+      pomdevice.pomchargetogo = pomtran.pomchargetogo;
+      pomdevice.depletion = pomtran.depletion;
+      pomdevice.hassource = pomtran.sourceconnections.size() != 0;
+      pomdevice.hasdrain = pomtran.drainconnections.size() != 0;
+   }
+}
+
+// the same as Transistor::SimulateLocal() on the slots of the transistor
+inline void SimulateFusedDevice(const FusedDevice &pomdevice, float *pomcharge)
+{
+   float gatecharge = pomcharge[pomdevice.gateslot];
+   if (nodemap[pomdevice.gate] == SIG_GND)
+      gatecharge = pomcharge[pomdevice.gateslot] = 0.0f;
+   else if (nodemap[pomdevice.gate] == SIG_VCC)
+      gatecharge = pomcharge[pomdevice.gateslot] = pomdevice.area;
+
+   if (!pomdevice.depletion && !(gatecharge > 0.0f))
+      return;
+
+   if (nodemap[pomdevice.drain] == SIG_VCC)
+   {
+      float chargetogo = pomdevice.pomchargetogo;
+      if (!pomdevice.depletion)
+         chargetogo *= gatecharge / pomdevice.area;
+      chargetogo /= PULLUPDEFLATOR;
+
+      if (pomdevice.hassource)
+         pomcharge[pomdevice.sourceslot] += chargetogo;
+   }
+   else if (nodemap[pomdevice.source] == SIG_GND)
+   {
+      float chargetogo = pomdevice.pomchargetogo;
+      if (!pomdevice.depletion)
+         chargetogo *= gatecharge / pomdevice.area;
+
+      if (pomdevice.hasdrain)
+         pomcharge[pomdevice.drainslot] -= chargetogo;
+   }
+   else
+   {
+      float pomsourcecharge = pomcharge[pomdevice.sourceslot];
+      if (pomsourcecharge > 0.0f)
+         pomsourcecharge /= PULLUPDEFLATOR;
+
+      float pomdraincharge = pomcharge[pomdevice.drainslot];
+      if (pomdraincharge > 0.0f)
+         pomdraincharge /= PULLUPDEFLATOR;
+
+      float chargetogo = ((pomsourcecharge - pomdraincharge) / pomdevice.resist) / PULLUPDEFLATOR;
+      float pomsign = 1.0;
+      if (chargetogo < 0.0f)
+      {
+         pomsign = -1.0;
+         chargetogo = -chargetogo;
+      }
+      if (chargetogo > MAXQUANTUM)
+         chargetogo = MAXQUANTUM;
+      if (!pomdevice.depletion)
+         chargetogo *= gatecharge / pomdevice.area;
+      chargetogo *= pomsign;
+
+      pomcharge[pomdevice.sourceslot] -= chargetogo;
+      pomcharge[pomdevice.drainslot] += chargetogo;
+   }
+}
+
+void FusedIteration()
+{
+   float *pomcharge = &fusedcharge[0];
+   const float *pomproportion = &fusedproportion[0];
+   const float *pomarea = &fusedarea[0];
+   for (unsigned int i = 0; i < signals.size(); i++)
+   {
+      for (unsigned int d = fuseddevicestarts[i]; d < fuseddevicestarts[i + 1]; d++)
+         SimulateFusedDevice(fuseddevices[d], pomcharge);
+
+      if (!fusedhomogenize[i])
+         continue;
+      unsigned int first = fusedstarts[i], last = fusedstarts[i + 1];
+      float pomsum = 0.0f;
+      if (last - first > LARGESIGNAL)
+      {
+         for (unsigned int chunk = first; chunk < last; chunk += SIGNALCHUNK)
+         {
+            float pomchunk = 0.0f;
+            for (unsigned int k = chunk; k < std::min(chunk + SIGNALCHUNK, last); k++)
+               pomchunk += pomcharge[k];
+            pomsum += pomchunk;
+         }
+      }
+      else
+      {
+         for (unsigned int k = first; k < last; k++)
+            pomsum += pomcharge[k];
+      }
+      for (unsigned int k = first; k < last; k++)
+      {
+         float pomvalue = pomsum * pomproportion[k];
+         if (pomvalue < -pomarea[k])
+            pomvalue = -pomarea[k];
+         if (pomvalue > pomarea[k])
+            pomvalue = pomarea[k];
+         pomcharge[k] = pomvalue;
+      }
+   }
+}
+
+// Colored engine - Simulate() moves the charge in place to the terminals on the source / drain signal of the
+// transistor, so two transistors conflict when one of them can write a signal the other one has a terminal on.
+// The conflict graph gets colored greedily (largest degree first), the classes get balanced and then the engine
+// runs one class after another with the transistors of the class in parallel - no races and no delta buffers.
+// The order differs from the dense engine, but it is the same for any number of threads.
+
+vector< vector<unsigned int> > colorclasses;
+
+// cost of Simulate() of the transistor - pull-ups and pull-downs spread the charge over the whole signal
+inline unsigned int ColorWeight(unsigned int t)
+{
+   return 1 + transistors[t].sourceconnections.size() + transistors[t].drainconnections.size();
+}
+
+void BuildColoring()
+{
+   unsigned int count = transistors.size();
+
+   // every transistor is a member of the signals of its terminals and can write the signals of its source and drain
+   // (the pads can turn it into a pull-up or pull-down any time), VCC and GND are never homogenized
+   vector< vector<unsigned int> > members(signals.size()), writers(signals.size());
+   for (unsigned int t = 0; t < count; t++)
+   {
+      int terminals[3] = { transistors[t].origgate, transistors[t].origsource, transistors[t].origdrain };
+      for (int k = 0; k < 3; k++)
+      {
+         if (terminals[k] == SIG_VCC || terminals[k] == SIG_GND)
+            continue;
+         if (members[terminals[k]].empty() || members[terminals[k]].back() != t)
+            members[terminals[k]].push_back(t);
+         if (k > 0 && (writers[terminals[k]].empty() || writers[terminals[k]].back() != t))
+            writers[terminals[k]].push_back(t);
+      }
+   }
+
+   vector< vector<unsigned int> > conflicts(count);
+   for (unsigned int s = 0; s < signals.size(); s++)
+   {
+      for (unsigned int w = 0; w < writers[s].size(); w++)
+      {
+         for (unsigned int m = 0; m < members[s].size(); m++)
+         {
+            if (writers[s][w] == members[s][m])
+               continue;
+            conflicts[writers[s][w]].push_back(members[s][m]);
+            conflicts[members[s][m]].push_back(writers[s][w]);
+         }
+      }
+   }
+   for (unsigned int t = 0; t < count; t++)
+   {
+      std::sort(conflicts[t].begin(), conflicts[t].end());
+      conflicts[t].erase(std::unique(conflicts[t].begin(), conflicts[t].end()), conflicts[t].end());
+   }
+
+   vector<unsigned int> order(count);
+   for (unsigned int t = 0; t < count; t++)
+      order[t] = t;
+   std::stable_sort(order.begin(), order.end(), [&conflicts](unsigned int a, unsigned int b) { return conflicts[a].size() > conflicts[b].size(); });
+
+   // greedy coloring - the smallest color none of the neighbours has
+   vector<int> color(count, -1);
+   vector<unsigned int> used;
+   unsigned int colors = 0;
+   for (unsigned int o = 0; o < count; o++)
+   {
+      unsigned int t = order[o];
+      used.assign(colors + 1, 0);
+      for (unsigned int n = 0; n < conflicts[t].size(); n++)
+         if (color[conflicts[t][n]] >= 0)
+            used[color[conflicts[t][n]]] = 1;
+      unsigned int c = 0;
+      while (used[c])
+         c++;
+      color[t] = c;
+      colors = max(colors, c + 1);
+   }
+
+   // balancing - transistors of the heavier classes move to the lightest class none of their neighbours is in
+   vector<unsigned int> load(colors, 0);
+   unsigned int total = 0;
+   for (unsigned int t = 0; t < count; t++)
+   {
+      load[color[t]] += ColorWeight(t);
+      total += ColorWeight(t);
+   }
+   unsigned int target = (total + colors - 1) / colors;
+   for (unsigned int t = 0; t < count; t++)
+   {
+      if (load[color[t]] <= target)
+         continue;
+      used.assign(colors, 0);
+      for (unsigned int n = 0; n < conflicts[t].size(); n++)
+         used[color[conflicts[t][n]]] = 1;
+      int best = -1;
+      for (unsigned int c = 0; c < colors; c++)
+         if (!used[c] && load[c] + ColorWeight(t) <= target && (best < 0 || load[c] < load[best]))
+            best = c;
+      if (best < 0)
+         continue;
+      load[color[t]] -= ColorWeight(t);
+      load[best] += ColorWeight(t);
+      color[t] = best;
+   }
+
+   colorclasses.assign(colors, vector<unsigned int>());
+   for (unsigned int t = 0; t < count; t++)
+      colorclasses[color[t]].push_back(t);
+}
+
+void PrintColoring()
+{
+   unsigned int total = 0, largest = 0, heaviest = 0;
+   for (unsigned int c = 0; c < colorclasses.size(); c++)
+   {
+      unsigned int pomload = 0;
+      for (unsigned int j = 0; j < colorclasses[c].size(); j++)
+         pomload += ColorWeight(colorclasses[c][j]);
+      total += pomload;
+      largest = max(largest, (unsigned int) colorclasses[c].size());
+      heaviest = max(heaviest, pomload);
+   }
+   printf("Coloring: %u colors, largest class %u transistors, heaviest class %.2fx the average load\n", (unsigned int) colorclasses.size(),
+      largest, double(heaviest) * colorclasses.size() / double(total));
+   printf("Class sizes:");
+   for (unsigned int c = 0; c < colorclasses.size(); c++)
+      printf(" %u", (unsigned int) colorclasses[c].size());
+   printf("\n");
+}
+
+// one iteration of the colored engine - the classes one by one, every thread takes its share of each class
+void ColoredIteration(unsigned int id)
+{
+   for (unsigned int c = 0; c < colorclasses.size(); c++)
+   {
+      vector<unsigned int> &pomclass = colorclasses[c];
+      unsigned int first = pomclass.size() * id / pool.count;
+      unsigned int last = pomclass.size() * (id + 1) / pool.count;
+      for (unsigned int j = first; j < last; j++)
+         transistors[pomclass[j]].Simulate();
+
+      pool.Barrier();
+   }
+
+   DenseHomogenizeNormalize(id);
+}
+
+// transistor as seen by the node engine - just the nodes it connects and the constants, kept in one flat array
+class NodeDevice
+{
+public:
+   NodeDevice();
+   int gate, source, drain;
+   float area, resist, pomchargetogo;
+   int32_t fixedarea, fixedchargetogo, fixedconductance; // for the fixed point engine, conductance is 65536 / resist / PULLUPDEFLATOR
+   bool depletion;
+};
+
+NodeDevice::NodeDevice()
+{
+   gate = source = drain = 0;
+   area = resist = pomchargetogo = 0.0f;
+   fixedarea = fixedchargetogo = fixedconductance = 0;
+   depletion = false;
+}
+
+const NodeDevice *nodedevices = NULL; // points to nodedevicelist or into the netlist of the run farm
+unsigned int nodedevicecount = 0;
+vector<NodeDevice> nodedevicelist;
+
+// allocates the state of the node engines for the netlist nodedevices / nodearea / nodegatearea and nodecount nodes
+void SetupNodeState(unsigned int nodecount)
+{
+   nodecharge.assign(nodecount, 0.0f);
+   nodedelta.assign(nodecount, 0.0f);
+   nodemap.resize(nodecount);
+   for (unsigned int i = 0; i < nodecount; i++)
+      nodemap[i] = i;
+
+   nodefixed.assign(nodecount, 0);
+   nodefixeddelta.assign(nodecount, 0);
+   noderatio.assign(nodecount, 0);
+   nodefixedarea.resize(nodecount);
+   nodefixedgatearea.resize(nodecount);
+   nodekeep.resize(nodecount);
+   noderecip.resize(nodecount);
+   for (unsigned int i = 0; i < nodecount; i++)
+   {
+      // areas are whole pixels so they are exact in fixed point
+      nodefixedarea[i] = int32_t(nodearea[i]) * CHARGESCALE;
+      nodefixedgatearea[i] = int32_t(nodegatearea[i]) * CHARGESCALE;
+      noderecip[i] = nodefixedarea[i] ? (int64_t(1) << RECIPSHIFT) / nodefixedarea[i] : 0;
+      nodekeep[i] = nodefixedarea[i] ? int32_t((int64_t(nodefixedarea[i] - nodefixedgatearea[i]) << RATIOSHIFT) / nodefixedarea[i]) : 0;
+   }
+}
+
+// builds the node netlist from the extracted transistors and signals
+void BuildNodeNetlist()
+{
+   nodedevicelist.clear();
+   for (unsigned int i = 0; i < transistors.size(); i++)
+   {
+      Transistor &pomtran = transistors[i];
+      pomtran.origgate = pomtran.gate;
+      pomtran.origsource = pomtran.source;
+      pomtran.origdrain = pomtran.drain;
+
+      NodeDevice pomdevice;
+      pomdevice.gate = pomtran.gate;
+      pomdevice.source = pomtran.source;
+      pomdevice.drain = pomtran.drain;
+      pomdevice.area = pomtran.area;
+      pomdevice.resist = pomtran.resist;
+      pomdevice.pomchargetogo = pomtran.pomchargetogo;
+      pomdevice.fixedarea = int32_t(pomtran.area) * CHARGESCALE;
+      pomdevice.fixedchargetogo = int32_t(pomtran.pomchargetogo * CHARGESCALE + 0.5f);
+      pomdevice.fixedconductance = int32_t(65536.0 / (double(pomtran.resist) * double(PULLUPDEFLATOR)) + 0.5);
+      pomdevice.depletion = pomtran.depletion;
+      nodedevicelist.push_back(pomdevice);
+   }
+   nodedevices = &nodedevicelist[0];
+   nodedevicecount = nodedevicelist.size();
+
+   nodeareas.assign(signals.size(), 0.0f);
+   nodegateareas.assign(signals.size(), 0.0f);
+   for (unsigned int i = 0; i < signals.size(); i++)
+   {
+      nodeareas[i] = signals[i].signalarea;
+      for (unsigned int j = 0; j < signals[i].connections.size(); j++)
+         if (signals[i].connections[j].terminal == GATE)
+            nodegateareas[i] += transistors[signals[i].connections[j].index].area;
+   }
+   nodearea = &nodeareas[0];
+   nodegatearea = &nodegateareas[0];
+
+   SetupNodeState(signals.size());
+}
+
+// the same as Transistor::SimulateLocal() - the charge of a terminal is derived from the charge of its node
+// and the moved charge goes to nodedelta
+inline void SimulateNodeDevice(const NodeDevice &pomdevice)
+{
+   int pomgate = nodemap[pomdevice.gate];
+   float gatefactor; // i.e. gatecharge / area
+   if (pomgate == SIG_GND)
+      gatefactor = 0.0f;
+   else if (pomgate == SIG_VCC)
+      gatefactor = 1.0f;
+   else
+      gatefactor = nodecharge[pomdevice.gate] / nodearea[pomdevice.gate];
+
+   if (!pomdevice.depletion && gatefactor <= 0.0f)
+      return;
+
+   if (nodemap[pomdevice.drain] == SIG_VCC)
+   {
+      float chargetogo = pomdevice.pomchargetogo;
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+      chargetogo /= PULLUPDEFLATOR;
+
+      if (pomdevice.source > SIG_VCC)
+         nodedelta[pomdevice.source] += chargetogo;
+   }
+   else if (nodemap[pomdevice.source] == SIG_GND)
+   {
+      float chargetogo = pomdevice.pomchargetogo;
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+
+      if (pomdevice.drain > SIG_VCC)
+         nodedelta[pomdevice.drain] -= chargetogo;
+   }
+   else
+   {
+      float pomsourcecharge = nodecharge[pomdevice.source] * pomdevice.area / nodearea[pomdevice.source];
+      if (pomsourcecharge > 0.0f)
+         pomsourcecharge /= PULLUPDEFLATOR;
+
+      float pomdraincharge = nodecharge[pomdevice.drain] * pomdevice.area / nodearea[pomdevice.drain];
+      if (pomdraincharge > 0.0f)
+         pomdraincharge /= PULLUPDEFLATOR;
+
+      float chargetogo = ((pomsourcecharge - pomdraincharge) / pomdevice.resist) / PULLUPDEFLATOR;
+      if (chargetogo > MAXQUANTUM)
+         chargetogo = MAXQUANTUM;
+      if (chargetogo < -MAXQUANTUM)
+         chargetogo = -MAXQUANTUM;
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+
+      nodedelta[pomdevice.source] -= chargetogo;
+      nodedelta[pomdevice.drain] += chargetogo;
+   }
+}
+
+// pins the gates of the node when a pad drives it, adds the charge moved to the node and clamps it
+inline void ChargeNode(unsigned int j, float pomdelta)
+{
+   float pomcharge = nodecharge[j];
+   if (nodemap[j] == SIG_VCC)
+      pomcharge = pomcharge * (1.0f - nodegatearea[j] / nodearea[j]) + nodegatearea[j];
+   else if (nodemap[j] == SIG_GND)
+      pomcharge = pomcharge * (1.0f - nodegatearea[j] / nodearea[j]);
+   pomcharge += pomdelta * relaxation;
+
+   if (pomcharge < -nodearea[j])
+      pomcharge = -nodearea[j];
+   if (pomcharge > nodearea[j])
+      pomcharge = nodearea[j];
+   nodecharge[j] = pomcharge;
+}
+
+// takes the charge moved to the node in this iteration
+inline void UpdateNode(unsigned int j)
+{
+   if (nodearea[j] <= 0.0f)
+      return;
+
+   ChargeNode(j, nodedelta[j]);
+   nodedelta[j] = 0.0f;
+}
+
+// one iteration of the node engine - all devices move charge from the state of the previous iteration
+// (as the threaded engine does), then the nodes take it and get clamped like Normalize() does to terminals
+// the gates of a node driven by a pad are pinned to VCC / GND first, just like Simulate() does it
+void NodeIteration()
+{
+   for (unsigned int j = 0; j < nodedevicecount; j++)
+      SimulateNodeDevice(nodedevices[j]);
+
+   for (unsigned int j = 0; j < nodecharge.size(); j++)
+      if (!signals[j].ignore)
+         UpdateNode(j);
+}
+
+// successive over-relaxation - the charge a device moves gets taken by its nodes right away (Gauss-Seidel),
+// so the devices later in the sweep already see it, relaxation scales it up
+inline void RelaxNode(unsigned int j)
+{
+   if (nodedelta[j] == 0.0f)
+      return;
+   float pomcharge = nodecharge[j] + nodedelta[j] * relaxation;
+   nodedelta[j] = 0.0f;
+   if (pomcharge < -nodearea[j])
+      pomcharge = -nodearea[j];
+   if (pomcharge > nodearea[j])
+      pomcharge = nodearea[j];
+   nodecharge[j] = pomcharge;
+}
+
+void SorIteration()
+{
+   // the gates of the nodes driven by pads get pinned once per sweep
+   for (unsigned int p = 0; p < pads.size(); p++)
+      if (nodearea[pads[p].origsignal] > 0.0f)
+         ChargeNode(pads[p].origsignal, 0.0f);
+
+   for (unsigned int j = 0; j < nodedevicecount; j++)
+   {
+      const NodeDevice &pomdevice = nodedevices[j];
+      SimulateNodeDevice(pomdevice);
+      if (pomdevice.source > SIG_VCC && nodearea[pomdevice.source] > 0.0f)
+         RelaxNode(pomdevice.source);
+      if (pomdevice.drain > SIG_VCC && nodearea[pomdevice.drain] > 0.0f)
+         RelaxNode(pomdevice.drain);
+   }
+}
+
+// Multi-rate simulation - the nodes are split into regions joined by the channels of the devices (channel
+// connected components), a region is only coupled to the others thru the gates of its devices and the pads.
+// The node engine computes a region from its own charges, the charges of the gates and nodemap, so when none of these
+// changed in the previous iteration the region would come out exactly the same - such region is dormant and
+// gets frozen until a gate it reads or a pad driving it changes. The result is bit identical to the node engine.
+// -multirate verify runs the full node engine from the same state after every iteration and compares them.
+
+bool multirate = false;
+bool multirateverify = false;
+vector<unsigned int> regionstarts, regionnodes; // nodes of region r are regionnodes[regionstarts[r]] .. [regionstarts[r + 1] - 1]
+vector<unsigned int> regiondevicestarts, regiondevices;
+vector<unsigned int> listenerstarts, listeners; // regions which read node n as a gate are listeners[listenerstarts[n]] ..
+vector<unsigned int> noderegion;
+vector<uint8_t> regionactive, regionnext;
+vector<int> regionmap; // nodemap of the pad nodes as the last iteration saw it
+vector<uint64_t> regionsteps;
+uint64_t multirateiterations = 0, multiratemismatches = 0;
+
+unsigned int FindRegion(vector<unsigned int> &parent, unsigned int n)
+{
+   while (parent[n] != n)
+      n = parent[n] = parent[parent[n]];
+   return n;
+}
+
+void BuildRegions()
+{
+   unsigned int count = nodecharge.size();
+   vector<unsigned int> parent(count);
+   for (unsigned int n = 0; n < count; n++)
+      parent[n] = n;
+   for (unsigned int d = 0; d < nodedevicecount; d++)
+   {
+      if (nodedevices[d].source > SIG_VCC && nodedevices[d].drain > SIG_VCC)
+         parent[FindRegion(parent, nodedevices[d].source)] = FindRegion(parent, nodedevices[d].drain);
+   }
+
+   // regions get numbered by their lowest node
+   vector<unsigned int> pomnumber(count, 0xffffffff);
+   noderegion.assign(count, 0xffffffff);
+   unsigned int regions = 0;
+   for (unsigned int n = SIG_VCC + 1; n < count; n++)
+   {
+      if (signals[n].ignore)
+         continue;
+      unsigned int pomroot = FindRegion(parent, n);
+      if (pomnumber[pomroot] == 0xffffffff)
+         pomnumber[pomroot] = regions++;
+      noderegion[n] = pomnumber[pomroot];
+   }
+
+   vector< vector<unsigned int> > pomnodes(regions), pomdevices(regions), pomlisteners(count);
+   for (unsigned int n = SIG_VCC + 1; n < count; n++)
+      if (noderegion[n] != 0xffffffff)
+         pomnodes[noderegion[n]].push_back(n);
+   for (unsigned int d = 0; d < nodedevicecount; d++)
+   {
+      int pomnode = (nodedevices[d].source > SIG_VCC) ? nodedevices[d].source : nodedevices[d].drain;
+      if (pomnode <= SIG_VCC)
+         continue;
+      unsigned int r = noderegion[pomnode];
+      pomdevices[r].push_back(d);
+      int pomgate = nodedevices[d].gate;
+      if (pomgate > SIG_VCC && (pomlisteners[pomgate].empty() || pomlisteners[pomgate].back() != r))
+         pomlisteners[pomgate].push_back(r);
+   }
+
+   regionstarts.assign(1, 0);
+   regionnodes.clear();
+   regiondevicestarts.assign(1, 0);
+   regiondevices.clear();
+   for (unsigned int r = 0; r < regions; r++)
+   {
+      regionnodes.insert(regionnodes.end(), pomnodes[r].begin(), pomnodes[r].end());
+      regionstarts.push_back(regionnodes.size());
+      regiondevices.insert(regiondevices.end(), pomdevices[r].begin(), pomdevices[r].end());
+      regiondevicestarts.push_back(regiondevices.size());
+   }
+   listenerstarts.assign(1, 0);
+   listeners.clear();
+   for (unsigned int n = 0; n < count; n++)
+   {
+      std::sort(pomlisteners[n].begin(), pomlisteners[n].end());
+      pomlisteners[n].erase(std::unique(pomlisteners[n].begin(), pomlisteners[n].end()), pomlisteners[n].end());
+      listeners.insert(listeners.end(), pomlisteners[n].begin(), pomlisteners[n].end());
+      listenerstarts.push_back(listeners.size());
+   }
+
+   regionactive.assign(regions, 1);
+   regionnext.assign(regions, 0);
+   regionmap.assign(nodemap.begin(), nodemap.end());
+   regionsteps.assign(regions, 0);
+   multirateiterations = multiratemismatches = 0;
+}
+
+// the region and everything reading its node as a gate has to be stepped in the next iteration
+inline void WakeListeners(unsigned int n)
+{
+   regionnext[noderegion[n]] = 1;
+   for (unsigned int k = listenerstarts[n]; k < listenerstarts[n + 1]; k++)
+      regionnext[listeners[k]] = 1;
+}
+
+// one iteration of the node engine on the regions which are not dormant
+void MultirateIteration()
+{
+   vector<float> pomsaved;
+   if (multirateverify)
+      pomsaved = nodecharge;
+
+   // a pad driving a node changed - its region and the regions reading it as a gate
+   for (unsigned int p = 0; p < pads.size(); p++)
+   {
+      int n = pads[p].origsignal;
+      if (nodemap[n] != regionmap[n] && noderegion[n] != 0xffffffff)
+      {
+         regionmap[n] = nodemap[n];
+         regionactive[noderegion[n]] = 1;
+         for (unsigned int k = listenerstarts[n]; k < listenerstarts[n + 1]; k++)
+            regionactive[listeners[k]] = 1;
+      }
+   }
+
+   unsigned int regions = regionactive.size();
+   for (unsigned int r = 0; r < regions; r++)
+   {
+      if (!regionactive[r])
+         continue;
+      for (unsigned int e = regiondevicestarts[r]; e < regiondevicestarts[r + 1]; e++)
+         SimulateNodeDevice(nodedevices[regiondevices[e]]);
+   }
+   for (unsigned int r = 0; r < regions; r++)
+   {
+      if (!regionactive[r])
+         continue;
+      regionsteps[r]++;
+      for (unsigned int e = regionstarts[r]; e < regionstarts[r + 1]; e++)
+      {
+         unsigned int n = regionnodes[e];
+         float pomold = nodecharge[n];
+         UpdateNode(n);
+         if (nodecharge[n] != pomold)
+            WakeListeners(n);
+      }
+   }
+   regionactive.swap(regionnext);
+   regionnext.assign(regions, 0);
+   multirateiterations++;
+
+   if (multirateverify)
+   {
+      vector<float> pomresult = nodecharge;
+      nodecharge = pomsaved;
+      NodeIteration();
+      if (memcmp(&pomresult[0], &nodecharge[0], nodecharge.size() * sizeof(float)))
+         multiratemismatches++;
+      nodecharge = pomresult;
+   }
+}
+
+// share of the iterations the regions of the given nodes were stepped in
+double RegionRate(const vector<unsigned int> &nodes)
+{
+   vector<unsigned int> pomregions;
+   for (unsigned int k = 0; k < nodes.size(); k++)
+      if (nodes[k] < noderegion.size() && noderegion[nodes[k]] != 0xffffffff)
+         pomregions.push_back(noderegion[nodes[k]]);
+   std::sort(pomregions.begin(), pomregions.end());
+   pomregions.erase(std::unique(pomregions.begin(), pomregions.end()), pomregions.end());
+   if (pomregions.empty() || !multirateiterations)
+      return 0.0;
+   uint64_t pomsteps = 0;
+   for (unsigned int k = 0; k < pomregions.size(); k++)
+      pomsteps += regionsteps[pomregions[k]];
+   return double(pomsteps) / (double(pomregions.size()) * multirateiterations);
+}
+
+void PrintMultirate()
+{
+   unsigned int regions = regionsteps.size();
+   if (!multirateiterations || !regions)
+      return;
+   uint64_t pomsteps = 0, pomdevicesteps = 0;
+   unsigned int pombins[6] = { 0 };
+   const char *pomnames[6] = { "never", "< 1%", "< 10%", "< 50%", "< 100%", "always" };
+   unsigned int pomlargest = 0;
+   for (unsigned int r = 0; r < regions; r++)
+   {
+      pomsteps += regionsteps[r];
+      pomdevicesteps += regionsteps[r] * (regiondevicestarts[r + 1] - regiondevicestarts[r]);
+      pomlargest = max(pomlargest, regionstarts[r + 1] - regionstarts[r]);
+      double pomrate = double(regionsteps[r]) / multirateiterations;
+      int b = (!regionsteps[r]) ? 0 : (pomrate < 0.01) ? 1 : (pomrate < 0.1) ? 2 : (pomrate < 0.5) ? 3 : (regionsteps[r] < multirateiterations) ? 4 : 5;
+      pombins[b]++;
+   }
+   printf("Multi-rate: %u regions (largest %u nodes), %.1f%% of the regions and %.1f%% of the devices stepped per iteration\n", regions, pomlargest,
+      100.0 * pomsteps / (double(regions) * multirateiterations), 100.0 * pomdevicesteps / (double(nodedevicecount) * multirateiterations));
+   printf("Regions by the share of iterations they were stepped in:");
+   for (int b = 0; b < 6; b++)
+      printf(" %s %u%s", pomnames[b], pombins[b], (b < 5) ? "," : "\n");
+   if (multirateverify)
+      printf("Verification against the full rate node engine: %" PRIu64 " of %" PRIu64 " iterations differ\n", multiratemismatches, multirateiterations);
+}
+
+// the same as SimulateNodeDevice() in fixed point
+inline void SimulateFixedDevice(const NodeDevice &pomdevice)
+{
+   int pomgate = nodemap[pomdevice.gate];
+   int64_t gatefactor;
+   if (pomgate == SIG_GND)
+      gatefactor = 0;
+   else if (pomgate == SIG_VCC)
+      gatefactor = 1 << RATIOSHIFT;
+   else
+      gatefactor = noderatio[pomdevice.gate];
+
+   if (!pomdevice.depletion && gatefactor <= 0)
+      return;
+
+   if (nodemap[pomdevice.drain] == SIG_VCC)
+   {
+      int64_t chargetogo = pomdevice.fixedchargetogo;
+      if (!pomdevice.depletion)
+         chargetogo = (chargetogo * gatefactor) >> RATIOSHIFT;
+      chargetogo = (chargetogo * FIXEDDEFLATOR) >> RATIOSHIFT;
+
+      if (pomdevice.source > SIG_VCC)
+         nodefixeddelta[pomdevice.source] += int32_t(chargetogo);
+   }
+   else if (nodemap[pomdevice.source] == SIG_GND)
+   {
+      int64_t chargetogo = pomdevice.fixedchargetogo;
+      if (!pomdevice.depletion)
+         chargetogo = (chargetogo * gatefactor) >> RATIOSHIFT;
+
+      if (pomdevice.drain > SIG_VCC)
+         nodefixeddelta[pomdevice.drain] -= int32_t(chargetogo);
+   }
+   else
+   {
+      int64_t pomsourcecharge = (int64_t(noderatio[pomdevice.source]) * pomdevice.fixedarea) >> RATIOSHIFT;
+      if (pomsourcecharge > 0)
+         pomsourcecharge = (pomsourcecharge * FIXEDDEFLATOR) >> RATIOSHIFT;
+
+      int64_t pomdraincharge = (int64_t(noderatio[pomdevice.drain]) * pomdevice.fixedarea) >> RATIOSHIFT;
+      if (pomdraincharge > 0)
+         pomdraincharge = (pomdraincharge * FIXEDDEFLATOR) >> RATIOSHIFT;
+
+      // saturates instead of the clamping
+      int64_t chargetogo = ((pomsourcecharge - pomdraincharge) * pomdevice.fixedconductance) >> RATIOSHIFT;
+      chargetogo = std::min(std::max(chargetogo, int64_t(-FIXEDMAXQUANTUM)), int64_t(FIXEDMAXQUANTUM));
+      if (!pomdevice.depletion)
+         chargetogo = (chargetogo * gatefactor) >> RATIOSHIFT;
+
+      nodefixeddelta[pomdevice.source] -= int32_t(chargetogo);
+      nodefixeddelta[pomdevice.drain] += int32_t(chargetogo);
+   }
+}
+
+// takes the moved charge to the nodes first .. last - 1, saturates them to their capacitance and gets their ratios
+// written as plain loops over the arrays so that the compiler turns them into SIMD code
+void UpdateFixedNodes(unsigned int first, unsigned int last)
+{
+   int32_t *pomcharge = &nodefixed[0];
+   int32_t *pomdelta = &nodefixeddelta[0];
+   const int32_t *pomarea = &nodefixedarea[0];
+   for (unsigned int j = first; j < last; j++)
+   {
+      int32_t pomvalue = pomcharge[j] + pomdelta[j];
+      pomvalue = std::max(pomvalue, -pomarea[j]);
+      pomvalue = std::min(pomvalue, pomarea[j]);
+      pomcharge[j] = pomvalue;
+      pomdelta[j] = 0;
+   }
+
+   int32_t *pomratio = &noderatio[0];
+   const int64_t *pomrecip = &noderecip[0];
+   for (unsigned int j = first; j < last; j++)
+      pomratio[j] = int32_t((int64_t(pomcharge[j]) * pomrecip[j]) >> (RECIPSHIFT - RATIOSHIFT));
+}
+
+// one iteration of the fixed point engine - the same steps as NodeIteration()
+void FixedIteration()
+{
+   for (unsigned int j = 0; j < nodedevicecount; j++)
+      SimulateFixedDevice(nodedevices[j]);
+
+   // pins the gates of the nodes driven by pads (only pads can drive a node)
+   for (unsigned int p = 0; p < pads.size(); p++)
+   {
+      int j = pads[p].origsignal;
+      if (nodemap[j] == SIG_VCC)
+         nodefixed[j] = int32_t((int64_t(nodefixed[j]) * nodekeep[j]) >> RATIOSHIFT) + nodefixedgatearea[j];
+      else if (nodemap[j] == SIG_GND)
+         nodefixed[j] = int32_t((int64_t(nodefixed[j]) * nodekeep[j]) >> RATIOSHIFT);
+   }
+
+   UpdateFixedNodes(0, nodefixed.size());
+}
+
+// calibration of the fixed point engine - it runs along the float node engine with the same pads
+// and both get compared at every output line
+unsigned int calibsamples = 0, calibpadmismatches = 0, calibnodemismatches = 0, calibmaxnodes = 0;
+float calibmaxdeviation = 0.0f;
+
+// the pad as ReadOutputStatus() sees it - from the charge / capacitance of its node
+int NodeRatioStatus(float pomratio)
+{
+   if (pomratio < -0.05f)
+      return SIG_GND;
+   else if (pomratio > 0.05f)
+      return SIG_VCC;
+   return SIG_FLOATING;
+}
+
+void CalibrateSample()
+{
+   unsigned int pomnodes = 0;
+   for (unsigned int j = 0; j < nodecharge.size(); j++)
+   {
+      if (signals[j].ignore || !nodefixedarea[j])
+         continue;
+      if ((nodecharge[j] > 0.0f) != (nodefixed[j] > 0))
+         pomnodes++;
+      float pomdeviation = fabsf(nodecharge[j] / nodearea[j] - float(nodefixed[j]) / float(nodefixedarea[j]));
+      if (pomdeviation > calibmaxdeviation)
+         calibmaxdeviation = pomdeviation;
+   }
+
+   bool padmismatch = false;
+   for (unsigned int p = 0; p < pads.size(); p++)
+   {
+      int j = pads[p].origsignal;
+      if (pads[p].type == PAD_INPUT || !nodefixedarea[j])
+         continue;
+      if (NodeRatioStatus(nodecharge[j] / nodearea[j]) != NodeRatioStatus(float(nodefixed[j]) / float(nodefixedarea[j])))
+         padmismatch = true;
+   }
+
+   calibsamples++;
+   if (padmismatch)
+      calibpadmismatches++;
+   calibnodemismatches += pomnodes;
+   if (pomnodes > calibmaxnodes)
+      calibmaxnodes = pomnodes;
+}
+
+void PrintCalibration()
+{
+   printf("---------------------\n");
+   printf("Calibration of the fixed point engine against the float node engine\n");
+   printf("Samples compared: %u\n", calibsamples);
+   printf("Samples with different bus (output pads): %u\n", calibpadmismatches);
+   printf("Nodes with different level: %u in total, at most %u in one sample\n", calibnodemismatches, calibmaxnodes);
+   printf("Largest difference of charge / capacitance: %.5f\n", calibmaxdeviation);
+   printf("Result: %s\n", calibpadmismatches ? "bus traces DIFFER" : "bus traces match");
+}
+
+// Batch engine - BATCHLANES independent Z80s run the node engine in lockstep, every node keeps one charge per lane
+// in a vector, so one pass thru nodedevices moves the charge of all the lanes. The input pads (clock, reset ..) are
+// common and get driven thru nodemap as for the node engine, the data bus is driven per lane from its own memory
+// and ports. Devices with source or drain on the data bus are simulated lane by lane, all others with the vector
+// operations.
+
+#define BATCHLANES 8
+
+typedef float lanefloat __attribute__((vector_size(BATCHLANES * sizeof(float))));
+typedef int32_t laneint __attribute__((vector_size(BATCHLANES * sizeof(int32_t))));
+
+vector<lanefloat> batchcharge;
+vector<lanefloat> batchdelta;
+vector<lanefloat> batchlevel; // +1 pad drives the node to VCC in that lane, -1 to GND, 0 node is free
+vector<uint8_t> batchvariant; // node is driven by a data bus pad
+vector<uint8_t> batchlanewise; // device has its source or drain on such node
+
+inline lanefloat LaneSplat(float pomvalue)
+{
+   lanefloat pomvector;
+   for (int l = 0; l < BATCHLANES; l++)
+      pomvector[l] = pomvalue;
+   return pomvector;
+}
+
+inline bool LaneAny(laneint pommask)
+{
+   for (int l = 0; l < BATCHLANES; l++)
+      if (pommask[l])
+         return true;
+   return false;
+}
+
+void BuildBatchNetlist()
+{
+   batchcharge.assign(signals.size(), LaneSplat(0.0f));
+   batchdelta.assign(signals.size(), LaneSplat(0.0f));
+   batchlevel.assign(signals.size(), LaneSplat(0.0f));
+   batchvariant.assign(signals.size(), 0);
+   for (unsigned int j = 0; j < pads.size(); j++)
+      if (pads[j].type == PAD_BIDIRECTIONAL)
+         batchvariant[pads[j].origsignal] = 1;
+   batchlanewise.resize(nodedevicecount);
+   for (unsigned int j = 0; j < nodedevicecount; j++)
+      batchlanewise[j] = batchvariant[nodedevices[j].source] || batchvariant[nodedevices[j].drain];
+}
+
+// what the node is in the lane - SIG_VCC / SIG_GND when a pad drives it, otherwise the node itself (like nodemap)
+inline int BatchMap(int node, int lane)
+{
+   if (!batchvariant[node])
+      return nodemap[node];
+   if (batchlevel[node][lane] > 0.0f)
+      return SIG_VCC;
+   if (batchlevel[node][lane] < 0.0f)
+      return SIG_GND;
+   return node;
+}
+
+void BatchSetPad(const Pad &pompad, int lane, int signal)
+{
+   batchlevel[pompad.origsignal][lane] = (signal == SIG_VCC) ? 1.0f : (signal == SIG_GND) ? -1.0f : 0.0f;
+}
+
+int BatchReadPad(const Pad &pompad, int lane)
+{
+   int j = pompad.origsignal;
+   if (pompad.type == PAD_BIDIRECTIONAL && batchlevel[j][lane] != 0.0f)
+      return (batchlevel[j][lane] > 0.0f) ? SIG_VCC : SIG_GND;
+   return NodeRatioStatus(batchcharge[j][lane] / nodearea[j]);
+}
+
+// is the transistor with the gate on the node open in the lane?
+inline bool BatchNodeIsOn(int pomgate, int lane)
+{
+   int pommap = BatchMap(pomgate, lane);
+   if (pommap == SIG_VCC)
+      return true;
+   if (pommap == SIG_GND)
+      return false;
+   return batchcharge[pomgate][lane] > 0.0f;
+}
+
+// SimulateNodeDevice() for a single lane
+void SimulateBatchDeviceLane(const NodeDevice &pomdevice, int lane)
+{
+   int pomgate = BatchMap(pomdevice.gate, lane);
+   float gatefactor;
+   if (pomgate == SIG_GND)
+      gatefactor = 0.0f;
+   else if (pomgate == SIG_VCC)
+      gatefactor = 1.0f;
+   else
+      gatefactor = batchcharge[pomdevice.gate][lane] / nodearea[pomdevice.gate];
+
+   if (!pomdevice.depletion && gatefactor <= 0.0f)
+      return;
+
+   if (BatchMap(pomdevice.drain, lane) == SIG_VCC)
+   {
+      float chargetogo = pomdevice.pomchargetogo;
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+      chargetogo /= PULLUPDEFLATOR;
+
+      if (pomdevice.source > SIG_VCC)
+         batchdelta[pomdevice.source][lane] += chargetogo;
+   }
+   else if (BatchMap(pomdevice.source, lane) == SIG_GND)
+   {
+      float chargetogo = pomdevice.pomchargetogo;
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+
+      if (pomdevice.drain > SIG_VCC)
+         batchdelta[pomdevice.drain][lane] -= chargetogo;
+   }
+   else
+   {
+      float pomsourcecharge = batchcharge[pomdevice.source][lane] * pomdevice.area / nodearea[pomdevice.source];
+      if (pomsourcecharge > 0.0f)
+         pomsourcecharge /= PULLUPDEFLATOR;
+
+      float pomdraincharge = batchcharge[pomdevice.drain][lane] * pomdevice.area / nodearea[pomdevice.drain];
+      if (pomdraincharge > 0.0f)
+         pomdraincharge /= PULLUPDEFLATOR;
+
+      float chargetogo = ((pomsourcecharge - pomdraincharge) / pomdevice.resist) / PULLUPDEFLATOR;
+      if (chargetogo > MAXQUANTUM)
+         chargetogo = MAXQUANTUM;
+      if (chargetogo < -MAXQUANTUM)
+         chargetogo = -MAXQUANTUM;
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+
+      batchdelta[pomdevice.source][lane] -= chargetogo;
+      batchdelta[pomdevice.drain][lane] += chargetogo;
+   }
+}
+
+// SimulateNodeDevice() for all the lanes at once - source and drain are the same nodes in every lane
+inline void SimulateBatchDevice(const NodeDevice &pomdevice)
+{
+   const lanefloat zero = LaneSplat(0.0f);
+   lanefloat gatefactor;
+   int pomgate = nodemap[pomdevice.gate];
+   if (batchvariant[pomdevice.gate])
+   {
+      const lanefloat &pomlevel = batchlevel[pomdevice.gate];
+      gatefactor = (pomlevel > zero) ? LaneSplat(1.0f) : (pomlevel < zero) ? zero : batchcharge[pomdevice.gate] / nodearea[pomdevice.gate];
+   }
+   else if (pomgate == SIG_GND)
+      gatefactor = zero;
+   else if (pomgate == SIG_VCC)
+      gatefactor = LaneSplat(1.0f);
+   else
+      gatefactor = batchcharge[pomdevice.gate] / nodearea[pomdevice.gate];
+
+   if (!pomdevice.depletion)
+   {
+      laneint pomon = gatefactor > zero;
+      if (!LaneAny(pomon))
+         return;
+      gatefactor = pomon ? gatefactor : zero; // the lanes where the transistor is closed move nothing
+   }
+
+   if (nodemap[pomdevice.drain] == SIG_VCC)
+   {
+      lanefloat chargetogo = LaneSplat(pomdevice.pomchargetogo);
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+      chargetogo /= PULLUPDEFLATOR;
+
+      if (pomdevice.source > SIG_VCC)
+         batchdelta[pomdevice.source] += chargetogo;
+   }
+   else if (nodemap[pomdevice.source] == SIG_GND)
+   {
+      lanefloat chargetogo = LaneSplat(pomdevice.pomchargetogo);
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+
+      if (pomdevice.drain > SIG_VCC)
+         batchdelta[pomdevice.drain] -= chargetogo;
+   }
+   else
+   {
+      lanefloat pomsourcecharge = batchcharge[pomdevice.source] * pomdevice.area / nodearea[pomdevice.source];
+      pomsourcecharge = (pomsourcecharge > zero) ? pomsourcecharge / PULLUPDEFLATOR : pomsourcecharge;
+
+      lanefloat pomdraincharge = batchcharge[pomdevice.drain] * pomdevice.area / nodearea[pomdevice.drain];
+      pomdraincharge = (pomdraincharge > zero) ? pomdraincharge / PULLUPDEFLATOR : pomdraincharge;
+
+      lanefloat chargetogo = ((pomsourcecharge - pomdraincharge) / pomdevice.resist) / PULLUPDEFLATOR;
+      const lanefloat maxquantum = LaneSplat(MAXQUANTUM);
+      chargetogo = (chargetogo > maxquantum) ? maxquantum : chargetogo;
+      chargetogo = (chargetogo < -maxquantum) ? -maxquantum : chargetogo;
+      if (!pomdevice.depletion)
+         chargetogo *= gatefactor;
+
+      batchdelta[pomdevice.source] -= chargetogo;
+      batchdelta[pomdevice.drain] += chargetogo;
+   }
+}
+
+// UpdateNode() for all the lanes, the pinning of the data bus is done lane by lane
+inline void UpdateBatchNode(unsigned int j)
+{
+   if (nodearea[j] <= 0.0f)
+      return;
+
+   lanefloat pomcharge = batchcharge[j];
+   if (batchvariant[j])
+   {
+      for (int l = 0; l < BATCHLANES; l++)
+      {
+         if (batchlevel[j][l] > 0.0f)
+            pomcharge[l] = pomcharge[l] * (1.0f - nodegatearea[j] / nodearea[j]) + nodegatearea[j];
+         else if (batchlevel[j][l] < 0.0f)
+            pomcharge[l] = pomcharge[l] * (1.0f - nodegatearea[j] / nodearea[j]);
+      }
+   }
+   else if (nodemap[j] == SIG_VCC)
+      pomcharge = pomcharge * (1.0f - nodegatearea[j] / nodearea[j]) + nodegatearea[j];
+   else if (nodemap[j] == SIG_GND)
+      pomcharge = pomcharge * (1.0f - nodegatearea[j] / nodearea[j]);
+   pomcharge += batchdelta[j];
+   batchdelta[j] = LaneSplat(0.0f);
+
+   const lanefloat pomarea = LaneSplat(nodearea[j]);
+   pomcharge = (pomcharge < -pomarea) ? -pomarea : pomcharge;
+   pomcharge = (pomcharge > pomarea) ? pomarea : pomcharge;
+   batchcharge[j] = pomcharge;
+}
+
+void BatchIteration()
+{
+   for (unsigned int j = 0; j < nodedevicecount; j++)
+   {
+      if (batchlanewise[j])
+      {
+         for (int l = 0; l < BATCHLANES; l++)
+            SimulateBatchDeviceLane(nodedevices[j], l);
+      }
+      else
+         SimulateBatchDevice(nodedevices[j]);
+   }
+
+   for (unsigned int j = 0; j < batchcharge.size(); j++)
+      if (!signals[j].ignore)
+         UpdateBatchNode(j);
+}
+
+// SpMV engines - the iteration of the node engine as a gated sparse matrix-vector product. The first kernel goes
+// thru the devices (ELL matrix of fixed width - gate, source and drain), masks off the devices which are closed and
+// writes the flow of every device into its two slots of spmvflow. The second kernel multiplies the flows by the
+// transposed incidence matrix (in CSR or in SELL-C-sigma) - every node gathers its flows and takes the sum.
+// A node sums its flows in the order of the devices as the node engine does, so the results are bit identical
+// and both kernels need no atomics, the threads just split the devices and then the nodes.
+
+#define SELLCHUNK BATCHLANES // C - rows of a chunk, one per SIMD lane
+#define SELLSIGMA 256 // sigma - rows get sorted by length within windows of this many rows
+
+vector<float> spmvflow; // [2 * device] goes to the source, [2 * device + 1] to the drain, the last one stays zero
+vector<uint8_t> spmvmask; // device is open in this iteration
+vector<unsigned int> csrrows, csrcols;
+vector<unsigned int> sellchunks, sellwidths, sellcols;
+vector<int> sellrows; // node of every row of the chunks, -1 for padding
+
+void BuildSpmvMatrix()
+{
+   unsigned int nodecount = nodecharge.size();
+   vector< vector<unsigned int> > pomrows(nodecount);
+   for (unsigned int d = 0; d < nodedevicecount; d++)
+   {
+      pomrows[nodedevices[d].source].push_back(2 * d);
+      pomrows[nodedevices[d].drain].push_back(2 * d + 1);
+   }
+   spmvflow.assign(2 * nodedevicecount + 1, 0.0f);
+   spmvmask.assign(nodedevicecount, 0);
+
+   csrrows.assign(1, 0);
+   csrcols.clear();
+   for (unsigned int n = 0; n < nodecount; n++)
+   {
+      csrcols.insert(csrcols.end(), pomrows[n].begin(), pomrows[n].end());
+      csrrows.push_back(csrcols.size());
+   }
+
+   // only the nodes which get updated are rows of SELL, the longest rows of every window go first
+   vector<int> pomorder;
+   for (unsigned int n = 0; n < nodecount; n++)
+      if (!signals[n].ignore && nodearea[n] > 0.0f)
+         pomorder.push_back(n);
+   for (unsigned int w = 0; w < pomorder.size(); w += SELLSIGMA)
+      std::stable_sort(pomorder.begin() + w, pomorder.begin() + min((unsigned int) pomorder.size(), w + SELLSIGMA),
+         [&pomrows](int a, int b) { return pomrows[a].size() > pomrows[b].size(); });
+
+   sellchunks.clear();
+   sellwidths.clear();
+   sellcols.clear();
+   sellrows.clear();
+   for (unsigned int c = 0; c < pomorder.size(); c += SELLCHUNK)
+   {
+      unsigned int pomwidth = 0;
+      for (unsigned int l = 0; l < SELLCHUNK; l++)
+      {
+         sellrows.push_back((c + l < pomorder.size()) ? pomorder[c + l] : -1);
+         if (sellrows.back() >= 0)
+            pomwidth = max(pomwidth, (unsigned int) pomrows[sellrows.back()].size());
+      }
+      sellchunks.push_back(sellcols.size());
+      sellwidths.push_back(pomwidth);
+      // column major - the k-th flow of all the rows of the chunk are next to each other, padding reads the zero slot
+      for (unsigned int k = 0; k < pomwidth; k++)
+      {
+         for (unsigned int l = 0; l < SELLCHUNK; l++)
+         {
+            int n = sellrows[sellrows.size() - SELLCHUNK + l];
+            sellcols.push_back((n >= 0 && k < pomrows[n].size()) ? pomrows[n][k] : 2 * nodedevicecount);
+         }
+      }
+   }
+}
+
+// flows of the devices first .. last - 1, the same arithmetic as SimulateNodeDevice()
+void SpmvDevices(unsigned int first, unsigned int last)
+{
+   for (unsigned int d = first; d < last; d++)
+   {
+      const NodeDevice &pomdevice = nodedevices[d];
+      float *pomflow = &spmvflow[2 * d];
+      pomflow[0] = pomflow[1] = 0.0f;
+
+      int pomgate = nodemap[pomdevice.gate];
+      float gatefactor;
+      if (pomgate == SIG_GND)
+         gatefactor = 0.0f;
+      else if (pomgate == SIG_VCC)
+         gatefactor = 1.0f;
+      else
+         gatefactor = nodecharge[pomdevice.gate] / nodearea[pomdevice.gate];
+
+      spmvmask[d] = pomdevice.depletion || gatefactor > 0.0f;
+      if (!spmvmask[d])
+         continue;
+
+      if (nodemap[pomdevice.drain] == SIG_VCC)
+      {
+         float chargetogo = pomdevice.pomchargetogo;
+         if (!pomdevice.depletion)
+            chargetogo *= gatefactor;
+         chargetogo /= PULLUPDEFLATOR;
+
+         if (pomdevice.source > SIG_VCC)
+            pomflow[0] = chargetogo;
+      }
+      else if (nodemap[pomdevice.source] == SIG_GND)
+      {
+         float chargetogo = pomdevice.pomchargetogo;
+         if (!pomdevice.depletion)
+            chargetogo *= gatefactor;
+
+         if (pomdevice.drain > SIG_VCC)
+            pomflow[1] = -chargetogo;
+      }
+      else
+      {
+         float pomsourcecharge = nodecharge[pomdevice.source] * pomdevice.area / nodearea[pomdevice.source];
+         if (pomsourcecharge > 0.0f)
+            pomsourcecharge /= PULLUPDEFLATOR;
+
+         float pomdraincharge = nodecharge[pomdevice.drain] * pomdevice.area / nodearea[pomdevice.drain];
+         if (pomdraincharge > 0.0f)
+            pomdraincharge /= PULLUPDEFLATOR;
+
+         float chargetogo = ((pomsourcecharge - pomdraincharge) / pomdevice.resist) / PULLUPDEFLATOR;
+         if (chargetogo > MAXQUANTUM)
+            chargetogo = MAXQUANTUM;
+         if (chargetogo < -MAXQUANTUM)
+            chargetogo = -MAXQUANTUM;
+         if (!pomdevice.depletion)
+            chargetogo *= gatefactor;
+
+         pomflow[0] = -chargetogo;
+         pomflow[1] = chargetogo;
+      }
+   }
+}
+
+void SpmvCsrNodes(unsigned int first, unsigned int last)
+{
+   for (unsigned int n = first; n < last; n++)
+   {
+      if (signals[n].ignore || nodearea[n] <= 0.0f)
+         continue;
+      float pomdelta = 0.0f;
+      for (unsigned int e = csrrows[n]; e < csrrows[n + 1]; e++)
+         pomdelta += spmvflow[csrcols[e]];
+      ChargeNode(n, pomdelta);
+   }
+}
+
+// SIMD kernel - one row of the chunk per lane
+void SpmvSellNodes(unsigned int first, unsigned int last)
+{
+   for (unsigned int c = first; c < last; c++)
+   {
+      const unsigned int *pomcols = &sellcols[sellchunks[c]];
+      lanefloat pomdelta = LaneSplat(0.0f);
+      for (unsigned int k = 0; k < sellwidths[c]; k++, pomcols += SELLCHUNK)
+      {
+         lanefloat pomflow;
+         for (int l = 0; l < SELLCHUNK; l++)
+            pomflow[l] = spmvflow[pomcols[l]];
+         pomdelta += pomflow;
+      }
+      for (int l = 0; l < SELLCHUNK; l++)
+         if (sellrows[c * SELLCHUNK + l] >= 0)
+            ChargeNode(sellrows[c * SELLCHUNK + l], pomdelta[l]);
+   }
+}
+
+void SpmvIteration(unsigned int id)
+{
+   SpmvDevices(nodedevicecount * id / pool.count, nodedevicecount * (id + 1) / pool.count);
+
+   pool.Barrier();
+
+   if (engine == ENGINE_SELL)
+      SpmvSellNodes(sellwidths.size() * id / pool.count, sellwidths.size() * (id + 1) / pool.count);
+   else
+      SpmvCsrNodes(nodecharge.size() * id / pool.count, nodecharge.size() * (id + 1) / pool.count);
+}
+
+// Temporal blocking - the nodes are split into regions of blocksize nodes (in breadth first order, so that
+// a region is a connected piece of the chip) and the blocked engine runs blockiterations iterations on one region
+// before it moves on to the next one, so the devices and nodes of the region stay in the cache meanwhile.
+// A node depends in one iteration on the nodes the devices with the source or drain in it read (their gate, source
+// and drain), so after k iterations on the nodes up to k such steps away. Every region therefore has a ghost layer
+// blockiterations deep: the region starts from the state at the start of the block on its own nodes and the ghosts
+// and computes the ghosts again by itself (the ghosts of level l only in the first blockiterations - l iterations,
+// after that they are not needed anymore). Nothing crosses from one region to another during a block, the devices
+// are simulated in the order of the node engine, so the result is bit identical to the node engine.
+// The block is computed ahead at its first call and every call takes the state of the next iteration from
+// blockhistory. The pads (and the bus reacting to the chip) can change at any iteration - when nodemap or the state
+// are not what the block started with, the rest of the block is dropped and a new block starts from that state.
+
+#define BLOCKSIZE 1024
+#define BLOCKITERATIONS 64
+
+unsigned int blocksize = BLOCKSIZE;
+unsigned int blockiterations = 4;
+unsigned int blockphase = 0; // iterations of the current block taken, 0 - a new block starts at the next call
+unsigned int blockruns = 0; // blocks computed
+uint64_t blocksteps = 0; // devices simulated in one block
+vector<unsigned int> blockstarts, blocknodes; // nodes of region b are blocknodes[blockstarts[b]] .. [blockstarts[b + 1] - 1]
+vector<unsigned int> blockdevicestarts, blockdevices; // devices of region b in the order of the node engine
+vector<unsigned int> blockdevicelevels; // a device is simulated while the level of its source or drain gets computed
+vector<unsigned int> blocklevelstarts, blockghosts; // region b computes blockghosts[blocklevelstarts[b * (blockiterations + 2)]] ..,
+                                                    // own nodes are level 0, level l starts at blocklevelstarts[b * (blockiterations + 2) + l]
+vector<float> blockstate, blockhistory; // state at the start of the block and after each of its iterations
+vector<int> blockmap; // nodemap the block was computed with
+
+// the node gets changed by the node engine
+inline bool BlockUpdated(unsigned int n)
+{
+   return n > SIG_VCC && !signals[n].ignore && nodearea[n] > 0.0f;
+}
+
+void BuildBlocks(unsigned int size)
+{
+   unsigned int count = nodecharge.size();
+
+   // neighbours through the devices, VCC and GND would connect everything
+   // writers of a node are the devices with the source or drain in it
+   vector< vector<unsigned int> > neighbours(count), writers(count);
+   for (unsigned int d = 0; d < nodedevicecount; d++)
+   {
+      int terminals[3] = { nodedevices[d].gate, nodedevices[d].source, nodedevices[d].drain };
+      for (int a = 0; a < 3; a++)
+         for (int b = a + 1; b < 3; b++)
+            if (terminals[a] > SIG_VCC && terminals[b] > SIG_VCC && terminals[a] != terminals[b])
+            {
+               neighbours[terminals[a]].push_back(terminals[b]);
+               neighbours[terminals[b]].push_back(terminals[a]);
+            }
+      if (BlockUpdated(nodedevices[d].source))
+         writers[nodedevices[d].source].push_back(d);
+      if (nodedevices[d].drain != nodedevices[d].source && BlockUpdated(nodedevices[d].drain))
+         writers[nodedevices[d].drain].push_back(d);
+   }
+
+   vector<int> region(count, -1);
+   blocknodes.clear();
+   for (unsigned int n = SIG_VCC + 1; n < count; n++)
+   {
+      if (region[n] >= 0)
+         continue;
+      unsigned int pomfirst = blocknodes.size();
+      region[n] = blocknodes.size() / size;
+      blocknodes.push_back(n);
+      for (unsigned int q = pomfirst; q < blocknodes.size(); q++)
+      {
+         unsigned int pomnode = blocknodes[q];
+         for (unsigned int k = 0; k < neighbours[pomnode].size(); k++)
+         {
+            unsigned int pomnext = neighbours[pomnode][k];
+            if (region[pomnext] >= 0)
+               continue;
+            region[pomnext] = blocknodes.size() / size;
+            blocknodes.push_back(pomnext);
+         }
+      }
+   }
+
+   unsigned int blocks = (blocknodes.size() + size - 1) / size;
+   blockstarts.resize(blocks + 1);
+   for (unsigned int b = 0; b <= blocks; b++)
+      blockstarts[b] = min(b * size, (unsigned int) blocknodes.size());
+
+   // the ghosts level by level - level l + 1 are the nodes the writers of level l read
+   blockghosts.clear();
+   blocklevelstarts.clear();
+   blockdevices.clear();
+   blockdevicelevels.clear();
+   blockdevicestarts.assign(1, 0);
+   blocksteps = 0;
+   vector<int> pomlevel(count, -1), pomdevicelevel(nodedevicecount, -1);
+   for (unsigned int b = 0; b < blocks; b++)
+   {
+      unsigned int pomfirst = blockghosts.size();
+      for (unsigned int e = blockstarts[b]; e < blockstarts[b + 1]; e++)
+      {
+         if (!BlockUpdated(blocknodes[e]))
+            continue;
+         pomlevel[blocknodes[e]] = 0;
+         blockghosts.push_back(blocknodes[e]);
+      }
+      vector<unsigned int> pomdevices;
+      for (unsigned int l = 0; l < blockiterations; l++)
+      {
+         blocklevelstarts.push_back(pomfirst);
+         unsigned int pomlast = blockghosts.size();
+         for (unsigned int e = pomfirst; e < pomlast; e++)
+         {
+            vector<unsigned int> &pomwriters = writers[blockghosts[e]];
+            for (unsigned int w = 0; w < pomwriters.size(); w++)
+            {
+               const NodeDevice &pomdevice = nodedevices[pomwriters[w]];
+               if (pomdevicelevel[pomwriters[w]] < 0)
+               {
+                  pomdevicelevel[pomwriters[w]] = l;
+                  pomdevices.push_back(pomwriters[w]);
+               }
+               int terminals[3] = { pomdevice.gate, pomdevice.source, pomdevice.drain };
+               for (int k = 0; k < 3; k++)
+               {
+                  if (!BlockUpdated(terminals[k]) || pomlevel[terminals[k]] >= 0)
+                     continue;
+                  pomlevel[terminals[k]] = l + 1;
+                  blockghosts.push_back(terminals[k]);
+               }
+            }
+         }
+         pomfirst = pomlast;
+      }
+      blocklevelstarts.push_back(pomfirst);
+      blocklevelstarts.push_back(blockghosts.size());
+
+      std::sort(pomdevices.begin(), pomdevices.end());
+      for (unsigned int k = 0; k < pomdevices.size(); k++)
+      {
+         blockdevices.push_back(pomdevices[k]);
+         blockdevicelevels.push_back(pomdevicelevel[pomdevices[k]]);
+         blocksteps += blockiterations - pomdevicelevel[pomdevices[k]];
+         pomdevicelevel[pomdevices[k]] = -1;
+      }
+      blockdevicestarts.push_back(blockdevices.size());
+      for (unsigned int e = blocklevelstarts[b * (blockiterations + 2)]; e < blockghosts.size(); e++)
+         pomlevel[blockghosts[e]] = -1;
+   }
+
+   blockstate.assign(count, 0.0f);
+   blockhistory.assign(blockiterations * count, 0.0f);
+   blockmap.assign(count, 0);
+   blockphase = 0;
+}
+
+// size of the regions, the nodes computed again as ghosts, the device steps of a block against the node engine
+// and the working set of one region
+void PrintBlocks()
+{
+   unsigned int blocks = blockstarts.size() - 1;
+   unsigned int largest = 0, pomown = 0;
+   for (unsigned int b = 0; b < blocks; b++)
+   {
+      const unsigned int *pomlevels = &blocklevelstarts[b * (blockiterations + 2)];
+      unsigned int pomset = (blockdevicestarts[b + 1] - blockdevicestarts[b]) * sizeof(NodeDevice) +
+         (pomlevels[blockiterations + 1] - pomlevels[0]) * 4 * sizeof(float);
+      largest = max(largest, pomset);
+      pomown += pomlevels[1] - pomlevels[0];
+   }
+   printf("%5u regions, %6u ghost nodes, %5.2fx the device steps, largest working set %4u kB",
+      blocks, (unsigned int) blockghosts.size() - pomown, double(blocksteps) / (double(blockiterations) * nodedevicecount), largest / 1024);
+}
+
+// computes blockiterations iterations of all regions from the current state into blockhistory
+void RunBlock()
+{
+   unsigned int count = nodecharge.size();
+   blockmap.assign(nodemap.begin(), nodemap.end());
+   blockstate.assign(nodecharge.begin(), nodecharge.end());
+   // the nodes no region computes keep their charge
+   for (unsigned int k = 0; k < blockiterations; k++)
+      memcpy(&blockhistory[k * count], &nodecharge[0], count * sizeof(float));
+
+   for (unsigned int b = 0; b + 1 < blockstarts.size(); b++)
+   {
+      const unsigned int *pomlevels = &blocklevelstarts[b * (blockiterations + 2)];
+      for (unsigned int e = pomlevels[0]; e < pomlevels[blockiterations + 1]; e++)
+         nodecharge[blockghosts[e]] = blockstate[blockghosts[e]];
+
+      for (unsigned int k = 0; k < blockiterations; k++)
+      {
+         // levels up to pomlevel are still needed
+         unsigned int pomlevel = blockiterations - 1 - k;
+         for (unsigned int e = blockdevicestarts[b]; e < blockdevicestarts[b + 1]; e++)
+            if (blockdevicelevels[e] <= pomlevel)
+               SimulateNodeDevice(nodedevices[blockdevices[e]]);
+         for (unsigned int e = pomlevels[0]; e < pomlevels[pomlevel + 1]; e++)
+            UpdateNode(blockghosts[e]);
+         // the charge moved to the next level is incomplete, that level is not needed anymore
+         for (unsigned int e = pomlevels[pomlevel + 1]; e < pomlevels[pomlevel + 2]; e++)
+            nodedelta[blockghosts[e]] = 0.0f;
+
+         float *pomhistory = &blockhistory[k * count];
+         for (unsigned int e = pomlevels[0]; e < pomlevels[1]; e++)
+            pomhistory[blockghosts[e]] = nodecharge[blockghosts[e]];
+      }
+   }
+   blockruns++;
+}
+
+// one iteration of the blocked engine - the next state of the block, or a new block when the pads or the state
+// are not the ones the block was computed for
+void BlockedIteration()
+{
+   unsigned int count = nodecharge.size();
+   if (!blockphase || blockphase == blockiterations || memcmp(&nodemap[0], &blockmap[0], count * sizeof(int)) ||
+      memcmp(&nodecharge[0], &blockhistory[(blockphase - 1) * count], count * sizeof(float)))
+   {
+      RunBlock();
+      blockphase = 0;
+   }
+   memcpy(&nodecharge[0], &blockhistory[blockphase * count], count * sizeof(float));
+   blockphase++;
+}
+
+// Memory traffic of the terminal engines - the 64 byte lines each sweep of an iteration touches,
+// counted as if nothing stayed in the cache from one sweep to the next one (the working set is larger than L2)
+
+class LineCounter
+{
+public:
+   void Touch(const void *pointer, size_t size);
+   size_t Bytes();
+   size_t total;
+   vector<uintptr_t> lines;
+   LineCounter() { total = 0; }
+};
+
+void LineCounter::Touch(const void *pointer, size_t size)
+{
+   for (uintptr_t l = uintptr_t(pointer) >> 6; l <= (uintptr_t(pointer) + size - 1) >> 6; l++)
+      lines.push_back(l);
+}
+
+// ends the sweep - adds its lines to the total
+size_t LineCounter::Bytes()
+{
+   std::sort(lines.begin(), lines.end());
+   total += (std::unique(lines.begin(), lines.end()) - lines.begin()) * 64;
+   lines.clear();
+   return total;
+}
+
+// the fields Simulate() / SimulateLocal() read and write
+void TouchTransistor(LineCounter &counter, const Transistor &pomtran)
+{
+   counter.Touch(&pomtran.gate, 3 * sizeof(int));
+   counter.Touch(&pomtran.area, sizeof(float));
+   counter.Touch(&pomtran.depletion, sizeof(bool));
+   counter.Touch(&pomtran.resist, 4 * sizeof(float));
+   counter.Touch(&pomtran.sourceconnections, 2 * sizeof(vector<Connection>));
+   counter.Touch(&pomtran.pomchargetogo, sizeof(float));
+}
+
+void TouchTerminal(LineCounter &counter, const Connection &pomconn)
+{
+   const Transistor &pomtran = transistors[pomconn.index];
+   counter.Touch(&pomconn, sizeof(Connection));
+   counter.Touch((pomconn.terminal == GATE) ? &pomtran.gatecharge : ((pomconn.terminal == SOURCE) ? &pomtran.sourcecharge : &pomtran.draincharge), sizeof(float));
+}
+
+// the homogenization sweep, with normalize the area gets read for the clamping too
+void TouchSignals(LineCounter &counter, bool normalize)
+{
+   for (unsigned int i = 0; i < signals.size(); i++)
+   {
+      counter.Touch(&signals[i], sizeof(Signal));
+      if (signals[i].ignore)
+         continue;
+      for (unsigned int j = 0; j < signals[i].connections.size(); j++)
+      {
+         TouchTerminal(counter, signals[i].connections[j]);
+         if (normalize)
+            counter.Touch(&transistors[signals[i].connections[j].index].area, sizeof(float));
+      }
+   }
+}
+
+void PrintTraffic(const double speeds[])
+{
+   // dense - Simulate() (pull-ups and pull-downs write the whole signal), Homogenize(), Normalize()
+   LineCounter dense;
+   for (unsigned int t = 0; t < transistors.size(); t++)
+   {
+      const Transistor &pomtran = transistors[t];
+      TouchTransistor(dense, pomtran);
+      const vector<Connection> *pomconns = (pomtran.origdrain == SIG_VCC) ? &pomtran.sourceconnections :
+         ((pomtran.origsource == SIG_GND) ? &pomtran.drainconnections : NULL);
+      if (pomconns)
+         for (unsigned int j = 0; j < pomconns->size(); j++)
+            TouchTerminal(dense, (*pomconns)[j]);
+   }
+   dense.Bytes();
+   TouchSignals(dense, false);
+   dense.Bytes();
+   for (unsigned int t = 0; t < transistors.size(); t++)
+      dense.Touch(&transistors[t].area, 4 * sizeof(float));
+   dense.Bytes();
+
+   // threaded - SimulateLocal(), HomogenizeNormalize()
+   LineCounter threaded;
+   for (unsigned int t = 0; t < transistors.size(); t++)
+      TouchTransistor(threaded, transistors[t]);
+   threaded.Bytes();
+   TouchSignals(threaded, true);
+   threaded.Bytes();
+
+   // fused - one sweep over the flat arrays
+   LineCounter fused;
+   fused.Touch(&fuseddevices[0], fuseddevices.size() * sizeof(FusedDevice));
+   for (unsigned int d = 0; d < fuseddevices.size(); d++)
+   {
+      int pomnodes[3] = { fuseddevices[d].gate, fuseddevices[d].source, fuseddevices[d].drain };
+      for (int k = 0; k < 3; k++)
+         fused.Touch(&nodemap[pomnodes[k]], sizeof(int));
+   }
+   fused.Touch(&fusedcharge[0], fusedcharge.size() * sizeof(float));
+   fused.Touch(&fusedproportion[0], fusedproportion.size() * sizeof(float));
+   fused.Touch(&fusedarea[0], fusedarea.size() * sizeof(float));
+   fused.Touch(&fusedstarts[0], fusedstarts.size() * sizeof(unsigned int));
+   fused.Touch(&fuseddevicestarts[0], fuseddevicestarts.size() * sizeof(unsigned int));
+   fused.Touch(&fusedhomogenize[0], fusedhomogenize.size());
+   fused.Bytes();
+
+   printf("Memory traffic per iteration: dense %u kB in 3 sweeps (%.1f it/s), threaded %u kB in 2 sweeps (%.1f it/s), fused %u kB in 1 sweep (%.1f it/s)\n",
+      (unsigned int) (dense.total / 1024), speeds[ENGINE_DENSE], (unsigned int) (threaded.total / 1024), speeds[ENGINE_THREADED],
+      (unsigned int) (fused.total / 1024), speeds[ENGINE_FUSED]);
+}
+
+// moves the charge for one iteration using the selected engine
+void SimulateIteration()
+{
+   if (engine == ENGINE_NODE && multirate)
+   {
+      MultirateIteration();
+      return;
+   }
+   if (engine == ENGINE_NODE && sorsweep)
+   {
+      SorIteration();
+      return;
+   }
+   if (engine == ENGINE_NODE)
+   {
+      NodeIteration();
+      if (calibrate)
+         FixedIteration();
+      return;
+   }
+   if (engine == ENGINE_FIXED)
+   {
+      FixedIteration();
+      return;
+   }
+   if (engine == ENGINE_THREADED)
+   {
+      pool.Run(ThreadedIteration);
+      return;
+   }
+   if (engine == ENGINE_CSR || engine == ENGINE_SELL)
+   {
+      pool.Run(SpmvIteration);
+      return;
+   }
+   if (engine == ENGINE_COLORED)
+   {
+      pool.Run(ColoredIteration);
+      return;
+   }
+   if (engine == ENGINE_BLOCKED)
+   {
+      BlockedIteration();
+      return;
+   }
+   if (engine == ENGINE_FUSED)
+   {
+      FusedIteration();
+      return;
+   }
+
+   for (unsigned int j = 0; j < transistors.size(); j++)
+      transistors[j].Simulate();
+   pool.Run(DenseHomogenizeNormalize);
+}
+
+// FNV-1a hash of all the charges - two runs with the same hash are bit identical
+uint64_t HashCharges()
+{
+   uint64_t pomhash = 14695981039346656037ULL;
+   if (NodeState())
+   {
+      uint8_t *pombytes = (engine == ENGINE_FIXED) ? (uint8_t *) &nodefixed[0] : (uint8_t *) &nodecharge[0];
+      for (unsigned int j = 0; j < nodecharge.size() * sizeof(float); j++)
+         pomhash = (pomhash ^ pombytes[j]) * 1099511628211ULL;
+      return pomhash;
+   }
+   for (unsigned int i = 0; i < transistors.size(); i++)
+   {
+      float pomcharges[3] = { transistors[i].gatecharge, transistors[i].sourcecharge, transistors[i].draincharge };
+      if (engine == ENGINE_FUSED)
+      {
+         pomcharges[0] = fusedcharge[fusedslots[3 * i + GATE - 1]];
+         pomcharges[1] = fusedcharge[fusedslots[3 * i + SOURCE - 1]];
+         pomcharges[2] = fusedcharge[fusedslots[3 * i + DRAIN - 1]];
+      }
+      uint8_t *pombytes = (uint8_t *) pomcharges;
+      for (unsigned int j = 0; j < sizeof(pomcharges); j++)
+         pomhash = (pomhash ^ pombytes[j]) * 1099511628211ULL;
+   }
+   return pomhash;
+}
+
+void ClearCharges()
+{
+   for (unsigned int i = 0; i < transistors.size(); i++)
+      transistors[i].gatecharge = transistors[i].sourcecharge = transistors[i].draincharge = 0.0f;
+   nodecharge.assign(nodecharge.size(), 0.0f);
+   nodedelta.assign(nodedelta.size(), 0.0f);
+   nodefixed.assign(nodefixed.size(), 0);
+   nodefixeddelta.assign(nodefixeddelta.size(), 0);
+   noderatio.assign(noderatio.size(), 0);
+   blockphase = 0;
+   fusedcharge.assign(fusedcharge.size(), 0.0f);
+   if (regionactive.size())
+   {
+      regionactive.assign(regionactive.size(), 1);
+      regionmap.assign(nodemap.begin(), nodemap.end());
+   }
+}
+
+// drives the pads as during the reset - clock is running, _RESET is low, other inputs are inactive and data bus floats
+void DriveResetPads(unsigned int i)
+{
+   for (unsigned int j = 0; j < pads.size(); j++)
+   {
+      if (pads[j].origsignal == PAD_CLK)
+         pads[j].SetInputSignal(((i / DIVISOR) & 1) ? SIG_VCC : SIG_GND);
+      else if (pads[j].origsignal == PAD__RESET)
+         pads[j].SetInputSignal(SIG_GND);
+      else if (pads[j].type == PAD_INPUT)
+         pads[j].SetInputSignal(SIG_VCC);
+      else if (pads[j].type == PAD_BIDIRECTIONAL)
+         pads[j].SetInputSignal(SIG_FLOATING);
+   }
+}
+
+// runs the same number of reset iterations with the dense and with the threaded engine on 1 .. maxthreads threads
+// (and with the serial node engines) and reports the speed and whether the results are identical for all numbers of threads
+void RunBenchmark(unsigned int iterations, unsigned int maxthreads)
+{
+   printf("-------------------------------------------------------\n");
+   printf("Benchmark: %u iterations, %u transistors, %u signals\n", iterations, (unsigned int) transistors.size(), (unsigned int) signals.size());
+
+   // data every iteration goes thru - transistors and connections for the terminal engines, devices and nodes for the node engine
+   unsigned int pomconnections = 0;
+   for (unsigned int i = 0; i < transistors.size(); i++)
+      pomconnections += transistors[i].gateconnections.size() + transistors[i].sourceconnections.size() + transistors[i].drainconnections.size();
+   for (unsigned int i = 0; i < signals.size(); i++)
+      pomconnections += signals[i].connections.size();
+   printf("Working set: terminal engines %u kB, node engine %u kB\n",
+      (unsigned int) ((transistors.size() * sizeof(Transistor) + pomconnections * sizeof(Connection)) / 1024),
+      (unsigned int) ((nodedevicecount * sizeof(NodeDevice) + nodecharge.size() * (4 * sizeof(float) + sizeof(int))) / 1024));
+
+   int pomengine = engine;
+   double nodespeed = 0.0, densespeed = 0.0, coloredspeed = 0.0;
+   vector<float> nodereference;
+   double speeds[ENGINE_COUNT];
+   unsigned int coloredthreads = 1;
+
+   for (int e = 0; e < ENGINE_COUNT; e++)
+   {
+      double basespeed = 0.0;
+      uint64_t basehash = 0;
+      engine = e;
+
+      // only the engines with a parallel iteration use more threads
+      for (unsigned int t = 1; t <= ((e == ENGINE_DENSE || e == ENGINE_THREADED || e == ENGINE_CSR || e == ENGINE_SELL || e == ENGINE_COLORED) ? maxthreads : 1); t++)
+      {
+         StartThreads(t);
+         ClearCharges();
+
+         uint64_t pomduration = GetTickCount();
+         for (unsigned int i = 0; i < iterations; i++)
+         {
+            DriveResetPads(i);
+            SimulateIteration();
+         }
+         pomduration = GetTickCount() - pomduration;
+         if (!pomduration)
+            pomduration = 1;
+
+         double pomspeed = double(iterations) * 1000.0 / double(pomduration);
+         uint64_t pomhash = HashCharges();
+         if (t == 1)
+         {
+            basespeed = pomspeed;
+            basehash = pomhash;
+            speeds[e] = pomspeed;
+         }
+         if (e == ENGINE_NODE)
+         {
+            nodespeed = pomspeed;
+            nodereference = nodecharge;
+         }
+         if (e == ENGINE_DENSE && t == 1)
+            densespeed = pomspeed;
+         if (e == ENGINE_COLORED && pomspeed > coloredspeed)
+         {
+            coloredspeed = pomspeed;
+            coloredthreads = t;
+         }
+         printf("%-8s threads %2u: %6" PRIu64 "ms %9.1f it/s speedup %5.2fx hash %016" PRIx64 " %s\n", enginenames[e], t, pomduration, pomspeed,
+            pomspeed / basespeed, pomhash, (pomhash == basehash) ? "identical" : "DIFFERENT");
+      }
+   }
+
+   PrintTraffic(speeds);
+   PrintFanout();
+   engine = ENGINE_DENSE;
+   ClearCharges();
+   printf("Time on the %d largest nets in the dense engine: %.1f%%\n", FANOUTTOP, 100.0 * TimeTopNets(iterations) * densespeed / (1000.0 * iterations));
+   PrintColoring();
+   printf("Colored engine: %.2fx the serial dense loop (best at %u threads)\n", coloredspeed / densespeed, coloredthreads);
+
+   unsigned int pomopen = 0;
+   for (unsigned int d = 0; d < nodedevicecount; d++)
+      pomopen += spmvmask[d];
+   printf("SpMV matrix: %u nonzeros, CSR %u kB, SELL-%d-%d %u kB (%.1f%% padding), devices open after the last iteration %.1f%%\n",
+      (unsigned int) csrcols.size(), (unsigned int) ((csrcols.size() + csrrows.size()) * sizeof(unsigned int) / 1024), SELLCHUNK, SELLSIGMA,
+      (unsigned int) ((sellcols.size() + sellrows.size() + 2 * sellwidths.size()) * sizeof(unsigned int) / 1024),
+      100.0 * (sellcols.size() - csrcols.size() + csrrows[SIG_VCC + 1] - csrrows[SIG_GND]) / sellcols.size(), 100.0 * pomopen / nodedevicecount);
+
+   // the node engine stepping only the regions which are not dormant
+   engine = ENGINE_NODE;
+   bool pommultirate = multirate;
+   multirate = true;
+   ClearCharges();
+   uint64_t pommultiduration = GetTickCount();
+   for (unsigned int i = 0; i < iterations; i++)
+   {
+      DriveResetPads(i);
+      SimulateIteration();
+   }
+   pommultiduration = GetTickCount() - pommultiduration;
+   if (!pommultiduration)
+      pommultiduration = 1;
+   printf("%-8s threads  1: %6" PRIu64 "ms %9.1f it/s %5.2fx the node engine hash %016" PRIx64 " %s\n", "multirate", pommultiduration,
+      double(iterations) * 1000.0 / double(pommultiduration), double(iterations) * 1000.0 / double(pommultiduration) / nodespeed, HashCharges(),
+      !memcmp(&nodecharge[0], &nodereference[0], nodecharge.size() * sizeof(float)) ? "identical" : "DIFFERENT");
+   PrintMultirate();
+   multirate = pommultirate;
+
+   // the blocked engine with several region sizes against the final state of the node engine, it has to be bit identical
+   engine = ENGINE_BLOCKED;
+   unsigned int blocksizes[] = { 64, 256, 1024, 4096, 0xffffffff };
+   for (unsigned int k = 0; k < sizeof(blocksizes) / sizeof(blocksizes[0]); k++)
+   {
+      BuildBlocks(blocksizes[k]);
+      ClearCharges();
+      blockruns = 0;
+      uint64_t pomduration = GetTickCount();
+      for (unsigned int i = 0; i < iterations; i++)
+      {
+         DriveResetPads(i);
+         BlockedIteration();
+      }
+      pomduration = GetTickCount() - pomduration;
+      if (!pomduration)
+         pomduration = 1;
+
+      unsigned int pomflipped = 0;
+      float pomdeviation = 0.0f;
+      for (unsigned int j = SIG_VCC + 1; j < nodecharge.size(); j++)
+      {
+         if (nodearea[j] <= 0.0f)
+            continue;
+         if ((nodecharge[j] > 0.0f) != (nodereference[j] > 0.0f))
+            pomflipped++;
+         pomdeviation = max(pomdeviation, fabsf(nodecharge[j] - nodereference[j]) / nodearea[j]);
+      }
+      double pomspeed = double(iterations) * 1000.0 / double(pomduration);
+      if (blocksizes[k] == 0xffffffff)
+         printf("blocked  size   all: ");
+      else
+         printf("blocked  size %5u: ", blocksizes[k]);
+      printf("%6" PRIu64 "ms %9.1f it/s %5.2fx the node engine, ", pomduration, pomspeed, pomspeed / nodespeed);
+      PrintBlocks();
+      printf(", %.1f iterations per block, %u levels differ, deviation %.3f %s\n", double(iterations) / double(blockruns ? blockruns : 1),
+         pomflipped, pomdeviation, !memcmp(&nodecharge[0], &nodereference[0], nodecharge.size() * sizeof(float)) ? "identical" : "DIFFERENT");
+   }
+   BuildBlocks(blocksize);
+
+   // the batch engine moves the charge of BATCHLANES instances in one iteration
+   BuildBatchNetlist();
+   uint64_t pomduration = GetTickCount();
+   for (unsigned int i = 0; i < iterations; i++)
+   {
+      DriveResetPads(i);
+      BatchIteration();
+   }
+   pomduration = GetTickCount() - pomduration;
+   if (!pomduration)
+      pomduration = 1;
+   double pomspeed = double(iterations) * 1000.0 / double(pomduration);
+   printf("%-8s lanes   %2d: %6" PRIu64 "ms %9.1f it/s %9.1f instance it/s, %.2fx the node engine\n", "batch", BATCHLANES, pomduration, pomspeed,
+      pomspeed * BATCHLANES, pomspeed * BATCHLANES / nodespeed);
+
+   pool.Stop();
+   engine = pomengine;
+}
+
+// Adaptive clock (-divisor auto) - instead of the fixed DIVISOR iterations per half period the clock
+// toggles as soon as the chip settles. A half period ends when no signal changed its level (sign of its charge)
+// for SETTLEWINDOW iterations and for margin % of the time the chip needed to settle, the bus got sampled
+// and neither the sample changed what is driven onto the data bus nor any address or control output floats.
+// DIVISOR stays the upper limit of a half period, the half periods which reach it are counted as unstable.
+
+#define SETTLEWINDOW 32
+#define SETTLEMINIMUM 64 // the clock pad itself needs some iterations to charge the clock net
+
+class AdaptiveClock
+{
+public:
+   AdaptiveClock();
+   void Setup();
+   bool Step();
+   void Sampled(bool busmoved);
+   void PrintSummary(uint64_t duration);
+   bool enabled;
+   bool clockhigh;
+   unsigned int margin;
+   unsigned int halfperiods;
+   unsigned int phaseiterations, lastchange;
+   unsigned int miniterations, maxiterations, unstableedges;
+   uint64_t totaliterations;
+   FILE *logfile;
+   vector<uint8_t> levels;
+};
+
+AdaptiveClock::AdaptiveClock()
+{
+   enabled = clockhigh = false;
+   margin = 25;
+   halfperiods = phaseiterations = lastchange = 0;
+   miniterations = 0xffffffff;
+   maxiterations = unstableedges = 0;
+   totaliterations = 0;
+   logfile = NULL;
+}
+
+AdaptiveClock adaptiveclock;
+
+// charge / capacitance of the signal - the same value ReadOutputStatus() compares against the thresholds
+float SignalRatio(unsigned int j)
+{
+   if (NodeState())
+      return (nodearea[j] > 0.0f) ? NodeCharge(j) / nodearea[j] : 0.0f;
+   if (!signals[j].connections.size())
+      return 0.0f;
+   const Connection &pomconn = signals[j].connections[0];
+   return TerminalCharge(pomconn) / transistors[pomconn.index].area;
+}
+
+void AdaptiveClock::Setup()
+{
+   levels.resize(signals.size());
+   for (unsigned int j = 0; j < signals.size(); j++)
+      levels[j] = SignalRatio(j) > 0.0f;
+   if (logfile)
+      fprintf(logfile, "halfperiod,clock,iterations,settled,unstable\n");
+}
+
+// called after every iteration, returns true when the bus should be sampled
+bool AdaptiveClock::Step()
+{
+   phaseiterations++;
+   totaliterations++;
+
+   bool pomchanged = false;
+   for (unsigned int j = 0; j < signals.size(); j++)
+   {
+      if (signals[j].ignore)
+         continue;
+      uint8_t pomlevel = SignalRatio(j) > 0.0f;
+      if (pomlevel != levels[j])
+      {
+         levels[j] = pomlevel;
+         pomchanged = true;
+      }
+   }
+   if (pomchanged)
+      lastchange = phaseiterations;
+
+   if (phaseiterations >= DIVISOR)
+      return true;
+   unsigned int pomwait = lastchange * margin / 100;
+   if (pomwait < SETTLEWINDOW)
+      pomwait = SETTLEWINDOW;
+   return phaseiterations >= SETTLEMINIMUM && phaseiterations >= lastchange + pomwait;
+}
+
+// called after the bus got sampled - either the clock toggles or the half period goes on
+void AdaptiveClock::Sampled(bool busmoved)
+{
+   bool pomunstable = busmoved;
+   for (unsigned int j = 0; j < pads.size(); j++)
+   {
+      int pomsignal = pads[j].origsignal;
+      if (pads[j].type == PAD_OUTPUT && pomsignal != PAD__BUSAK && pads[j].ReadOutputStatus() == SIG_FLOATING)
+         pomunstable = true;
+   }
+
+   if (pomunstable && phaseiterations < DIVISOR)
+   {
+      lastchange = phaseiterations;
+      return;
+   }
+
+   if (pomunstable)
+      unstableedges++;
+   if (logfile)
+      fprintf(logfile, "%u,%d,%u,%u,%d\n", halfperiods, clockhigh ? 1 : 0, phaseiterations, lastchange, pomunstable ? 1 : 0);
+   if (phaseiterations < miniterations)
+      miniterations = phaseiterations;
+   if (phaseiterations > maxiterations)
+      maxiterations = phaseiterations;
+
+   clockhigh = !clockhigh;
+   halfperiods++;
+   phaseiterations = lastchange = 0;
+}
+
+void AdaptiveClock::PrintSummary(uint64_t duration)
+{
+   if (!halfperiods)
+      return;
+   double pomaverage = double(totaliterations) / double(halfperiods);
+   printf("Adaptive clock: %u half periods, iterations per half period min %u avg %.1f max %u (DIVISOR %u), unstable edges %u\n",
+      halfperiods, miniterations, pomaverage, maxiterations, DIVISOR, unstableedges);
+   printf("Iterations saved against fixed DIVISOR: %.1f%%\n", 100.0 - 100.0 * pomaverage / double(DIVISOR));
+   printf("Speed of simulation: %.2fHz\n", (double(halfperiods) / 2.0) / double(duration ? duration : 1) * 1000.0);
+}
+
+// Steady state detection (-steady) - at every rising clock edge after reset the digital state of the chip (which
+// signals are charged plus the levels of the pads) gets hashed together with the memory, the ports and the bus state
+// the main loop drives the pads from. A recurring hash makes the distance to its previous visit a candidate period,
+// it is taken as steady once the whole next period repeats cycle by cycle with nothing written to the outfile.
+// Then the run stops, or with -cycles N the whole periods left are skipped and only the remainder gets simulated.
+// Only the digital state is compared - the charges of two visits of the same state may differ slightly.
+
+bool steady = false;
+unsigned int runcycles = 0; // -cycles N, 0 - until the CPU halts
+vector<uint64_t> steadyhashes; // hash of every clock cycle since the first checked one
+std::map<uint64_t, unsigned int> steadyseen; // last index into steadyhashes with the hash
+unsigned int steadyperiod = 0, steadymatched = 0, steadyoutput = 0;
+
+uint64_t HashDigitalState(uint64_t pomhash)
+{
+   uint8_t pombyte = 0;
+   unsigned int pombits = 0;
+   for (unsigned int j = 0; j < signals.size(); j++)
+   {
+      if (signals[j].ignore)
+         continue;
+      pombyte = (pombyte << 1) | (SignalRatio(j) > 0.0f);
+      if (++pombits == 8)
+      {
+         pomhash = (pomhash ^ pombyte) * 1099511628211ULL;
+         pombyte = pombits = 0;
+      }
+   }
+   pomhash = (pomhash ^ pombyte) * 1099511628211ULL;
+   for (unsigned int j = 0; j < pads.size(); j++)
+      pomhash = (pomhash ^ pads[j].ReadInputStatus()) * 1099511628211ULL;
+   for (unsigned int j = 0; j < sizeof(memory); j++)
+      pomhash = (pomhash ^ memory[j]) * 1099511628211ULL;
+   for (unsigned int j = 0; j < sizeof(ports); j++)
+      pomhash = (pomhash ^ ports[j]) * 1099511628211ULL;
+   return pomhash;
+}
+
+// called at every checked clock edge with the hash of the state, returns true when the steady state got confirmed
+bool SteadyCycle(uint64_t pomhash, unsigned int outputbytes)
+{
+   unsigned int c = steadyhashes.size();
+   steadyhashes.push_back(pomhash);
+   if (steadyperiod)
+   {
+      if (steadyhashes[c - steadyperiod] == pomhash && outputbytes == steadyoutput)
+      {
+         if (++steadymatched >= steadyperiod)
+            return true;
+      }
+      else
+         steadyperiod = 0;
+   }
+   if (!steadyperiod)
+   {
+      std::map<uint64_t, unsigned int>::iterator pomprevious = steadyseen.find(pomhash);
+      if (pomprevious != steadyseen.end())
+      {
+         steadyperiod = c - pomprevious->second;
+         steadymatched = 0;
+         steadyoutput = outputbytes;
+      }
+   }
+   steadyseen[pomhash] = c;
+   return false;
+}
+
+// Binary trace (-trace file) - every sample of the bus is kept as a fixed size record instead of being printed,
+// the records go thru a lock-free ring to a writer thread which drains them to the file. -decode file prints
+// the records in the same format as the simulation prints them.
+
+#define TRACERING 4096 // records in the ring
+#define TRACEVERSION 1
+
+#define TRACE_FETCH 1
+#define TRACE_MEMWRITE 2
+#define TRACE_IOWRITE 4
+#define TRACE_MEMREAD 8
+#define TRACE_IOREAD 16
+
+struct TraceHeader
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t recordsize;
+};
+
+struct TraceRecord
+{
+   uint64_t padhigh, padfloating; // bit n is the pad of signal n
+   uint32_t iteration;
+   uint16_t pc, ir, sp, wz, ix, iy, hl, hl2, de, de2, bc, bc2;
+   uint8_t a, a2, f, f2;
+   uint8_t tstates, mstates; // bit 0 - T1 / M1 ..
+   uint8_t events; // TRACE_...
+   uint8_t data, memdata; // data bus and the memory at the address
+   uint16_t address;
+
+   char Pad(int signal) const;
+   uint8_t Access() const { return events & -events; } // one access at a time, the lowest bit if not
+};
+
+char TraceRecord::Pad(int signal) const
+{
+   if (padfloating & (uint64_t(1) << signal))
+      return '.';
+   return (padhigh & (uint64_t(1) << signal)) ? '1' : '0';
+}
+
+const char traceheader[] =
+   "       : C// // // // AAAA AA                      \n"
+   "       : LRH MR RW MI 1111 11AA AAAA AAAA DDDD DDDD\n"
+   "       : KSL 1F DR QQ 5432 1098 7654 3210 7654 3210\n";
+
+void PrintTraceHeader(FILE *file)
+{
+   fputs(traceheader, file);
+}
+
+#define TRACELINE 512
+
+// the line of the record into text (TRACELINE bytes), returns its length
+unsigned int FormatTraceRecord(char *text, const TraceRecord &pomrecord)
+{
+   // pads in the order of the header, space after the last one of a group
+   static const int pomorder[] = { PAD_CLK, PAD__RESET, -PAD__HALT, PAD__M1, -PAD__RFSH, PAD__RD, -PAD__WR, PAD__MREQ, -PAD__IORQ,
+      PAD_A15, PAD_A14, PAD_A13, -PAD_A12, PAD_A11, PAD_A10, PAD_A9, -PAD_A8, PAD_A7, PAD_A6, PAD_A5, -PAD_A4, PAD_A3, PAD_A2, PAD_A1, -PAD_A0,
+      PAD_D7, PAD_D6, PAD_D5, -PAD_D4, PAD_D3, PAD_D2, PAD_D1, PAD_D0 };
+   char pomline[64];
+   unsigned int pomlength = 0;
+   for (unsigned int k = 0; k < sizeof(pomorder) / sizeof(pomorder[0]); k++)
+   {
+      pomline[pomlength++] = pomrecord.Pad(abs(pomorder[k]));
+      if (pomorder[k] < 0)
+         pomline[pomlength++] = ' ';
+   }
+   pomline[pomlength] = 0;
+
+   char pomflags[2][9];
+   for (int r = 0; r < 2; r++)
+   {
+      uint8_t pomf = r ? pomrecord.f2 : pomrecord.f;
+      for (int b = 0; b < 8; b++)
+         pomflags[r][b] = (pomf & (0x80 >> b)) ? "SZ5H3VNC"[b] : '.';
+      pomflags[r][8] = 0;
+   }
+   char pomstates[2][7];
+   for (int b = 0; b < 6; b++)
+      pomstates[0][b] = (pomrecord.tstates & (1 << b)) ? '1' + b : '.';
+   pomstates[0][6] = 0;
+   for (int b = 0; b < 5; b++)
+      pomstates[1][b] = (pomrecord.mstates & (1 << b)) ? '1' + b : '.';
+   pomstates[1][5] = 0;
+
+   unsigned int pomsize = snprintf(text, TRACELINE, "%07d: %s PC:%04x IR:%04x SP:%04x WZ:%04x IX:%04x IY:%04x HL:%04x HL':%04x DE:%04x DE':%04x BC:%04x BC':%04x"
+      " A:%02x A':%02x F:%s F':%s T:%s M:%s", pomrecord.iteration, pomline, pomrecord.pc, pomrecord.ir, pomrecord.sp, pomrecord.wz,
+      pomrecord.ix, pomrecord.iy, pomrecord.hl, pomrecord.hl2, pomrecord.de, pomrecord.de2, pomrecord.bc, pomrecord.bc2,
+      pomrecord.a, pomrecord.a2, pomflags[0], pomflags[1], pomstates[0], pomstates[1]);
+   if (pomrecord.events & TRACE_FETCH)
+      pomsize += snprintf(text + pomsize, TRACELINE - pomsize, " ***** OPCODE FETCH: %04x[%02x]", pomrecord.address, pomrecord.memdata);
+   if (pomrecord.events & TRACE_MEMWRITE)
+      pomsize += snprintf(text + pomsize, TRACELINE - pomsize, " MEMORY WRITE: %04x[%02x]", pomrecord.address, pomrecord.data);
+   if (pomrecord.events & TRACE_IOWRITE)
+      pomsize += snprintf(text + pomsize, TRACELINE - pomsize, " I/O WRITE: %04x[%02x]", pomrecord.address, pomrecord.data);
+   if (pomrecord.events & TRACE_MEMREAD)
+      pomsize += snprintf(text + pomsize, TRACELINE - pomsize, " MEMORY READ: %04x[%02x]", pomrecord.address, pomrecord.memdata);
+   if (pomrecord.events & TRACE_IOREAD)
+      pomsize += snprintf(text + pomsize, TRACELINE - pomsize, " I/O READ: %04x[%02x]", pomrecord.address, pomrecord.memdata);
+   pomsize += snprintf(text + pomsize, TRACELINE - pomsize, "\n");
+   return pomsize;
+}
+
+void PrintTraceRecord(FILE *file, const TraceRecord &pomrecord)
+{
+   char pomtext[TRACELINE];
+   FormatTraceRecord(pomtext, pomrecord);
+   fputs(pomtext, file);
+}
+
+// the records go to the output thread as they are
+class TraceLog
+{
+public:
+   TraceLog();
+   bool Open(const char *filename);
+   void Push(const TraceRecord &pomrecord);
+   void Close();
+   OutputStream stream;
+   uint64_t pushed;
+};
+
+TraceLog::TraceLog()
+{
+   pushed = 0;
+}
+
+bool TraceLog::Open(const char *filename)
+{
+   if (!stream.Open(filename))
+      return false;
+   TraceHeader pomheader;
+   ZeroMemory(&pomheader, sizeof(pomheader));
+   memcpy(pomheader.magic, "Z80TRACE", 8);
+   pomheader.version = TRACEVERSION;
+   pomheader.recordsize = sizeof(TraceRecord);
+   stream.Write(&pomheader, sizeof(pomheader));
+   return true;
+}
+
+void TraceLog::Push(const TraceRecord &pomrecord)
+{
+   stream.Write(&pomrecord, sizeof(pomrecord));
+   pushed++;
+}
+
+void TraceLog::Close()
+{
+   if (!stream.active)
+      return;
+   printf("Trace: %" PRIu64 " records of %u bytes written\n", pushed, (unsigned int) sizeof(TraceRecord));
+   stream.Close();
+}
+
+TraceLog tracelog;
+
+OutputStream stdoutstream; // the sample lines and the messages of the main loop while it runs
+
+// Bus transaction log (-buslog file, .csv or .csv.gz gets text) - every memory or I/O access gets one record: it opens on
+// the falling edge of the strobe (the first sample with the event) and is written when the strobe goes up again,
+// with the data as the bus had them at the last sample. The cycle is the clock cycle of the falling edge.
+
+#define BUSVERSION 1
+
+struct BusTransaction
+{
+   uint32_t cycle;
+   uint16_t address;
+   uint8_t type; // TRACE_...
+   uint8_t data;
+   uint8_t m1;
+   uint8_t reserved[3];
+};
+
+const char *BusTypeName(int type)
+{
+   switch (type)
+   {
+   case TRACE_FETCH:
+      return "FETCH";
+   case TRACE_MEMWRITE:
+      return "MEMWRITE";
+   case TRACE_IOWRITE:
+      return "IOWRITE";
+   case TRACE_MEMREAD:
+      return "MEMREAD";
+   case TRACE_IOREAD:
+      return "IOREAD";
+   }
+   return "?";
+}
+
+int FormatBusTransaction(char *line, unsigned int size, const BusTransaction &pomtransaction)
+{
+   return snprintf(line, size, "%u,%s,%04x,%02x,%d\n", pomtransaction.cycle, BusTypeName(pomtransaction.type), pomtransaction.address,
+      pomtransaction.data, pomtransaction.m1);
+}
+
+class BusLog
+{
+public:
+   BusLog();
+   bool Open(const char *filename);
+   void Sample(unsigned int cycle, const TraceRecord &pomrecord, bool starts);
+   void Close();
+   BusTransaction open; // type 0 - no transaction open
+   OutputStream stream;
+   bool csv;
+   uint64_t transactions, samples;
+};
+
+BusLog::BusLog()
+{
+   ZeroMemory(&open, sizeof(open));
+   csv = false;
+   transactions = samples = 0;
+}
+
+bool BusLog::Open(const char *filename)
+{
+   unsigned int pomlength = strlen(filename);
+   csv = (pomlength > 4 && !strcmp(filename + pomlength - 4, ".csv")) || (pomlength > 7 && !strcmp(filename + pomlength - 7, ".csv.gz"));
+   if (!stream.Open(filename))
+      return false;
+   if (csv)
+      stream.Write("cycle,type,address,data,m1\n", 27);
+   else
+   {
+      TraceHeader pomheader;
+      ZeroMemory(&pomheader, sizeof(pomheader));
+      memcpy(pomheader.magic, "Z80BUS\0\0", 8);
+      pomheader.version = BUSVERSION;
+      pomheader.recordsize = sizeof(BusTransaction);
+      stream.Write(&pomheader, sizeof(pomheader));
+   }
+   return true;
+}
+
+// every sample, starts - the access of the sample is a new one
+void BusLog::Sample(unsigned int cycle, const TraceRecord &pomrecord, bool starts)
+{
+   samples++;
+   uint8_t pomtype = pomrecord.Access();
+   if (open.type && (starts || !pomtype))
+   {
+      if (csv)
+      {
+         char pomline[64];
+         stream.Write(pomline, FormatBusTransaction(pomline, sizeof(pomline), open));
+      }
+      else
+         stream.Write(&open, sizeof(open));
+      transactions++;
+      open.type = 0;
+   }
+   if (!pomtype)
+      return;
+   if (starts)
+   {
+      open.cycle = cycle;
+      open.address = pomrecord.address;
+      open.type = pomtype;
+      open.m1 = pomrecord.mstates & 1;
+   }
+   open.data = pomrecord.data;
+}
+
+void BusLog::Close()
+{
+   if (!stream.active)
+      return;
+   TraceRecord pomnone;
+   ZeroMemory(&pomnone, sizeof(pomnone));
+   Sample(0, pomnone, false);
+   samples--;
+   printf("Bus log: %" PRIu64 " transactions in %" PRIu64 " bytes from %" PRIu64 " samples\n", transactions, stream.bytes, samples);
+   stream.Close();
+}
+
+BusLog buslog;
+
+// Stimulus (-stimulus file) - scripted levels of the input pins. Every line of the file is one transition:
+//    at <cycle> <pin> <low|high|free>
+//    on <fetch|read|write|ioread|iowrite> <hex address or port> [+<cycles>] <pin> <low|high|free>
+// pin is RESET, INT, NMI, WAIT or BUSRQ, free gives the pin back to the simulator and the devices, # starts
+// a comment. An "on" line fires every time the access happens. The timed lines get compiled into a queue sorted
+// by cycle, a bus event puts its line into the queue when the access starts, so the main loop only compares the
+// cycle with the head of the queue. The steady state hash includes the pins held and the queue by the cycles left,
+// so a state with a timed line still to come never repeats, and a skip moves the queued lines along.
+
+struct StimulusEvent
+{
+   unsigned int cycle;
+   unsigned int order; // the same cycle goes in the order of the file
+   int signal;
+   int level; // SIG_GND, SIG_VCC or SIG_FLOATING - free
+   bool operator>(const StimulusEvent &other) const { return cycle != other.cycle ? cycle > other.cycle : order > other.order; }
+};
+
+struct StimulusTrigger
+{
+   uint8_t type; // TRACE_...
+   uint16_t address;
+   unsigned int delay;
+   int signal;
+   int level;
+};
+
+class Stimulus
+{
+public:
+   Stimulus();
+   bool Load(const char *filename);
+   void Advance(unsigned int cycle);
+   void Access(unsigned int cycle, const TraceRecord &pomrecord);
+   uint64_t Hash(unsigned int cycle, uint64_t pomhash) const;
+   void Skip(unsigned int cycles);
+   std::priority_queue<StimulusEvent, vector<StimulusEvent>, std::greater<StimulusEvent> > queue;
+   vector<StimulusTrigger> triggers;
+   uint64_t mask, high; // pins the stimulus holds and their levels, bit n - signal n
+   unsigned int order, applied;
+};
+
+Stimulus::Stimulus()
+{
+   mask = high = 0;
+   order = applied = 0;
+}
+
+bool Stimulus::Load(const char *filename)
+{
+   FILE *pomfile = ::fopen(filename, "r");
+   if (!pomfile)
+   {
+      printf("Couldn't open %s as stimulus.\n", filename);
+      return false;
+   }
+   const char *pompins[] = { "RESET", "INT", "NMI", "WAIT", "BUSRQ" };
+   const int pomsignals[] = { PAD__RESET, PAD__INT, PAD__NMI, PAD__WAIT, PAD__BUSRQ };
+   const char *pomtypes[] = { "fetch", "write", "iowrite", "read", "ioread" }; // in the order of the TRACE_ bits
+   const char *pomlevels[] = { "low", "high", "free" };
+   const int pomlevelsignals[] = { SIG_GND, SIG_VCC, SIG_FLOATING };
+   char pomline[256];
+   bool pomok = true;
+   for (unsigned int l = 1; fgets(pomline, sizeof(pomline), pomfile); l++)
+   {
+      char *pomcomment = strchr(pomline, '#');
+      if (pomcomment)
+         *pomcomment = 0;
+      char pomwords[6][32];
+      int pomcount = sscanf(pomline, "%31s %31s %31s %31s %31s %31s", pomwords[0], pomwords[1], pomwords[2], pomwords[3], pomwords[4], pomwords[5]);
+      if (pomcount <= 0)
+         continue;
+
+      // the pin and the level are the last two words
+      int pomsignal = -1, pomlevel = -1;
+      if (pomcount >= 4)
+      {
+         for (int k = 0; k < 5; k++)
+            if (!strcmp(pomwords[pomcount - 2], pompins[k]))
+               pomsignal = pomsignals[k];
+         for (int k = 0; k < 3; k++)
+            if (!strcmp(pomwords[pomcount - 1], pomlevels[k]))
+               pomlevel = pomlevelsignals[k];
+      }
+      unsigned int pomcycle, pomaddress, pomdelay = 0;
+      int pomtype = -1;
+      if (!strcmp(pomwords[0], "on") && (pomcount == 5 || pomcount == 6))
+         for (int k = 0; k < 5; k++)
+            if (!strcmp(pomwords[1], pomtypes[k]))
+               pomtype = k;
+
+      if (pomsignal >= 0 && pomlevel >= 0 && pomcount == 4 && !strcmp(pomwords[0], "at") && sscanf(pomwords[1], "%u", &pomcycle) == 1)
+      {
+         StimulusEvent pomevent = { pomcycle, order++, pomsignal, pomlevel };
+         queue.push(pomevent);
+      }
+      else if (pomsignal >= 0 && pomlevel >= 0 && pomtype >= 0 && sscanf(pomwords[2], "%x", &pomaddress) == 1 && pomaddress <= 0xffff
+         && (pomcount == 5 || sscanf(pomwords[3], "+%u", &pomdelay) == 1))
+      {
+         StimulusTrigger pomtrigger = { uint8_t(1 << pomtype), uint16_t(pomaddress), pomdelay, pomsignal, pomlevel };
+         triggers.push_back(pomtrigger);
+      }
+      else
+      {
+         printf("Wrong stimulus at %s:%u.\n", filename, l);
+         pomok = false;
+      }
+   }
+   ::fclose(pomfile);
+   return pomok;
+}
+
+// applies everything due up to the cycle
+void Stimulus::Advance(unsigned int cycle)
+{
+   while (!queue.empty() && queue.top().cycle <= cycle)
+   {
+      const StimulusEvent &pomevent = queue.top();
+      uint64_t pombit = uint64_t(1) << pomevent.signal;
+      if (pomevent.level == SIG_FLOATING)
+         mask &= ~pombit;
+      else
+         mask |= pombit;
+      if (pomevent.level == SIG_VCC)
+         high |= pombit;
+      else
+         high &= ~pombit;
+      applied++;
+      queue.pop();
+   }
+}
+
+// a bus access which starts puts the lines waiting for it into the queue
+void Stimulus::Access(unsigned int cycle, const TraceRecord &pomrecord)
+{
+   uint8_t pomtype = pomrecord.Access();
+   for (unsigned int k = 0; k < triggers.size(); k++)
+   {
+      const StimulusTrigger &pomtrigger = triggers[k];
+      if (pomtrigger.type != pomtype || pomtrigger.address != (pomtype & (TRACE_IOWRITE | TRACE_IOREAD) ? pomrecord.address & 0xff : pomrecord.address))
+         continue;
+      StimulusEvent pomevent = { cycle + pomtrigger.delay, order++, pomtrigger.signal, pomtrigger.level };
+      queue.push(pomevent);
+   }
+}
+
+uint64_t Stimulus::Hash(unsigned int cycle, uint64_t pomhash) const
+{
+   pomhash = (pomhash ^ mask) * 1099511628211ULL;
+   pomhash = (pomhash ^ high) * 1099511628211ULL;
+   std::priority_queue<StimulusEvent, vector<StimulusEvent>, std::greater<StimulusEvent> > pomqueue = queue;
+   for (; !pomqueue.empty(); pomqueue.pop())
+   {
+      const StimulusEvent &pomevent = pomqueue.top();
+      uint64_t pomevents[] = { uint64_t(pomevent.cycle) - cycle, uint64_t(pomevent.signal), uint64_t(pomevent.level) };
+      for (unsigned int k = 0; k < 3; k++)
+         pomhash = (pomhash ^ pomevents[k]) * 1099511628211ULL;
+   }
+   return pomhash;
+}
+
+// the steady state skipped whole periods - the lines put in by the bus events move with the simulation
+void Stimulus::Skip(unsigned int cycles)
+{
+   vector<StimulusEvent> pomevents;
+   for (; !queue.empty(); queue.pop())
+      pomevents.push_back(queue.top());
+   for (unsigned int k = 0; k < pomevents.size(); k++)
+   {
+      pomevents[k].cycle += cycles;
+      queue.push(pomevents[k]);
+   }
+}
+
+Stimulus stimulus;
+
+// Stop conditions (-stop cond) - the run ends when any of them is met and the simulator exits with the code
+// of the condition, so a batch of runs can be sorted without reading the logs:
+//    pc:aaaa      STOP_PC        opcode fetch at the address
+//    write:aaaa   STOP_WRITE     memory write to the address
+//    out:pp       STOP_OUT       write to the port
+//    output:text  STOP_OUTPUT    the console output ends with the text (\n, \r, \t and \\ are escapes, 128 at most)
+//    halt:n       STOP_HALT      n clock cycles in HALT (it replaces the default of 15 cycles)
+//    cycles:n     STOP_CYCLES    n clock cycles
+//    time:s       STOP_TIME      s seconds of wall time
+// The address conditions are checked when a bus access starts, the others once per clock cycle.
+
+#define STOP_NONE 0
+#define STOP_PC 10
+#define STOP_WRITE 11
+#define STOP_OUT 12
+#define STOP_OUTPUT 13
+#define STOP_HALT 14
+#define STOP_CYCLES 15
+#define STOP_TIME 16
+
+class StopConditions
+{
+public:
+   StopConditions();
+   bool Add(const char *spec);
+   int Access(const TraceRecord &pomrecord);
+   int Cycle(unsigned int cycle, bool halted);
+   bool Any() const { return !pcs.empty() || !writes.empty() || !outs.empty() || !output.empty() || halt || cycles || time; }
+   vector<uint16_t> pcs, writes, outs;
+   string output;
+   unsigned int halt, cycles, time;
+   unsigned int haltcycles, lastoutput;
+   uint64_t start;
+   char reason[64];
+};
+
+StopConditions::StopConditions()
+{
+   halt = cycles = time = 0;
+   haltcycles = lastoutput = 0;
+   start = 0;
+   reason[0] = 0;
+}
+
+bool StopConditions::Add(const char *spec)
+{
+   unsigned int pomvalue;
+   if (sscanf(spec, "pc:%x", &pomvalue) == 1 && pomvalue <= 0xffff)
+      pcs.push_back(pomvalue);
+   else if (sscanf(spec, "write:%x", &pomvalue) == 1 && pomvalue <= 0xffff)
+      writes.push_back(pomvalue);
+   else if (sscanf(spec, "out:%x", &pomvalue) == 1 && pomvalue <= 0xff)
+      outs.push_back(pomvalue);
+   else if (sscanf(spec, "halt:%u", &pomvalue) == 1 && pomvalue)
+      halt = pomvalue;
+   else if (sscanf(spec, "cycles:%u", &pomvalue) == 1 && pomvalue)
+      cycles = pomvalue;
+   else if (sscanf(spec, "time:%u", &pomvalue) == 1 && pomvalue)
+      time = pomvalue;
+   else if (!strncmp(spec, "output:", 7) && spec[7])
+   {
+      output.clear();
+      for (const char *c = spec + 7; *c; c++)
+      {
+         if (*c != '\\' || !c[1])
+         {
+            output += *c;
+            continue;
+         }
+         c++;
+         output += (*c == 'n') ? '\n' : (*c == 'r') ? '\r' : (*c == 't') ? '\t' : *c;
+      }
+      // only the last CONSOLERECENT bytes of the output are kept to compare with
+      if (output.size() > CONSOLERECENT)
+      {
+         printf("Stop condition output:text longer than %u characters.\n", CONSOLERECENT);
+         output.clear();
+         return false;
+      }
+   }
+   else
+   {
+      printf("Wrong stop condition %s (pc:aaaa, write:aaaa, out:pp, output:text, halt:n, cycles:n, time:s).\n", spec);
+      return false;
+   }
+   return true;
+}
+
+// a bus access starts - returns the code of the condition met, STOP_NONE if none
+int StopConditions::Access(const TraceRecord &pomrecord)
+{
+   uint8_t pomtype = pomrecord.Access();
+   const vector<uint16_t> &pomlist = (pomtype == TRACE_FETCH) ? pcs : (pomtype == TRACE_MEMWRITE) ? writes : outs;
+   if (pomtype != TRACE_FETCH && pomtype != TRACE_MEMWRITE && pomtype != TRACE_IOWRITE)
+      return STOP_NONE;
+   uint16_t pomaddress = (pomtype == TRACE_IOWRITE) ? pomrecord.address & 0xff : pomrecord.address;
+   for (unsigned int k = 0; k < pomlist.size(); k++)
+   {
+      if (pomlist[k] != pomaddress)
+         continue;
+      snprintf(reason, sizeof(reason), "%s %04x", (pomtype == TRACE_FETCH) ? "opcode fetch at" : (pomtype == TRACE_MEMWRITE) ? "memory write to" : "write to port", pomaddress);
+      return (pomtype == TRACE_FETCH) ? STOP_PC : (pomtype == TRACE_MEMWRITE) ? STOP_WRITE : STOP_OUT;
+   }
+   return STOP_NONE;
+}
+
+// once per clock cycle
+int StopConditions::Cycle(unsigned int cycle, bool halted)
+{
+   if (!output.empty() && consoleoutput != lastoutput)
+   {
+      lastoutput = consoleoutput;
+      if (consolerecent.size() >= output.size() && !consolerecent.compare(consolerecent.size() - output.size(), output.size(), output))
+      {
+         snprintf(reason, sizeof(reason), "console output");
+         return STOP_OUTPUT;
+      }
+   }
+   haltcycles = halted ? haltcycles + 1 : 0;
+   if (halt && haltcycles >= halt)
+   {
+      snprintf(reason, sizeof(reason), "%u cycles in HALT", halt);
+      return STOP_HALT;
+   }
+   if (cycles && cycle >= cycles)
+   {
+      snprintf(reason, sizeof(reason), "cycle limit");
+      return STOP_CYCLES;
+   }
+   if (time && GetTickCount() - start >= uint64_t(time) * 1000)
+   {
+      snprintf(reason, sizeof(reason), "time limit");
+      return STOP_TIME;
+   }
+   return STOP_NONE;
+}
+
+StopConditions stops;
+
+// prints the trace or the binary bus log
+int DecodeTrace(const char *filename)
+{
+   // gzread() reads the files without compression as they are
+   gzFile pomfile = gzopen(filename, "rb");
+   if (!pomfile)
+   {
+      printf("Couldn't open %s as trace.\n", filename);
+      return 1;
+   }
+   TraceHeader pomheader;
+   bool pomread = gzread(pomfile, &pomheader, sizeof(pomheader)) == sizeof(pomheader);
+   if (pomread && !memcmp(pomheader.magic, "Z80BUS\0\0", 8) && pomheader.version == BUSVERSION
+      && pomheader.recordsize == sizeof(BusTransaction))
+   {
+      BusTransaction pomtransaction;
+      char pomline[64];
+      printf("cycle,type,address,data,m1\n");
+      while (gzread(pomfile, &pomtransaction, sizeof(pomtransaction)) == sizeof(pomtransaction))
+      {
+         FormatBusTransaction(pomline, sizeof(pomline), pomtransaction);
+         fputs(pomline, stdout);
+      }
+      gzclose(pomfile);
+      return 0;
+   }
+   if (!pomread || memcmp(pomheader.magic, "Z80TRACE", 8)
+      || pomheader.version != TRACEVERSION || pomheader.recordsize != sizeof(TraceRecord))
+   {
+      printf("%s is not a trace of this version.\n", filename);
+      gzclose(pomfile);
+      return 1;
+   }
+   TraceRecord pomrecord;
+   for (unsigned int k = 0; gzread(pomfile, &pomrecord, sizeof(pomrecord)) == sizeof(pomrecord); k++)
+   {
+      if (!(k % 25))
+         PrintTraceHeader(stdout);
+      PrintTraceRecord(stdout, pomrecord);
+   }
+   gzclose(pomfile);
+   return 0;
+}
+
+int GetPixelFromBitmapData(png::image<png::rgb_pixel>& image, int x, int y)
+{
+   if (x < 0)
+      return 0;
+   if (y < 0)
+      return 0;
+   if (x >= size_x)
+      return 0;
+   if (y >= size_y)
+      return 0;
+
+   png::rgb_pixel pixel = image[y][x];
+
+   return pixel.red + (pixel.green << 8) + (pixel.blue << 16);
+}
+
+
+bool SetPixelToBitmapData(png::image<png::rgba_pixel>& image, int x, int y, int barva)
+{
+   if (x < 0)
+      return false;
+   if (y < 0)
+      return false;
+   if (x >= size_x)
+      return false;
+   if (y >= size_y)
+      return false;
+
+   if (barva)
+      image[y][x] = png::rgba_pixel((barva >> 16) & 0xff, (barva >> 8) & 0xff, barva & 0xff, 0xff);
+   else
+      image[y][x] = png::rgba_pixel();
+
+   return true;
+}
+
+// These functions are very poorly implemented - they use recursive flood algorithm which is very slow and time consuming
+// should be reimplemented
+
+bool FillObject(int x, int y)
+{
+   if (pombuf[y * size_x + x] & type || !GetPixelFromBitmapData(bd, x, y)) {
+      return false;
+   }
+   stack_x[0] = x;
+   stack_y[0] = y;
+   int stack_ptr = 1;
+
+   while (stack_ptr > 0) {
+
+      stack_ptr--;
+      x = stack_x[stack_ptr];
+      y = stack_y[stack_ptr];
+
+      pombuf[y * size_x + x] |= type;
+      shapesize++;
+
+      for (int i = 0; i < 4; i++) {
+         int nx;
+         int ny;
+         switch (i) {
+         case 0: nx = x - 1; ny = y    ; break;
+         case 1: nx = x    ; ny = y - 1; break;
+         case 2: nx = x + 1; ny = y    ; break;
+         case 3: nx = x    ; ny = y + 1; break;
+         }
+         if (nx >= 0 && nx < size_x && ny >= 0 && ny < size_y) {
+            if (!(pombuf[ny * size_x + nx] & type) && GetPixelFromBitmapData(bd, nx, ny)) {
+               if (stack_ptr < FILL_STACK_SIZE) {
+                  stack_x[stack_ptr] = nx;
+                  stack_y[stack_ptr] = ny;
+                  stack_ptr++;
+               } else {
+                  printf("Fill stack overflow in FillObject()\n");
+                  ::exit(1);
+               }
+            }
+         }
+      }
+   }
+   return true;
+}
+
+
+bool FillStructure(int x, int y)
+{
+   if ((pombuf[y * size_x + x] & type) || (pombuf[y * size_x + x] & type2) != type3) {
+      return false;
+   }
+   stack_x[0] = x;
+   stack_y[0] = y;
+   int stack_ptr = 1;
+
+   while (stack_ptr > 0) {
+
+      stack_ptr--;
+      x = stack_x[stack_ptr];
+      y = stack_y[stack_ptr];
+
+      pombuf[y * size_x + x] |= type;
+      shapesize++;
+
+      for (int i = 0; i < 4; i++) {
+         int nx;
+         int ny;
+         switch (i) {
+         case 0: nx = x - 1; ny = y    ; break;
+         case 1: nx = x    ; ny = y - 1; break;
+         case 2: nx = x + 1; ny = y    ; break;
+         case 3: nx = x    ; ny = y + 1; break;
+         }
+         if (nx >= 0 && nx < size_x && ny >= 0 && ny < size_y) {
+            if (!(pombuf[ny * size_x + nx] & type) && (pombuf[ny * size_x + nx] & type2) == type3) {
+               if (stack_ptr < FILL_STACK_SIZE) {
+                  stack_x[stack_ptr] = nx;
+                  stack_y[stack_ptr] = ny;
+                  stack_ptr++;
+               } else {
+                  printf("Fill stack overflow in FillStructure()\n");
+                  ::exit(1);
+               }
+            }
+         }
+      }
+   }
+   return true;
+}
+
+
+bool FillStructureCheck(int x, int y)
+{
+   if ((pombuf[y * size_x + x] & type) || (pombuf[y * size_x + x] & type2) != type2) {
+      return false;
+   }
+   stack_x[0] = x;
+   stack_y[0] = y;
+   int stack_ptr = 1;
+
+   while (stack_ptr > 0) {
+
+      stack_ptr--;
+      x = stack_x[stack_ptr];
+      y = stack_y[stack_ptr];
+
+      pombuf[y * size_x + x] |= type;
+
+      if ((pombuf[y * size_x + x] & type3)) {
+         objectfound = true;
+      }
+
+      for (int i = 0; i < 4; i++) {
+         int nx;
+         int ny;
+         switch (i) {
+         case 0: nx = x - 1; ny = y    ; break;
+         case 1: nx = x    ; ny = y - 1; break;
+         case 2: nx = x + 1; ny = y    ; break;
+         case 3: nx = x    ; ny = y + 1; break;
+         }
+         if (nx >= 0 && nx < size_x && ny >= 0 && ny < size_y) {
+            if (!(pombuf[ny * size_x + nx] & type) && (pombuf[ny * size_x + nx] & type2) == type2) {
+               if (stack_ptr < FILL_STACK_SIZE) {
+                  stack_x[stack_ptr] = nx;
+                  stack_y[stack_ptr] = ny;
+                  stack_ptr++;
+               } else {
+                  printf("Fill stack overflow in FillCheckStructure()\n");
+                  ::exit(1);
+               }
+            }
+         }
+      }
+   }
+   return true;
+}
+
+void ClearTemporary()
+{
+   for (int y = 0; y < size_y; y++)
+      for (int x = 0; x < size_x; x++)
+         pombuf[y * size_x + x] &= ~TEMPORARY;
+}
+
+// opens the respective file and copies its content to pombuff which holds the layers
+void CheckFile(char *firstpart, int ltype)
+{
+   type = ltype;
+
+   char filename[256];
+   if (type == VIAS)
+      sprintf(filename, "%s%s", firstpart, "_vias.png");
+   if (type == METAL)
+      sprintf(filename, "%s%s", firstpart, "_metal.png");
+   if (type == PADS)
+      sprintf(filename, "%s%s", firstpart, "_pads.png");
+   if (type == POLYSILICON)
+      sprintf(filename, "%s%s", firstpart, "_polysilicon.png");
+   if (type == DIFFUSION)
+      sprintf(filename, "%s%s", firstpart, "_diffusion.png");
+   if (type == BURIED)
+      sprintf(filename, "%s%s", firstpart, "_buried.png");
+   if (type == ION_IMPLANTS)
+      sprintf(filename, "%s%s", firstpart, "_ions.png");
+   if (verbous)
+      printf("%s", filename);
+
+   try {
+
+      png::image<png::rgb_pixel> bitmapa(filename);
+
+      size_x = bitmapa.get_width();
+      size_y = bitmapa.get_height();
+
+      if (verbous)
+         printf(" size x: %d, y: %d\n", size_x, size_y);
+
+      if (!pombuf)
+      {
+         pombuf = new uint16_t[size_x * size_y];
+         ZeroMemory(&pombuf[0], size_x * size_y * sizeof(uint16_t));
+      }
+
+      // Assign global variable, used by FillObject
+      bd = bitmapa;
+
+      int bitmap_room = 0;
+      for (int y = 0; y < size_y; y++)
+         for (int x = 0; x < size_x; x++)
+            if (GetPixelFromBitmapData(bitmapa, x, y))
+               bitmap_room++;
+      if (verbous)
+         printf("Percentage: %.2f%%\n", 100.0 * bitmap_room / size_x / size_y);
+
+      int bitmap_count = 0;
+      for (int y = 0; y < size_y; y++)
+         for (int x = 0; x < size_x; x++)
+            if (shapesize = 0, FillObject(x, y))
+            {
+               bitmap_count++;
+               if (shapesize < MINSHAPESIZE)
+                  if (verbous)
+                     printf("Object at %d, %d is too small.\n", x, y);
+            }
+      if (verbous)
+      {
+         printf("Count: %d\n", bitmap_count);
+         printf("---------------------\n");
+      }
+
+   } catch (png::std_error e) {
+      printf("\nCannot open file: %s\n", filename);
+      ::exit(1);
+   }
+}
+
+
+// routes the signal thru all the layers - necessary for numbering the signals
+void RouteSignal(int x, int y, int sig_num, int layer)
+{
+   stack_x[0] = x;
+   stack_y[0] = y;
+   stack_layer[0] = layer;
+   int stack_ptr = 1;
+
+   while (stack_ptr > 0) {
+
+      stack_ptr--;
+      x = stack_x[stack_ptr];
+      y = stack_y[stack_ptr];
+      layer = stack_layer[stack_ptr];
+
+      switch (layer) {
+      case METAL:
+         if (!(pombuf[y * size_x + x] & METAL)) {
+            continue;
+         }
+         break;
+      case POLYSILICON:
+         if (!(pombuf[y * size_x + x] & POLYSILICON)) {
+            continue;
+         }
+         break;
+      case DIFFUSION:
+         if (!(pombuf[y * size_x + x] & REAL_DIFFUSION)) {
+            continue;
+         }
+         break;
+      }
+
+      int pomsig = 0;
+      switch (layer) {
+      case METAL:
+         pomsig = signals_metal[y * size_x + x];
+         break;
+      case POLYSILICON:
+         pomsig = signals_poly[y * size_x + x];
+         break;
+      case DIFFUSION:
+         pomsig = signals_diff[y * size_x + x];
+         break;
+      }
+      if (pomsig) {
+         if (pomsig != sig_num) {
+            if (verbous) {
+               printf("Signal mismatch %d vs %d at %d, %d\n", sig_num, pomsig, x, y);
+            }
+         }
+         continue;
+      }
+
+      switch (layer) {
+      case METAL:
+         signals_metal[y * size_x + x] = sig_num;
+         break;
+      case POLYSILICON:
+         signals_poly[y * size_x + x] = sig_num;
+         break;
+      case DIFFUSION:
+         signals_diff[y * size_x + x] = sig_num;
+         break;
+      }
+
+      for (int i = 0; i < 4; i++) {
+         int nx;
+         int ny;
+         switch (i) {
+         case 0: nx = x - 1; ny = y    ; break;
+         case 1: nx = x    ; ny = y - 1; break;
+         case 2: nx = x + 1; ny = y    ; break;
+         case 3: nx = x    ; ny = y + 1; break;
+         }
+         if (nx >= 0 && nx < size_x && ny >= 0 && ny < size_y) {
+            if (stack_ptr < FILL_STACK_SIZE) {
+               stack_x[stack_ptr] = nx;
+               stack_y[stack_ptr] = ny;
+               stack_layer[stack_ptr] = layer;
+               stack_ptr++;
+            } else {
+               printf("Fill stack overflow in RouteSignal()\n");
+               ::exit(1);
+            }
+         }
+      }
+
+      if (stack_ptr < FILL_STACK_SIZE) {
+         // These don't actually take effect until stack_ptr is incremented
+         stack_x[stack_ptr] = x;
+         stack_y[stack_ptr] = y;
+         switch (layer) {
+         case METAL:
+            if ((pombuf[y * size_x + x] & VIAS_TO_POLYSILICON)) {
+               stack_layer[stack_ptr++] = POLYSILICON;
+            } else if ((pombuf[y * size_x + x] & VIAS_TO_DIFFUSION)) {
+               stack_layer[stack_ptr++] = DIFFUSION;
+            }
+            break;
+         case POLYSILICON:
+            if ((pombuf[y * size_x + x] & VIAS_TO_POLYSILICON)) {
+               stack_layer[stack_ptr++] = METAL;
+            } else if ((pombuf[y * size_x + x] & BURIED_CONTACT)) {
+               stack_layer[stack_ptr++] = DIFFUSION;
+            }
+            break;
+         case DIFFUSION:
+            if ((pombuf[y * size_x + x] & VIAS_TO_DIFFUSION)) {
+               stack_layer[stack_ptr++] = METAL;
+            } else if ((pombuf[y * size_x + x] & BURIED_CONTACT)) {
+               stack_layer[stack_ptr++] = POLYSILICON;
+            }
+            break;
+         }
+      } else {
+         printf("Fill stack overflow in RouteSignal()\n");
+         ::exit(1);
+      }
+   }
+}
+
+int gate, source, drain;
+int sourcelen, drainlen, otherlen;
+
+// helping function for setting source and drain of the transistor
+void SetSourceDran(int x, int y, int value)
+{
+   if (!source)
+   {
+      source = value;
+      sourcelen++;
+   }
+   else
+   {
+      if (source == value)
+      {
+         sourcelen++;
+      }
+      else
+      {
+         if (!drain)
+         {
+            drain = value;
+            drainlen++;
+         }
+         else
+         {
+            if (drain == value)
+            {
+               drainlen++;
+            }
+            else
+            {
+               if (verbous)
+                  printf("Transistor has more than 3 terminals at %d %d.\n", x, y);
+            }
+         }
+      }
+   }
+}
+
+// gets the value of 8 transistors - for listing purposes
+int GetRegVal(unsigned int reg[])
+{
+   int pomvalue = 0;
+   for (int i = 7; i >= 0; i--)
+      pomvalue = (pomvalue << 1) | (transistors[reg[i]].IsOn() & 1);
+   return pomvalue;
+}
+
+// Register snapshot - the transistors of all the register bits and of the T / M states are listed in one probe
+// table, one group of 8 per byte of RegisterFile (bit l is probe l of the group as GetRegVal() has it). The charges
+// on their gates get gathered into one array and compared by whole groups, which the compiler turns into a vector
+// compare and movemask. Gates pinned by a pad and the fixed point engine are read thru IsOn() instead.
+
+#define REG_PCH 0
+#define REG_PCL 1
+#define REG_I 2
+#define REG_R 3
+#define REG_SPH 4
+#define REG_SPL 5
+#define REG_W 6
+#define REG_Z 7
+#define REG_IXH 8
+#define REG_IXL 9
+#define REG_IYH 10
+#define REG_IYL 11
+#define REG_H 12
+#define REG_L 13
+#define REG_H2 14
+#define REG_L2 15
+#define REG_D 16
+#define REG_E 17
+#define REG_D2 18
+#define REG_E2 19
+#define REG_B 20
+#define REG_C 21
+#define REG_B2 22
+#define REG_C2 23
+#define REG_A 24
+#define REG_A2 25
+#define REG_F 26
+#define REG_F2 27
+#define REG_T 28 // T1 .. T6
+#define REG_M 29 // M1 .. M5
+#define REGISTERGROUPS 30
+
+struct RegisterFile
+{
+   uint8_t values[REGISTERGROUPS];
+
+   uint16_t Pair(int high) const { return values[high] << 8 | values[high + 1]; }
+};
+
+vector<unsigned int> registerprobes; // transistor of every bit, REGISTERGROUPS * 8
+vector<const float *> registeraddresses; // where its gate charge is kept, NULL - IsOn()
+RegisterFile lastregisters;
+bool haslastregisters = false;
+bool changesonly = false; // -changes - the sample lines with nothing changed are left out
+bool samplelines = true; // -nolines - no sample lines at all
+float registeroff = -1.0f; // unused bits of the T / M groups
+
+// bits[g * 8 + l] is the transistor of bit l of group g, -1 for the unused ones
+void BuildRegisterProbes(const vector<int> &bits)
+{
+   registerprobes.assign(REGISTERGROUPS * 8, 0);
+   registeraddresses.assign(REGISTERGROUPS * 8, &registeroff);
+   for (unsigned int g = 0; g < REGISTERGROUPS; g++)
+   {
+      for (unsigned int l = 0; l < 8; l++)
+      {
+         unsigned int k = g * 8 + l;
+         if (bits[k] < 0)
+            continue;
+         unsigned int t = bits[k];
+         registerprobes[k] = t;
+         int pomgate = transistors[t].origgate;
+         if (NodeState())
+            registeraddresses[k] = (engine == ENGINE_FIXED || pomgate < FIRST_SIGNAL) ? NULL : &nodecharge[pomgate];
+         else if (engine == ENGINE_FUSED)
+            registeraddresses[k] = &fusedcharge[fusedslots[3 * t + GATE - 1]];
+         else
+            registeraddresses[k] = &transistors[t].gatecharge;
+      }
+   }
+   haslastregisters = false;
+}
+
+// returns true when anything changed since the previous snapshot
+bool SnapshotRegisters(RegisterFile &pomregisters)
+{
+   float pomcharges[REGISTERGROUPS * 8];
+   for (unsigned int k = 0; k < REGISTERGROUPS * 8; k++)
+   {
+      if (registeraddresses[k])
+         pomcharges[k] = *registeraddresses[k];
+      else
+         pomcharges[k] = transistors[registerprobes[k]].IsOn() ? 1.0f : -1.0f;
+   }
+   for (unsigned int g = 0; g < REGISTERGROUPS; g++)
+   {
+      uint8_t pombits = 0;
+      for (unsigned int l = 0; l < 8; l++)
+         pombits |= (pomcharges[g * 8 + l] > 0.0f) << l;
+      pomregisters.values[g] = pombits;
+   }
+   bool pomchanged = !haslastregisters || memcmp(&pomregisters, &lastregisters, sizeof(RegisterFile));
+   lastregisters = pomregisters;
+   haslastregisters = true;
+   return pomchanged;
+}
+
+void WriteTransCoords(int bit7, int bit6, int bit5, int bit4, int bit3, int bit2, int bit1, int bit0)
+{
+   printf("[%d, %d], ", transistors[bit7].x, transistors[bit7].y);
+   printf("[%d, %d], ", transistors[bit6].x, transistors[bit6].y);
+   printf("[%d, %d], ", transistors[bit5].x, transistors[bit5].y);
+   printf("[%d, %d], ", transistors[bit4].x, transistors[bit4].y);
+   printf("[%d, %d], ", transistors[bit3].x, transistors[bit3].y);
+   printf("[%d, %d], ", transistors[bit2].x, transistors[bit2].y);
+   printf("[%d, %d], ", transistors[bit1].x, transistors[bit1].y);
+   printf("[%d, %d]", transistors[bit0].x, transistors[bit0].y);
+}
+
+// finds the transistor by coordinates - the coordinations must be upper - left corner ie the most top (first) and most left (second) corner
+int FindTransistor(unsigned int x, unsigned int y)
+{
+   for (unsigned int i = 0; i < transistors.size(); i++)
+      if (transistors[i].x == x && transistors[i].y == y)
+         return i;
+   printf("--- Error --- Transistor at %d, %d not found.\n", x, y);
+   return -1;
+}
+
+// level of the pad as the bus sampling sees it - SIG_GND, SIG_VCC or SIG_FLOATING
+int PadLevel(Pad &pad)
+{
+   if (pad.type == PAD_INPUT)
+      return pad.ReadInputStatus();
+   if ((pad.type == PAD_BIDIRECTIONAL) && (pad.ReadInputStatus() != SIG_FLOATING))
+      return pad.ReadInputStatus();
+   return pad.ReadOutputStatus();
+}
+
+string PadName(int signal)
+{
+   char pomname[16];
+   if (signal >= PAD_A0 && signal <= PAD_A15)
+      snprintf(pomname, sizeof(pomname), "A%d", signal - PAD_A0);
+   else if (signal >= PAD_D0 && signal <= PAD_D7)
+      snprintf(pomname, sizeof(pomname), "D%d", signal - PAD_D0);
+   else
+   {
+      const char *pomcontrol[] = { "_RESET", "_WAIT", "_INT", "_NMI", "_BUSRQ", "_M1", "_RD", "_WR", "_MREQ", "_IORQ", "_RFSH" };
+      if (signal == PAD_CLK)
+         return "CLK";
+      if (signal == PAD__HALT)
+         return "_HALT";
+      if (signal == PAD__BUSAK)
+         return "_BUSAK";
+      if (signal >= PAD__RESET && signal <= PAD__RFSH)
+         return pomcontrol[signal - PAD__RESET];
+      snprintf(pomname, sizeof(pomname), "PAD%d", signal);
+   }
+   return pomname;
+}
+
+// VCD waveform (-vcd file, .gz gets compressed) - the pads and the nodes given by -vcdnodes are checked after
+// every iteration and only their changes get written, one time unit is one iteration. The text is collected
+// in VCDBUFFER sized blocks for the output thread. A node is 1 above and 0 below the thresholds the pads are read with, x between them.
+
+#define VCDBUFFER (1 << 20)
+
+class VcdWriter
+{
+public:
+   VcdWriter();
+   bool Open(const char *filename);
+   void AddNodes(const char *list);
+   void Start();
+   void Sample(unsigned int iteration);
+   void Flush();
+   void Close();
+   vector<int> watched; // pad index for the pads, -1 - signal of the node
+   vector<int> watchedsignals;
+   vector<string> watchednames, ids;
+   vector<char> values;
+   vector<string> nodelist; // -vcdnodes as given, resolved by Start()
+   string buffer;
+   OutputStream stream;
+   uint64_t changes;
+};
+
+VcdWriter::VcdWriter()
+{
+   changes = 0;
+}
+
+bool VcdWriter::Open(const char *filename)
+{
+   return stream.Open(filename);
+}
+
+// comma separated signal numbers or transistor coordinates x/y (the node on the gate of the transistor)
+void VcdWriter::AddNodes(const char *list)
+{
+   string pomlist = list;
+   size_t pomstart = 0;
+   while (pomstart <= pomlist.size())
+   {
+      size_t pomend = pomlist.find(',', pomstart);
+      if (pomend == string::npos)
+         pomend = pomlist.size();
+      if (pomend > pomstart)
+         nodelist.push_back(pomlist.substr(pomstart, pomend - pomstart));
+      pomstart = pomend + 1;
+   }
+}
+
+void VcdWriter::Start()
+{
+   if (!stream.active)
+      return;
+   for (unsigned int j = 0; j < pads.size(); j++)
+   {
+      watched.push_back(j);
+      watchedsignals.push_back(pads[j].origsignal);
+      watchednames.push_back(PadName(pads[j].origsignal));
+   }
+   unsigned int pompads = watched.size();
+   for (unsigned int k = 0; k < nodelist.size(); k++)
+   {
+      const char *pomitem = nodelist[k].c_str();
+      unsigned int x, y;
+      int pomsignal = -1;
+      char pomname[32];
+      if (sscanf(pomitem, "%u/%u", &x, &y) == 2)
+      {
+         int t = FindTransistor(x, y);
+         if (t >= 0)
+            pomsignal = transistors[t].origgate;
+         snprintf(pomname, sizeof(pomname), "t%u_%u", x, y);
+      }
+      else
+      {
+         pomsignal = atoi(pomitem);
+         snprintf(pomname, sizeof(pomname), "n%d", pomsignal);
+      }
+      if (pomsignal <= SIG_VCC || pomsignal >= int(signals.size()) || signals[pomsignal].ignore)
+      {
+         printf("No node %s to trace in VCD.\n", pomitem);
+         continue;
+      }
+      watched.push_back(-1);
+      watchedsignals.push_back(pomsignal);
+      watchednames.push_back(pomname);
+   }
+
+   // identifiers are printable characters 33 - 126 as base 94 numbers
+   for (unsigned int k = 0; k < watched.size(); k++)
+   {
+      string pomid;
+      unsigned int pomnumber = k;
+      do
+      {
+         pomid += char(33 + pomnumber % 94);
+         pomnumber /= 94;
+      } while (pomnumber);
+      ids.push_back(pomid);
+   }
+
+   buffer.reserve(VCDBUFFER + 4096);
+   buffer += "$version Z80_Simulator $end\n$timescale 1 ns $end\n$scope module z80 $end\n";
+   for (unsigned int k = 0; k < watched.size(); k++)
+   {
+      if (k == pompads)
+         buffer += "$scope module nodes $end\n";
+      buffer += "$var wire 1 " + ids[k] + " " + watchednames[k] + " $end\n";
+   }
+   if (watched.size() > pompads)
+      buffer += "$upscope $end\n";
+   buffer += "$upscope $end\n$enddefinitions $end\n";
+   values.assign(watched.size(), 0);
+}
+
+void VcdWriter::Sample(unsigned int iteration)
+{
+   bool pomtime = false;
+   for (unsigned int k = 0; k < watched.size(); k++)
+   {
+      int pomlevel;
+      if (watched[k] >= 0)
+         pomlevel = PadLevel(pads[watched[k]]);
+      else
+      {
+         float pomratio = SignalRatio(watchedsignals[k]);
+         pomlevel = (pomratio < -0.05f) ? SIG_GND : (pomratio > 0.05f) ? SIG_VCC : SIG_FLOATING;
       }
+      char pomvalue = (pomlevel == SIG_GND) ? '0' : (pomlevel == SIG_VCC) ? '1' : (watched[k] >= 0) ? 'z' : 'x';
+      if (pomvalue == values[k])
+         continue;
+      if (!pomtime)
+      {
+         char pomstamp[16];
+         snprintf(pomstamp, sizeof(pomstamp), "#%u\n", iteration);
+         buffer += pomstamp;
+         pomtime = true;
+      }
+      values[k] = pomvalue;
+      buffer += pomvalue;
+      buffer += ids[k];
+      buffer += '\n';
+      changes++;
+   }
+   if (buffer.size() >= VCDBUFFER)
+      Flush();
+}
 
-      if (stack_ptr < FILL_STACK_SIZE) {
-         // These don't actually take effect until stack_ptr is incremented
-         stack_x[stack_ptr] = x;
-         stack_y[stack_ptr] = y;
-         switch (layer) {
-         case METAL:
-            if ((pombuf[y * size_x + x] & VIAS_TO_POLYSILICON)) {
-               stack_layer[stack_ptr++] = POLYSILICON;
-            } else if ((pombuf[y * size_x + x] & VIAS_TO_DIFFUSION)) {
-               stack_layer[stack_ptr++] = DIFFUSION;
-            }
-            break;
-         case POLYSILICON:
-            if ((pombuf[y * size_x + x] & VIAS_TO_POLYSILICON)) {
-               stack_layer[stack_ptr++] = METAL;
-            } else if ((pombuf[y * size_x + x] & BURIED_CONTACT)) {
-               stack_layer[stack_ptr++] = DIFFUSION;
-            }
-            break;
-         case DIFFUSION:
-            if ((pombuf[y * size_x + x] & VIAS_TO_DIFFUSION)) {
-               stack_layer[stack_ptr++] = METAL;
-            } else if ((pombuf[y * size_x + x] & BURIED_CONTACT)) {
-               stack_layer[stack_ptr++] = POLYSILICON;
-            }
-            break;
+void VcdWriter::Flush()
+{
+   if (buffer.empty())
+      return;
+   stream.Write(buffer.data(), buffer.size());
+   buffer.clear();
+}
+
+void VcdWriter::Close()
+{
+   if (!stream.active)
+      return;
+   Flush();
+   printf("VCD: %u signals, %" PRIu64 " value changes written\n", (unsigned int) watched.size(), changes);
+   stream.Close();
+}
+
+VcdWriter vcd;
+
+void CheckTransistor(int x, int y)
+{
+   if ((pombuf[y * size_x + x] & (TRANSISTORS | TEMPORARY)) != TRANSISTORS)
+      return;
+
+   if (!signals_poly[y * size_x + x])
+      if (verbous)
+         printf("Transistor with no signal in gate at: %d %d.\n", x, y);
+   if (!gate)
+      gate = signals_poly[y * size_x + x];
+   if (gate != signals_poly[y * size_x + x])
+      if (verbous)
+         printf("Ambiguous signals in poly for transistor at: %d %d.\n", x, y);
+
+   pombuf[y * size_x + x] |= TEMPORARY;
+   shapesize++;
+
+   if (x)
+   {
+      if ((pombuf[y * size_x + x - 1] & TRANSISTORS))
+      {
+         CheckTransistor(x - 1, y);
+      }
+      else
+      {
+         if ((pombuf[y * size_x + x - 1] & DIFFUSION))
+            SetSourceDran(x, y, signals_diff[y * size_x + x - 1]);
+         else
+            otherlen++;
+      }
+   }
+   if (y)
+   {
+      if ((pombuf[(y - 1) * size_x + x] & TRANSISTORS))
+      {
+         CheckTransistor(x, y - 1);
+      }
+      else
+      {
+         if ((pombuf[(y - 1) * size_x + x] & DIFFUSION))
+            SetSourceDran(x, y, signals_diff[(y - 1) * size_x + x]);
+         else
+            otherlen++;
+      }
+   }
+   if (x < size_x - 1)
+   {
+      if ((pombuf[y * size_x + x + 1] & TRANSISTORS))
+      {
+         CheckTransistor(x + 1, y);
+      }
+      else
+      {
+         if ((pombuf[y * size_x + x + 1] & DIFFUSION))
+            SetSourceDran(x, y, signals_diff[y * size_x + x + 1]);
+         else
+            otherlen++;
+      }
+   }
+   if (y < size_y - 1)
+   {
+      if ((pombuf[(y + 1) * size_x + x] & TRANSISTORS))
+      {
+         CheckTransistor(x, y + 1);
+      }
+      else
+      {
+         if ((pombuf[(y + 1) * size_x + x] & DIFFUSION))
+            SetSourceDran(x, y, signals_diff[(y + 1) * size_x + x]);
+         else
+            otherlen++;
+      }
+   }
+}
+
+void SetupPad(int x, int y, int signalnum, int padtype)
+{
+   Pad tmppad;
+
+   tmppad.x = x;
+   tmppad.y = y;
+   tmppad.origsignal = signalnum;
+   tmppad.type = padtype;
+   pads.push_back(tmppad);
+   RouteSignal(tmppad.x, tmppad.y, tmppad.origsignal, METAL);
+}
+
+// Program loader - -load spec puts a program into memory[], the specs are loaded in the order given:
+//    file@ssss[:oooo[:llll]]   raw binary at address ssss, optionally from offset oooo of the file and llll bytes long
+//                              (the file gets mapped, so only the window is read from a large banked image)
+//    file.hex / file.ihx       Intel HEX
+//    file.s19 / .s28 / .s37 / .srec / .mot   Motorola S-record
+//    snapshot:file             memory and ports as -savesnapshot wrote them
+// All numbers are hexadecimal. The first program loaded (or -memfile) replaces the built-in test program, a load
+// which overwrites bytes of a previous one gets reported. A loader of its own puts the programs of the batch lanes
+// and the farm jobs into the memory of the lane the same way.
+
+#define SNAPSHOTSIZE (8 + 65536 + 256)
+
+class Loader
+{
+public:
+   Loader(uint8_t *pommemory, uint8_t *pomports);
+   bool Load(const char *spec);
+   bool LoadRaw(const char *filename, unsigned int address, unsigned int offset, unsigned int length);
+   bool LoadIntelHex(const char *filename);
+   bool LoadSRecord(const char *filename);
+   bool LoadSnapshot(const char *filename);
+   bool Store(unsigned int address, const uint8_t *data, unsigned int length);
+   void Start();
+   uint8_t *target, *targetports; // memory[] and ports[], or the ones of a lane
+   vector<uint8_t> loaded; // bytes of the target some load wrote
+   bool used;
+   unsigned int bytes, overlaps;
+};
+
+Loader::Loader(uint8_t *pommemory, uint8_t *pomports)
+{
+   target = pommemory;
+   targetports = pomports;
+   used = false;
+   bytes = overlaps = 0;
+}
+
+// the first load clears the built-in program
+void Loader::Start()
+{
+   if (used)
+      return;
+   ZeroMemory(target, 65536 * sizeof(uint8_t));
+   loaded.assign(65536, 0);
+   used = true;
+}
+
+bool Loader::Store(unsigned int address, const uint8_t *data, unsigned int length)
+{
+   if (address + length > 65536)
+      return false;
+   Start();
+   for (unsigned int k = address; k < address + length; k++)
+   {
+      overlaps += loaded[k];
+      loaded[k] = 1;
+   }
+   memcpy(&target[address], data, length);
+   bytes += length;
+   return true;
+}
+
+bool Loader::LoadRaw(const char *filename, unsigned int address, unsigned int offset, unsigned int length)
+{
+   int pomfd = open(filename, O_RDONLY);
+   if (pomfd < 0)
+   {
+      printf("Couldn't open %s as program.\n", filename);
+      return false;
+   }
+   struct stat pomstat;
+   if (fstat(pomfd, &pomstat) || offset > (uint64_t) pomstat.st_size)
+   {
+      printf("Offset %x is past the end of %s.\n", offset, filename);
+      close(pomfd);
+      return false;
+   }
+   uint64_t pomavailable = pomstat.st_size - offset;
+   if (!length || length > pomavailable)
+      length = pomavailable;
+   if (address > 0xffff)
+   {
+      printf("Destination address out of limit (0 - ffff): %x.\n", address);
+      close(pomfd);
+      return false;
+   }
+   if (address + length > 65536)
+   {
+      printf("Program %s too long for specified destination address (%x). Only part will be read.\n", filename, address);
+      length = 65536 - address;
+   }
+   if (!length)
+   {
+      close(pomfd);
+      return true;
+   }
+
+   // only the pages of the window get read
+   unsigned int pompage = sysconf(_SC_PAGESIZE);
+   unsigned int pomstart = offset / pompage * pompage;
+   void *pommap = mmap(NULL, offset - pomstart + length, PROT_READ, MAP_PRIVATE, pomfd, pomstart);
+   close(pomfd);
+   if (pommap == MAP_FAILED)
+   {
+      printf("Couldn't map %s.\n", filename);
+      return false;
+   }
+   Store(address, (const uint8_t *) pommap + (offset - pomstart), length);
+   munmap(pommap, offset - pomstart + length);
+   return true;
+}
+
+// two hex digits
+int HexByte(const char *text)
+{
+   int pomvalue = 0;
+   for (int k = 0; k < 2; k++)
+   {
+      char c = text[k];
+      int pomdigit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+      if (pomdigit < 0)
+         return -1;
+      pomvalue = pomvalue << 4 | pomdigit;
+   }
+   return pomvalue;
+}
+
+// the bytes of a record after the first pomskip characters, false if any of them is not hex
+bool HexBytes(const char *line, unsigned int pomskip, vector<uint8_t> &pombytes)
+{
+   pombytes.clear();
+   unsigned int pomlength = strlen(line);
+   while (pomlength && (line[pomlength - 1] == '\n' || line[pomlength - 1] == '\r' || line[pomlength - 1] == ' '))
+      pomlength--;
+   if (pomlength < pomskip || (pomlength - pomskip) & 1)
+      return false;
+   for (unsigned int k = pomskip; k < pomlength; k += 2)
+   {
+      int pomvalue = HexByte(line + k);
+      if (pomvalue < 0)
+         return false;
+      pombytes.push_back(pomvalue);
+   }
+   return true;
+}
+
+bool Loader::LoadIntelHex(const char *filename)
+{
+   FILE *pomfile = ::fopen(filename, "r");
+   if (!pomfile)
+   {
+      printf("Couldn't open %s as program.\n", filename);
+      return false;
+   }
+   char pomline[1024];
+   vector<uint8_t> pombytes;
+   unsigned int pombase = 0;
+   bool pomok = true;
+   for (unsigned int l = 1; pomok && fgets(pomline, sizeof(pomline), pomfile); l++)
+   {
+      if (pomline[0] != ':')
+         continue;
+      // count, address, type, data, checksum - all the bytes sum up to 0
+      uint8_t pomsum = 0;
+      if (!HexBytes(pomline, 1, pombytes) || pombytes.size() < 5 || pombytes.size() != 5u + pombytes[0])
+      {
+         printf("Wrong Intel HEX record at %s:%u.\n", filename, l);
+         pomok = false;
+         break;
+      }
+      for (unsigned int k = 0; k < pombytes.size(); k++)
+         pomsum += pombytes[k];
+      if (pomsum)
+      {
+         printf("Wrong checksum at %s:%u.\n", filename, l);
+         pomok = false;
+         break;
+      }
+      unsigned int pomaddress = pombytes[1] << 8 | pombytes[2];
+      switch (pombytes[3])
+      {
+      case 0x00:
+         if (!Store(pombase + pomaddress, &pombytes[4], pombytes[0]))
+         {
+            printf("Data out of the 64k at %s:%u.\n", filename, l);
+            pomok = false;
          }
-      } else {
-         printf("Fill stack overflow in RouteSignal()\n");
-         ::exit(1);
+         break;
+      case 0x01:
+         ::fclose(pomfile);
+         return true;
+      case 0x02: // extended segment address
+         pombase = (pombytes[0] == 2) ? (pombytes[4] << 8 | pombytes[5]) << 4 : 0;
+         break;
+      case 0x04: // extended linear address
+         pombase = (pombytes[0] == 2) ? (pombytes[4] << 8 | pombytes[5]) << 16 : 0;
+         break;
+      }
+   }
+   ::fclose(pomfile);
+   return pomok;
+}
+
+bool Loader::LoadSRecord(const char *filename)
+{
+   FILE *pomfile = ::fopen(filename, "r");
+   if (!pomfile)
+   {
+      printf("Couldn't open %s as program.\n", filename);
+      return false;
+   }
+   char pomline[1024];
+   vector<uint8_t> pombytes;
+   bool pomok = true;
+   for (unsigned int l = 1; pomok && fgets(pomline, sizeof(pomline), pomfile); l++)
+   {
+      if (pomline[0] != 'S')
+         continue;
+      // count, address, data, checksum - the checksum is the ones' complement of the sum of the others
+      int pomtype = pomline[1] - '0';
+      if (pomtype < 0 || pomtype > 9 || !HexBytes(pomline, 2, pombytes) || pombytes.size() < 3 || pombytes.size() != 1u + pombytes[0])
+      {
+         printf("Wrong S-record at %s:%u.\n", filename, l);
+         pomok = false;
+         break;
+      }
+      uint8_t pomsum = 0;
+      for (unsigned int k = 0; k < pombytes.size(); k++)
+         pomsum += pombytes[k];
+      if (pomsum != 0xff)
+      {
+         printf("Wrong checksum at %s:%u.\n", filename, l);
+         pomok = false;
+         break;
+      }
+      if (pomtype < 1 || pomtype > 3)
+         continue;
+      unsigned int pomaddresslength = pomtype + 1;
+      if (pombytes.size() < 2 + pomaddresslength)
+      {
+         printf("Wrong S-record at %s:%u.\n", filename, l);
+         pomok = false;
+         break;
+      }
+      unsigned int pomaddress = 0;
+      for (unsigned int k = 0; k < pomaddresslength; k++)
+         pomaddress = pomaddress << 8 | pombytes[1 + k];
+      if (!Store(pomaddress, &pombytes[1 + pomaddresslength], pombytes.size() - 2 - pomaddresslength))
+      {
+         printf("Data out of the 64k at %s:%u.\n", filename, l);
+         pomok = false;
       }
    }
+   ::fclose(pomfile);
+   return pomok;
 }
 
-int gate, source, drain;
-int sourcelen, drainlen, otherlen;
+bool Loader::LoadSnapshot(const char *filename)
+{
+   FILE *pomfile = ::fopen(filename, "rb");
+   if (!pomfile)
+   {
+      printf("Couldn't open %s as snapshot.\n", filename);
+      return false;
+   }
+   vector<uint8_t> pomsnapshot(SNAPSHOTSIZE);
+   bool pomok = fread(&pomsnapshot[0], 1, SNAPSHOTSIZE, pomfile) == SNAPSHOTSIZE && !memcmp(&pomsnapshot[0], "Z80SNAP\0", 8);
+   ::fclose(pomfile);
+   if (!pomok)
+   {
+      printf("%s is not a snapshot.\n", filename);
+      return false;
+   }
+   Store(0, &pomsnapshot[8], 65536);
+   memcpy(targetports, &pomsnapshot[8 + 65536], 256);
+   return true;
+}
+
+bool SaveSnapshot(const char *filename)
+{
+   FILE *pomfile = ::fopen(filename, "wb");
+   if (!pomfile)
+   {
+      printf("Couldn't open %s as snapshot.\n", filename);
+      return false;
+   }
+   fwrite("Z80SNAP\0", 1, 8, pomfile);
+   fwrite(memory, 1, 65536, pomfile);
+   fwrite(ports, 1, 256, pomfile);
+   ::fclose(pomfile);
+   return true;
+}
+
+bool Loader::Load(const char *spec)
+{
+   unsigned int pombytes = bytes, pomoverlaps = overlaps;
+   bool pomok;
+   string pomspec = spec;
+   size_t pomat = pomspec.rfind('@');
+   size_t pomdot = pomspec.rfind('.');
+   string pomextension = (pomdot == string::npos) ? "" : pomspec.substr(pomdot + 1);
+   for (unsigned int k = 0; k < pomextension.size(); k++)
+      pomextension[k] = tolower(pomextension[k]);
+   if (!pomspec.compare(0, 9, "snapshot:"))
+      pomok = LoadSnapshot(spec + 9);
+   else if (pomat != string::npos)
+   {
+      unsigned int pomaddress = 0, pomoffset = 0, pomlength = 0;
+      if (sscanf(spec + pomat + 1, "%x:%x:%x", &pomaddress, &pomoffset, &pomlength) < 1)
+      {
+         printf("Destination address expected in %s.\n", spec);
+         return false;
+      }
+      pomok = LoadRaw(pomspec.substr(0, pomat).c_str(), pomaddress, pomoffset, pomlength);
+   }
+   else if (pomextension == "hex" || pomextension == "ihx")
+      pomok = LoadIntelHex(spec);
+   else if (pomextension == "s19" || pomextension == "s28" || pomextension == "s37" || pomextension == "srec" || pomextension == "mot")
+      pomok = LoadSRecord(spec);
+   else
+   {
+      printf("Unknown program format of %s (file@address for raw binary).\n", spec);
+      return false;
+   }
+   if (pomok)
+      printf("Loaded %s: %u bytes%s\n", spec, bytes - pombytes, (overlaps != pomoverlaps) ? ", overwriting a previous load" : "");
+   return pomok;
+}
+
+Loader loader(memory, ports);
+
+// one Z80 of the batch - its own memory, ports and state of the bus, the same as the simulation in main() keeps
+class BatchLane
+{
+public:
+   BatchLane();
+   vector<uint8_t> lanememory;
+   uint8_t laneports[256];
+   int lastadr, lastdata, pomadr;
+   bool pom_wr, pom_rd, pom_mreq, pom_iorq, pom_halt;
+   bool justwasoutput;
+   int outcounter;
+   bool active;
+   bool halted;
+   bool trace; // bus transactions get printed
+   unsigned int iterations;
+   uint64_t maxiterations; // 0 means no limit
+   int pc;
+   FILE *outfile;
+};
+
+// the gate nodes of the transistors the batch reads - M1 and the program counter
+class BatchProbes
+{
+public:
+   int m1;
+   int pcl[8], pch[8];
+};
 
-// helping function for setting source and drain of the transistor
-void SetSourceDran(int x, int y, int value)
+BatchLane::BatchLane()
 {
-   if (!source)
+   lanememory.assign(memory, memory + 65536);
+   memcpy(laneports, ports, sizeof(laneports));
+   lastadr = lastdata = pomadr = 0;
+   pom_wr = pom_rd = pom_mreq = pom_iorq = pom_halt = true;
+   justwasoutput = false;
+   outcounter = 0;
+   active = halted = false;
+   trace = true;
+   iterations = maxiterations = 0;
+   pc = 0;
+   outfile = NULL;
+}
+
+// drives the data bus of the lane from its memory / ports
+void DriveBatchLane(const BatchLane &pomlane, int lane)
+{
+   for (unsigned int j = 0; j < pads.size(); j++)
    {
-      source = value;
-      sourcelen++;
+      int pomsignal = pads[j].origsignal;
+      if (pads[j].type == PAD_BIDIRECTIONAL)
+      {
+         int pombit = 1 << (pomsignal - PAD_D0);
+         if (pomlane.pom_rd) // nothing is read
+            BatchSetPad(pads[j], lane, SIG_FLOATING);
+         else if (!pomlane.pom_mreq) // memory is read
+            BatchSetPad(pads[j], lane, (pomlane.lanememory[pomlane.lastadr] & pombit) ? SIG_VCC : SIG_GND);
+         else if (!pomlane.pom_iorq) // I/O is read
+            BatchSetPad(pads[j], lane, (pomlane.laneports[pomlane.lastadr & 0xff] & pombit) ? SIG_VCC : SIG_GND);
+      }
    }
-   else
+}
+
+// reads the bus of the lane and does what the simulation in main() does with it, returns false when the lane halted
+bool SampleBatchLane(BatchLane &pomlane, int lane, unsigned int number, unsigned int i, bool pom_rst, const BatchProbes &probes)
+{
+   for (unsigned int j = 0; j < pads.size(); j++)
    {
-      if (source == value)
+      int pomsignal = pads[j].origsignal;
+      if (pads[j].type == PAD_INPUT)
+         continue;
+      bool pomhigh = (BatchReadPad(pads[j], lane) == SIG_VCC);
+      if (pomsignal == PAD__HALT)
+         pomlane.pom_halt = pomhigh;
+      else if (pomsignal == PAD__RD)
+         pomlane.pom_rd = pomhigh;
+      else if (pomsignal == PAD__WR)
+         pomlane.pom_wr = pomhigh;
+      else if (pomsignal == PAD__MREQ)
+         pomlane.pom_mreq = pomhigh;
+      else if (pomsignal == PAD__IORQ)
+         pomlane.pom_iorq = pomhigh;
+      else if (pomsignal >= PAD_A0 && pomsignal <= PAD_A15)
       {
-         sourcelen++;
+         pomlane.pomadr &= ~(1 << (pomsignal - PAD_A0));
+         pomlane.pomadr |= pomhigh ? (1 << (pomsignal - PAD_A0)) : 0;
       }
-      else
+      else if (pomsignal >= PAD_D0 && pomsignal <= PAD_D7)
       {
-         if (!drain)
-         {
-            drain = value;
-            drainlen++;
-         }
-         else
+         pomlane.lastdata &= ~(1 << (pomsignal - PAD_D0));
+         pomlane.lastdata |= pomhigh ? (1 << (pomsignal - PAD_D0)) : 0;
+      }
+   }
+
+   bool pomm1 = BatchNodeIsOn(probes.m1, lane);
+   if (pomlane.trace && !pomlane.pom_rd && !pomlane.pom_mreq && pomm1)
+      printf("lane %u %07u: ***** OPCODE FETCH: %04x[%02x]\n", number, i, pomlane.pomadr, pomlane.lanememory[pomlane.pomadr]);
+
+   if (!pomlane.pom_mreq || !pomlane.pom_iorq)
+   {
+      pomlane.lastadr = pomlane.pomadr; // gets the valid address
+      if (!pom_rst)
+      {
+         if (!pomlane.pom_wr)
          {
-            if (drain == value)
+            if (!pomlane.pom_mreq)
             {
-               drainlen++;
+               pomlane.lanememory[pomlane.lastadr] = pomlane.lastdata;
+               if (pomlane.trace)
+                  printf("lane %u %07u: MEMORY WRITE: %04x[%02x]\n", number, i, pomlane.lastadr, pomlane.lastdata);
             }
-            else
+            if (!pomlane.pom_iorq)
             {
-               if (verbous)
-                  printf("Transistor has more than 3 terminals at %d %d.\n", x, y);
+               pomlane.laneports[pomlane.lastadr & 0xff] = pomlane.lastdata;
+               if (pomlane.trace)
+                  printf("lane %u %07u: I/O WRITE: %04x[%02x]\n", number, i, pomlane.lastadr, pomlane.lastdata);
+               if (!(pomlane.lastadr & 0xff))
+                  pomlane.justwasoutput = true;
             }
          }
+         else if (pomlane.justwasoutput)
+         {
+            pomlane.justwasoutput = false;
+            if (pomlane.outfile)
+               fputc(pomlane.laneports[0], pomlane.outfile);
+         }
+         if (pomlane.trace && !pomlane.pom_rd)
+         {
+            if (!pomlane.pom_mreq && !pomm1)
+               printf("lane %u %07u: MEMORY READ: %04x[%02x]\n", number, i, pomlane.lastadr, pomlane.lanememory[pomlane.lastadr]);
+            if (!pomlane.pom_iorq)
+               printf("lane %u %07u: I/O READ: %04x[%02x]\n", number, i, pomlane.lastadr, pomlane.laneports[pomlane.lastadr & 0xff]);
+         }
       }
    }
+
+   if (!pomlane.pom_halt && !pom_rst)
+      pomlane.outcounter++;
+   else
+      pomlane.outcounter = 0;
+   return pomlane.outcounter < 150;
 }
 
-// gets the value of 8 transistors - for listing purposes
-int GetRegVal(unsigned int reg[])
+int GetBatchRegVal(const int reg[], int lane)
 {
    int pomvalue = 0;
    for (int i = 7; i >= 0; i--)
-      pomvalue = (pomvalue << 1) | (transistors[reg[i]].IsOn() & 1);
+      pomvalue = (pomvalue << 1) | (BatchNodeIsOn(reg[i], lane) & 1);
    return pomvalue;
 }
 
-void WriteTransCoords(int bit7, int bit6, int bit5, int bit4, int bit3, int bit2, int bit1, int bit0)
+// runs the group of BATCHLANES lanes until every lane halts or reaches its limit, such lanes are masked off -
+// their bus is not sampled any more and they do not count to the throughput
+void RunBatchGroup(BatchLane *grouplanes[], unsigned int first, const BatchProbes &probes)
 {
-   printf("[%d, %d], ", transistors[bit7].x, transistors[bit7].y);
-   printf("[%d, %d], ", transistors[bit6].x, transistors[bit6].y);
-   printf("[%d, %d], ", transistors[bit5].x, transistors[bit5].y);
-   printf("[%d, %d], ", transistors[bit4].x, transistors[bit4].y);
-   printf("[%d, %d], ", transistors[bit3].x, transistors[bit3].y);
-   printf("[%d, %d], ", transistors[bit2].x, transistors[bit2].y);
-   printf("[%d, %d], ", transistors[bit1].x, transistors[bit1].y);
-   printf("[%d, %d]", transistors[bit0].x, transistors[bit0].y);
+   BuildBatchNetlist();
+
+   for (unsigned int i = 0; i < 1000000000; i++)
+   {
+      // clock and reset are common for all the lanes
+      bool resetactive = i < DIVISOR * 8;
+      for (unsigned int j = 0; j < pads.size(); j++)
+      {
+         if (pads[j].origsignal == PAD__RESET)
+            pads[j].SetInputSignal(resetactive ? SIG_GND : SIG_VCC);
+         else if (pads[j].origsignal == PAD_CLK)
+            pads[j].SetInputSignal(((i / DIVISOR) & 1) ? SIG_VCC : SIG_GND);
+         else if (pads[j].type == PAD_INPUT)
+            pads[j].SetInputSignal(SIG_VCC);
+      }
+      for (int l = 0; l < BATCHLANES; l++)
+         DriveBatchLane(*grouplanes[l], l);
+
+      BatchIteration();
+
+      if (!(i % (DIVISOR / 5)))
+      {
+         bool pomactive = false;
+         for (int l = 0; l < BATCHLANES; l++)
+         {
+            BatchLane &pomlane = *grouplanes[l];
+            if (!pomlane.active)
+               continue;
+            pomlane.iterations = i;
+            pomlane.halted = !SampleBatchLane(pomlane, l, first + l, i, resetactive, probes);
+            if (pomlane.halted || (pomlane.maxiterations && i >= pomlane.maxiterations))
+            {
+               pomlane.active = false;
+               pomlane.pc = (GetBatchRegVal(probes.pch, l) << 8) | GetBatchRegVal(probes.pcl, l);
+               if (pomlane.trace)
+                  printf("lane %u %07u: %s PC:%04x\n", first + l, i, pomlane.halted ? "HALT" : "LIMIT", pomlane.pc);
+            }
+            pomactive |= pomlane.active;
+         }
+         if (!pomactive)
+            break;
+      }
+   }
 }
 
-// finds the transistor by coordinates - the coordinations must be upper - left corner ie the most top (first) and most left (second) corner
-int FindTransistor(unsigned int x, unsigned int y)
+// runs all the lanes in groups of BATCHLANES
+void RunBatch(vector<BatchLane> &lanes, const BatchProbes &probes)
 {
-   for (unsigned int i = 0; i < transistors.size(); i++)
-      if (transistors[i].x == x && transistors[i].y == y)
-         return i;
-   printf("--- Error --- Transistor at %d, %d not found.\n", x, y);
-   return -1;
+   printf("-------------------------------------------------------\n");
+   printf("Batch: %u instances in lanes of %d\n", (unsigned int) lanes.size(), BATCHLANES);
+
+   int64_t duration = GetTickCount();
+   uint64_t instanceiterations = 0;
+
+   for (unsigned int first = 0; first < lanes.size(); first += BATCHLANES)
+   {
+      // lanes over the number of instances stay masked off from the start
+      BatchLane emptylane;
+      BatchLane *grouplanes[BATCHLANES];
+      for (int l = 0; l < BATCHLANES; l++)
+      {
+         grouplanes[l] = (first + l < lanes.size()) ? &lanes[first + l] : &emptylane;
+         grouplanes[l]->active = (first + l < lanes.size());
+      }
+
+      RunBatchGroup(grouplanes, first, probes);
+
+      for (int l = 0; l < BATCHLANES && first + l < lanes.size(); l++)
+         instanceiterations += grouplanes[l]->iterations;
+   }
+
+   duration = GetTickCount() - duration;
+   if (!duration)
+      duration = 1;
+   double instancecycles = double(instanceiterations) / 2.0 / double(DIVISOR);
+   printf("---------------------\n");
+   printf("Duration: %" PRId64 "ms\n", duration);
+   printf("Instance cycles: %.0f, throughput %.2f instance cycles/s\n", instancecycles, instancecycles / double(duration) * 1000.0);
 }
 
-void CheckTransistor(int x, int y)
+// Run farm (-farm <manifest>) - the netlist gets extracted once and goes to a sealed memfd, the workers (this program
+// started again with -farmworker) map it read only and keep just the charges of their lanes. The jobs are in another
+// shared segment, every worker takes BATCHLANES of them at once and writes the results back to the segment.
+
+#define FARMMAGIC 0x4d524146
+#define FARMPATH 256
+
+class FarmPad
 {
-   if ((pombuf[y * size_x + x] & (TRANSISTORS | TEMPORARY)) != TRANSISTORS)
-      return;
+public:
+   int origsignal;
+   int type;
+};
 
-   if (!signals_poly[y * size_x + x])
-      if (verbous)
-         printf("Transistor with no signal in gate at: %d %d.\n", x, y);
-   if (!gate)
-      gate = signals_poly[y * size_x + x];
-   if (gate != signals_poly[y * size_x + x])
-      if (verbous)
-         printf("Ambiguous signals in poly for transistor at: %d %d.\n", x, y);
+// header of the netlist segment, the tables follow it
+class FarmNetlist
+{
+public:
+   uint32_t magic;
+   uint32_t divisor;
+   uint32_t devicecount, nodecount, padcount;
+   BatchProbes probes;
+   uint64_t devicesoffset, areaoffset, gateareaoffset, padsoffset;
+   uint64_t size;
+};
 
-   pombuf[y * size_x + x] |= TEMPORARY;
-   shapesize++;
+class FarmJob
+{
+public:
+   char program[FARMPATH];
+   char output[FARMPATH];
+   uint32_t address;
+   uint32_t cyclelimit; // 0 means no limit
+   uint32_t done, halted, cycles, pc, outputbytes, worker;
+};
 
-   if (x)
+// header of the jobs segment, the jobs follow it
+class FarmJobs
+{
+public:
+   std::atomic<uint32_t> next;
+   uint32_t count;
+   uint32_t workerrss[64]; // peak resident set of every worker in kB
+};
+
+inline FarmJob *GetFarmJobs(FarmJobs *pomjobs)
+{
+   return (FarmJob *) (pomjobs + 1);
+}
+
+int CreateSharedSegment(const char *name, size_t size)
+{
+   int fd = memfd_create(name, MFD_ALLOW_SEALING);
+   if (fd < 0)
+      return -1;
+   if (ftruncate(fd, size) < 0)
    {
-      if ((pombuf[y * size_x + x - 1] & TRANSISTORS))
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+// peak resident set of this process in kB - getrusage() of the children would count the pages of the parent
+// the worker had between fork() and exec()
+unsigned int GetPeakRSS()
+{
+   unsigned int pomrss = 0;
+   FILE *pomstatus = ::fopen("/proc/self/status", "r");
+   if (!pomstatus)
+      return 0;
+   char line[256];
+   while (fgets(line, sizeof(line), pomstatus))
+      if (sscanf(line, "VmHWM: %u", &pomrss) == 1)
+         break;
+   ::fclose(pomstatus);
+   return pomrss;
+}
+
+inline uint64_t AlignFarm(uint64_t offset)
+{
+   return (offset + 63) & ~uint64_t(63);
+}
+
+// puts the node netlist to a sealed memfd - nobody can write it after that
+int ExportFarmNetlist(const BatchProbes &probes)
+{
+   FarmNetlist pomheader;
+   pomheader.magic = FARMMAGIC;
+   pomheader.divisor = DIVISOR;
+   pomheader.devicecount = nodedevicecount;
+   pomheader.nodecount = nodecharge.size();
+   pomheader.padcount = pads.size();
+   pomheader.probes = probes;
+   pomheader.devicesoffset = AlignFarm(sizeof(FarmNetlist));
+   pomheader.areaoffset = AlignFarm(pomheader.devicesoffset + pomheader.devicecount * sizeof(NodeDevice));
+   pomheader.gateareaoffset = AlignFarm(pomheader.areaoffset + pomheader.nodecount * sizeof(float));
+   pomheader.padsoffset = AlignFarm(pomheader.gateareaoffset + pomheader.nodecount * sizeof(float));
+   pomheader.size = pomheader.padsoffset + pomheader.padcount * sizeof(FarmPad);
+
+   int fd = CreateSharedSegment("z80netlist", pomheader.size);
+   if (fd < 0)
+      return -1;
+   uint8_t *pombase = (uint8_t *) mmap(NULL, pomheader.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (pombase == MAP_FAILED)
+   {
+      close(fd);
+      return -1;
+   }
+   memcpy(pombase, &pomheader, sizeof(pomheader));
+   memcpy(pombase + pomheader.devicesoffset, nodedevices, pomheader.devicecount * sizeof(NodeDevice));
+   memcpy(pombase + pomheader.areaoffset, nodearea, pomheader.nodecount * sizeof(float));
+   memcpy(pombase + pomheader.gateareaoffset, nodegatearea, pomheader.nodecount * sizeof(float));
+   FarmPad *pompads = (FarmPad *) (pombase + pomheader.padsoffset);
+   for (unsigned int j = 0; j < pads.size(); j++)
+   {
+      pompads[j].origsignal = pads[j].origsignal;
+      pompads[j].type = pads[j].type;
+   }
+   munmap(pombase, pomheader.size);
+
+   fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL);
+   return fd;
+}
+
+// manifest has one job per line: program file, load address, cycle limit (0 = until HALT), output file (- = none)
+bool ReadFarmManifest(const char *filename, vector<FarmJob> &jobs)
+{
+   FILE *manifest = ::fopen(filename, "r");
+   if (!manifest)
+   {
+      printf("Couldn't open %s as manifest.\n", filename);
+      return false;
+   }
+
+   char line[1024];
+   unsigned int linenumber = 0;
+   while (fgets(line, sizeof(line), manifest))
+   {
+      linenumber++;
+      char pomprogram[FARMPATH], pomaddress[32], pomlimit[32], pomoutput[FARMPATH];
+      if (line[0] == '#' || sscanf(line, "%255s", pomprogram) != 1)
+         continue;
+      if (sscanf(line, "%255s %31s %31s %255s", pomprogram, pomaddress, pomlimit, pomoutput) != 4)
       {
-         CheckTransistor(x - 1, y);
+         printf("Manifest %s line %u: program, address, cycle limit and output file expected.\n", filename, linenumber);
+         continue;
       }
-      else
+      FarmJob pomjob;
+      memset(&pomjob, 0, sizeof(pomjob));
+      strcpy(pomjob.program, pomprogram);
+      strcpy(pomjob.output, pomoutput);
+      char *pomaddressend;
+      long pomvalue = strtol(pomaddress, &pomaddressend, 0);
+      if (*pomaddressend || pomvalue < 0 || pomvalue > 65535)
       {
-         if ((pombuf[y * size_x + x - 1] & DIFFUSION))
-            SetSourceDran(x, y, signals_diff[y * size_x + x - 1]);
+         printf("Manifest %s line %u: address out of limit (0 - 65535): %s.\n", filename, linenumber, pomaddress);
+         continue;
+      }
+      pomjob.address = pomvalue;
+      // the batch runs 1000000000 iterations at most, a longer limit would never be reached
+      char *pomend;
+      unsigned long long pomcycles = strtoull(pomlimit, &pomend, 0);
+      if (*pomend || pomlimit[0] == '-' || pomcycles >= 1000000000 / (2 * DIVISOR))
+      {
+         printf("Manifest %s line %u: cycle limit out of limit (0 - %u): %s.\n", filename, linenumber, 1000000000 / (2 * DIVISOR) - 1, pomlimit);
+         continue;
+      }
+      pomjob.cyclelimit = pomcycles;
+      jobs.push_back(pomjob);
+   }
+   ::fclose(manifest);
+   return true;
+}
+
+// worker - attaches the netlist read only and runs the jobs until there are none left
+int RunFarmWorker(int netfd, int jobsfd, unsigned int worker)
+{
+   struct stat pomstat;
+   if (fstat(netfd, &pomstat) < 0)
+      return 1;
+   const uint8_t *pomnet = (const uint8_t *) mmap(NULL, pomstat.st_size, PROT_READ, MAP_SHARED, netfd, 0);
+   if (pomnet == MAP_FAILED)
+      return 1;
+   const FarmNetlist *pomheader = (const FarmNetlist *) pomnet;
+   if (pomheader->magic != FARMMAGIC)
+      return 1;
+
+   if (fstat(jobsfd, &pomstat) < 0)
+      return 1;
+   FarmJobs *pomjobs = (FarmJobs *) mmap(NULL, pomstat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, jobsfd, 0);
+   if (pomjobs == MAP_FAILED)
+      return 1;
+   FarmJob *jobs = GetFarmJobs(pomjobs);
+
+   // the netlist stays in the segment, only the state of the lanes is private
+   DIVISOR = pomheader->divisor;
+   engine = ENGINE_NODE;
+   nodedevices = (const NodeDevice *) (pomnet + pomheader->devicesoffset);
+   nodedevicecount = pomheader->devicecount;
+   nodearea = (const float *) (pomnet + pomheader->areaoffset);
+   nodegatearea = (const float *) (pomnet + pomheader->gateareaoffset);
+   SetupNodeState(pomheader->nodecount);
+   signals.resize(pomheader->nodecount);
+   signals[SIG_VCC].ignore = signals[SIG_GND].ignore = true;
+   const FarmPad *pompads = (const FarmPad *) (pomnet + pomheader->padsoffset);
+   pads.resize(pomheader->padcount);
+   for (unsigned int j = 0; j < pads.size(); j++)
+   {
+      pads[j].origsignal = pompads[j].origsignal;
+      pads[j].type = pompads[j].type;
+   }
+
+   for (;;)
+   {
+      unsigned int first = pomjobs->next.fetch_add(BATCHLANES);
+      if (first >= pomjobs->count)
+         break;
+
+      vector<BatchLane> lanes(BATCHLANES);
+      BatchLane *grouplanes[BATCHLANES];
+      for (int l = 0; l < BATCHLANES; l++)
+      {
+         BatchLane &pomlane = lanes[l];
+         grouplanes[l] = &pomlane;
+         pomlane.trace = false;
+         if (first + l >= pomjobs->count)
+            continue;
+
+         FarmJob &pomjob = jobs[first + l];
+         pomjob.worker = worker;
+         Loader pomloader(&pomlane.lanememory[0], pomlane.laneports);
+         if (pomloader.LoadRaw(pomjob.program, pomjob.address, 0, 0) && pomloader.bytes)
+            pomlane.active = true;
          else
-            otherlen++;
+            printf("job %4u: no program loaded from %s.\n", first + l, pomjob.program);
+         fflush(stdout);
+         pomlane.maxiterations = uint64_t(pomjob.cyclelimit) * 2 * DIVISOR;
+         if (strcmp(pomjob.output, "-"))
+            pomlane.outfile = ::fopen(pomjob.output, "wb");
+      }
+
+      RunBatchGroup(grouplanes, first, pomheader->probes);
+
+      for (int l = 0; l < BATCHLANES && first + l < pomjobs->count; l++)
+      {
+         FarmJob &pomjob = jobs[first + l];
+         pomjob.halted = lanes[l].halted;
+         pomjob.cycles = lanes[l].iterations / (2 * DIVISOR);
+         pomjob.pc = lanes[l].pc;
+         if (lanes[l].outfile)
+         {
+            pomjob.outputbytes = ftell(lanes[l].outfile);
+            ::fclose(lanes[l].outfile);
+         }
+         pomjob.done = (lanes[l].iterations > 0);
       }
    }
-   if (y)
+   pomjobs->workerrss[worker] = GetPeakRSS();
+   return 0;
+}
+
+// parent - shares the netlist and the jobs, starts the workers, waits for them and prints the summary
+void RunFarm(const char *manifest, unsigned int workers, char *argv[], const BatchProbes &probes)
+{
+   vector<FarmJob> pomjoblist;
+   if (!ReadFarmManifest(manifest, pomjoblist) || !pomjoblist.size())
    {
-      if ((pombuf[(y - 1) * size_x + x] & TRANSISTORS))
+      printf("No jobs in manifest %s.\n", manifest);
+      return;
+   }
+
+   int netfd = ExportFarmNetlist(probes);
+   size_t jobssize = sizeof(FarmJobs) + pomjoblist.size() * sizeof(FarmJob);
+   int jobsfd = CreateSharedSegment("z80jobs", jobssize);
+   if (netfd < 0 || jobsfd < 0)
+   {
+      printf("Couldn't create the shared segments of the run farm.\n");
+      return;
+   }
+   FarmJobs *pomjobs = (FarmJobs *) mmap(NULL, jobssize, PROT_READ | PROT_WRITE, MAP_SHARED, jobsfd, 0);
+   if (pomjobs == MAP_FAILED)
+   {
+      printf("Couldn't map the jobs of the run farm.\n");
+      return;
+   }
+   new (&pomjobs->next) std::atomic<uint32_t>(0);
+   pomjobs->count = pomjoblist.size();
+   memcpy(GetFarmJobs(pomjobs), &pomjoblist[0], pomjoblist.size() * sizeof(FarmJob));
+
+   struct stat pomstat;
+   fstat(netfd, &pomstat);
+   printf("-------------------------------------------------------\n");
+   printf("Run farm: %u jobs, %u workers, shared netlist %u kB (%u devices, %u nodes)\n", (unsigned int) pomjoblist.size(), workers,
+      (unsigned int) (pomstat.st_size / 1024), nodedevicecount, (unsigned int) nodecharge.size());
+   fflush(stdout);
+
+   int64_t duration = GetTickCount();
+   vector<pid_t> pids;
+   for (unsigned int w = 0; w < workers; w++)
+   {
+      pid_t pid = fork();
+      if (pid == 0)
       {
-         CheckTransistor(x, y - 1);
+         char pomnetfd[16], pomjobsfd[16], pomworker[16];
+         snprintf(pomnetfd, sizeof(pomnetfd), "%d", netfd);
+         snprintf(pomjobsfd, sizeof(pomjobsfd), "%d", jobsfd);
+         snprintf(pomworker, sizeof(pomworker), "%u", w);
+         char *pomargv[] = { argv[0], argv[1], (char *) "-farmworker", pomnetfd, pomjobsfd, pomworker, NULL };
+         execv("/proc/self/exe", pomargv);
+         _exit(127);
       }
+      if (pid > 0)
+         pids.push_back(pid);
       else
+         printf("Couldn't start worker %u.\n", w);
+   }
+   for (unsigned int w = 0; w < pids.size(); w++)
+   {
+      int status;
+      waitpid(pids[w], &status, 0);
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+         printf("Worker %u failed.\n", w);
+   }
+   duration = GetTickCount() - duration;
+   if (!duration)
+      duration = 1;
+
+   FarmJob *jobs = GetFarmJobs(pomjobs);
+   double instancecycles = 0.0;
+   unsigned int pomhalted = 0, pomfailed = 0;
+   for (unsigned int j = 0; j < pomjobs->count; j++)
+   {
+      FarmJob &pomjob = jobs[j];
+      if (!pomjob.done)
       {
-         if ((pombuf[(y - 1) * size_x + x] & DIFFUSION))
-            SetSourceDran(x, y, signals_diff[(y - 1) * size_x + x]);
-         else
-            otherlen++;
+         printf("job %4u: %s FAILED\n", j, pomjob.program);
+         pomfailed++;
+         continue;
       }
+      printf("job %4u: %s @%04x %s after %u cycles PC:%04x, output %u bytes (worker %u)\n", j, pomjob.program, pomjob.address,
+         pomjob.halted ? "halted" : "cycle limit", pomjob.cycles, pomjob.pc, pomjob.outputbytes, pomjob.worker);
+      instancecycles += pomjob.cycles;
+      if (pomjob.halted)
+         pomhalted++;
    }
-   if (x < size_x - 1)
+
+   unsigned int pomworkerrss = 0;
+   for (unsigned int w = 0; w < workers; w++)
+      pomworkerrss = max(pomworkerrss, pomjobs->workerrss[w]);
+   printf("---------------------\n");
+   printf("Jobs: %u halted, %u reached the cycle limit, %u failed\n", pomhalted, pomjobs->count - pomhalted - pomfailed, pomfailed);
+   printf("Duration: %" PRId64 "ms, throughput %.2f instance cycles/s\n", duration, instancecycles / double(duration) * 1000.0);
+   printf("Peak RSS: extraction %u kB, largest worker %u kB\n", GetPeakRSS(), pomworkerrss);
+
+   munmap(pomjobs, jobssize);
+   close(jobsfd);
+   close(netfd);
+}
+
+// Convergence comparison - the simulation runs once per solver scheme, each time with the adaptive clock,
+// so that every half period lasts only until the chip settles. Every run writes a binary bus log into a temporary
+// file, its transactions (cycle, type, address, data, M1) are compared one by one against the first scheme (the
+// original Jacobi sweep) and the iterations per half period get reported. The switches which write files or
+// print the samples are not passed to the runs.
+
+class ConvergeScheme
+{
+public:
+   const char *name;
+   bool sor;
+   const char *relax;
+};
+
+const ConvergeScheme convergeschemes[] = {
+   { "jacobi", false, "1.0" },
+   { "jacobi", false, "1.25" },
+   { "jacobi", false, "1.5" },
+   { "sor", true, "1.0" },
+   { "sor", true, "1.25" },
+   { "sor", true, "1.5" },
+   { "sor", true, "1.75" },
+};
+
+// reads the adaptive clock summary from the output of one run and the transactions from its bus log
+bool ReadConvergeRun(const char *filename, const char *buslogname, vector<BusTransaction> &transactions, float &average,
+   unsigned int &maximum, unsigned int &halfperiods)
+{
+   FILE *pomfile = fopen(filename, "r");
+   if (!pomfile)
+      return false;
+   char pomline[1024];
+   average = 0.0f;
+   maximum = halfperiods = 0;
+   while (fgets(pomline, sizeof(pomline), pomfile))
+   {
+      unsigned int pommin;
+      if (sscanf(pomline, "Adaptive clock: %u half periods, iterations per half period min %u avg %f max %u", &halfperiods, &pommin, &average, &maximum) == 4)
+         break;
+   }
+   fclose(pomfile);
+
+   pomfile = fopen(buslogname, "rb");
+   if (!pomfile)
+      return false;
+   TraceHeader pomheader;
+   bool pomok = fread(&pomheader, sizeof(pomheader), 1, pomfile) == 1 && !memcmp(pomheader.magic, "Z80BUS\0\0", 8)
+      && pomheader.version == BUSVERSION && pomheader.recordsize == sizeof(BusTransaction);
+   BusTransaction pomtransaction;
+   while (pomok && fread(&pomtransaction, sizeof(pomtransaction), 1, pomfile) == 1)
+      transactions.push_back(pomtransaction);
+   fclose(pomfile);
+   return pomok && halfperiods > 0;
+}
+
+int RunConvergence(int argc, char *argv[])
+{
+   // the other switches are passed to every run, the ones which write files or the samples are left out
+   const char *pomdropped[] = { "-converge", "-sor", "-nolines", "-changes" };
+   const char *pomdroppedwithvalue[] = { "-outfile", "-relax", "-engine", "-divisor", "-trace", "-buslog", "-vcd", "-vcdnodes", "-savesnapshot" };
+   vector<char *> pomargs;
+   for (int i = 0; i < argc; i++)
+   {
+      bool pomdrop = false;
+      for (unsigned int k = 0; k < sizeof(pomdropped) / sizeof(pomdropped[0]); k++)
+         pomdrop |= !::strcmp(argv[i], pomdropped[k]);
+      for (unsigned int k = 0; k < sizeof(pomdroppedwithvalue) / sizeof(pomdroppedwithvalue[0]); k++)
+      {
+         if (!::strcmp(argv[i], pomdroppedwithvalue[k]))
+         {
+            pomdrop = true;
+            i++;
+         }
+      }
+      if (!pomdrop)
+         pomargs.push_back(argv[i]);
+   }
+
+   printf("-------------------------------------------------------\n");
+   printf("Convergence comparison: node engine, adaptive clock (DIVISOR %u at most)\n", DIVISOR);
+   printf("scheme  relax  half periods  avg it/half period  max  transactions  bus log\n");
+   fflush(stdout);
+
+   vector<BusTransaction> reference;
+   float referenceaverage = 0.0f;
+   for (unsigned int s = 0; s < sizeof(convergeschemes) / sizeof(convergeschemes[0]); s++)
    {
-      if ((pombuf[y * size_x + x + 1] & TRANSISTORS))
+      const ConvergeScheme &pomscheme = convergeschemes[s];
+      char pomname[] = "/tmp/z80convergeXXXXXX";
+      char pombuslog[] = "/tmp/z80convergebusXXXXXX";
+      int pomfd = mkstemp(pomname);
+      int pombusfd = mkstemp(pombuslog);
+      if (pomfd < 0 || pombusfd < 0)
       {
-         CheckTransistor(x + 1, y);
+         printf("Couldn't create a temporary file.\n");
+         return 1;
       }
-      else
+      close(pombusfd);
+
+      pid_t pid = fork();
+      if (pid == 0)
       {
-         if ((pombuf[y * size_x + x + 1] & DIFFUSION))
-            SetSourceDran(x, y, signals_diff[y * size_x + x + 1]);
-         else
-            otherlen++;
+         dup2(pomfd, 1);
+         vector<char *> pomargv(pomargs);
+         const char *pomextra[] = { "-engine", "node", "-divisor", "auto", "-relax", pomscheme.relax, "-nolines", "-buslog", pombuslog };
+         for (unsigned int k = 0; k < sizeof(pomextra) / sizeof(pomextra[0]); k++)
+            pomargv.push_back((char *) pomextra[k]);
+         if (pomscheme.sor)
+            pomargv.push_back((char *) "-sor");
+         pomargv.push_back(NULL);
+         execv("/proc/self/exe", &pomargv[0]);
+         _exit(127);
       }
-   }
-   if (y < size_y - 1)
-   {
-      if ((pombuf[(y + 1) * size_x + x] & TRANSISTORS))
+      close(pomfd);
+      int status = 1;
+      if (pid > 0)
+         waitpid(pid, &status, 0);
+
+      vector<BusTransaction> pomevents;
+      float pomaverage;
+      unsigned int pommaximum, pomhalfperiods;
+      // a run ended by -stop exits with the code of its condition
+      bool pomread = pid >= 0 && WIFEXITED(status) && (!WEXITSTATUS(status) || (WEXITSTATUS(status) >= STOP_PC && WEXITSTATUS(status) <= STOP_TIME))
+         && ReadConvergeRun(pomname, pombuslog, pomevents, pomaverage, pommaximum, pomhalfperiods);
+      unlink(pomname);
+      unlink(pombuslog);
+      if (!pomread)
       {
-         CheckTransistor(x, y + 1);
+         printf("%-7s %5s  run failed\n", pomscheme.name, pomscheme.relax);
+         continue;
       }
-      else
+
+      if (reference.empty())
       {
-         if ((pombuf[(y + 1) * size_x + x] & DIFFUSION))
-            SetSourceDran(x, y, signals_diff[(y + 1) * size_x + x]);
-         else
-            otherlen++;
+         reference = pomevents;
+         referenceaverage = pomaverage;
       }
+      unsigned int pomsame = 0;
+      while (pomsame < pomevents.size() && pomsame < reference.size() && !memcmp(&pomevents[pomsame], &reference[pomsame], sizeof(BusTransaction)))
+         pomsame++;
+      char pomverdict[64];
+      if (pomsame == pomevents.size() && pomsame == reference.size())
+         snprintf(pomverdict, sizeof(pomverdict), "identical");
+      else
+         snprintf(pomverdict, sizeof(pomverdict), "DIFFERS at transaction %u", pomsame);
+      printf("%-7s %5s  %12u  %10.1f (%5.1f%%)  %3u  %12u  %s\n", pomscheme.name, pomscheme.relax, pomhalfperiods, pomaverage,
+         100.0f * pomaverage / referenceaverage, pommaximum, (unsigned int) pomevents.size(), pomverdict);
+      fflush(stdout);
    }
+   return 0;
 }
 
-void SetupPad(int x, int y, int signalnum, int padtype)
+// -manifest file - the switches of the run are read from the file (separated by white space, # starts a comment)
+// and take the place of -manifest, so one file describes the whole setup of a run
+bool ExpandManifest(int &argc, char **&argv, vector<string> &storage, vector<char *> &arguments)
 {
-   Pad tmppad;
-
-   tmppad.x = x;
-   tmppad.y = y;
-   tmppad.origsignal = signalnum;
-   tmppad.type = padtype;
-   pads.push_back(tmppad);
-   RouteSignal(tmppad.x, tmppad.y, tmppad.origsignal, METAL);
+   vector<string> pomwords;
+   bool pomexpanded = false;
+   for (int i = 0; i < argc; i++)
+   {
+      if (i < 2 || strcmp(argv[i], "-manifest") || i + 1 == argc)
+      {
+         pomwords.push_back(argv[i]);
+         continue;
+      }
+      i++;
+      FILE *pomfile = ::fopen(argv[i], "r");
+      if (!pomfile)
+      {
+         printf("Couldn't open %s as manifest.\n", argv[i]);
+         continue;
+      }
+      char pomline[1024];
+      while (fgets(pomline, sizeof(pomline), pomfile))
+      {
+         char *pomcomment = strchr(pomline, '#');
+         if (pomcomment)
+            *pomcomment = 0;
+         for (char *pomword = strtok(pomline, " \t\r\n"); pomword; pomword = strtok(NULL, " \t\r\n"))
+            pomwords.push_back(pomword);
+      }
+      ::fclose(pomfile);
+      pomexpanded = true;
+   }
+   if (!pomexpanded)
+      return false;
+   storage = pomwords;
+   arguments.clear();
+   for (unsigned int k = 0; k < storage.size(); k++)
+      arguments.push_back((char *) storage[k].c_str());
+   arguments.push_back(NULL);
+   argc = storage.size();
+   argv = &arguments[0];
+   return true;
 }
 
 // Everything starts here
@@ -1131,13 +6582,33 @@ int main(int argc, char *argv[])
    memory[0x10] = 0xe3;
    memory[0x11] = 0x76;
 
+   if (argc == 3 && !::strcmp(argv[1], "-decode"))
+      return DecodeTrace(argv[2]);
+
    if (argc < 2)
    {
       printf("Need filename as argument.\n");
       return 0;
    }
 
+   vector<string> manifeststorage;
+   vector<char *> manifestarguments;
+   ExpandManifest(argc, argv, manifeststorage, manifestarguments);
+
    FILE *outfile = NULL;
+   const char *outfilename = NULL;
+   unsigned int benchmark = 0;
+   unsigned int batchcopies = 0;
+   vector<const char *> lanefiles;
+   vector<int> laneaddresses;
+   const char *farmmanifest = NULL;
+   unsigned int farmworkers = 4;
+   int farmnetfd = -1, farmjobsfd = -1, farmworker = 0;
+   bool converge = false;
+   vector<string> devicespecs;
+   unsigned int busbench = 0;
+   const char *savesnapshot = NULL;
+   bool badinput = false; // a program, stimulus or stop condition which didn't load or switches which don't go together
    //outfile = ::fopen("outfile.txt", "wb");
 
    for (int i = 2; i < argc; i++)
@@ -1151,85 +6622,430 @@ int main(int argc, char *argv[])
          i++;
          if (argc == i)
          {
-            printf("Filename of outfile expected.\n");
+            printf("Filename of outfile expected.\n");
+         }
+         else
+         {
+            if (outfile)
+               fclose(outfile);
+            outfile = ::fopen(argv[i], "wb");
+            if (!outfile)
+               printf("Couldn't open %s as outfile.\n", argv[i]);
+            outfilename = argv[i];
+         }
+      }
+      else if (!::strcmp(argv[i], "-locale"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Locale specifier expected.\n");
+         }
+         else
+         {
+            char *tmp = setlocale(LC_ALL, argv[i]);
+            if (!tmp)
+               printf("Couldn't set locale %s.\n", argv[i]);
+         }
+      }
+      else if (!::strcmp(argv[i], "-divisor"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Divisor value (100 - 10000) expected.\n");
+         }
+         else if (!::strcmp(argv[i], "auto"))
+         {
+            adaptiveclock.enabled = true;
+         }
+         else
+         {
+            int pomdivisor = atoi(argv[i]);
+            if (pomdivisor < 100 || pomdivisor > 10000)
+               printf("Divisor out of limit (100 - 10000): %d.\n", pomdivisor);
+            else
+               DIVISOR = pomdivisor;
+         }
+      }
+      else if (!::strcmp(argv[i], "-margin"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Settling margin in percent (0 - 1000) expected.\n");
+         }
+         else
+         {
+            int pommargin = atoi(argv[i]);
+            if (pommargin < 0 || pommargin > 1000)
+               printf("Settling margin out of limit (0 - 1000): %d.\n", pommargin);
+            else
+               adaptiveclock.margin = pommargin;
+         }
+      }
+      else if (!::strcmp(argv[i], "-sor"))
+         sorsweep = true;
+      else if (!::strcmp(argv[i], "-relax"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Relaxation factor (0.5 - 2.0) expected.\n");
+         }
+         else
+         {
+            float pomrelax = atof(argv[i]);
+            if (pomrelax < 0.5f || pomrelax > 2.0f)
+               printf("Relaxation factor out of limit (0.5 - 2.0): %s.\n", argv[i]);
+            else
+               relaxation = pomrelax;
+         }
+      }
+      else if (!::strcmp(argv[i], "-blocksize"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Nodes per region (16 - 1000000) expected.\n");
+         }
+         else
+         {
+            int pomsize = atoi(argv[i]);
+            if (pomsize < 16 || pomsize > 1000000)
+               printf("Nodes per region out of limit (16 - 1000000): %d.\n", pomsize);
+            else
+               blocksize = pomsize;
+         }
+      }
+      else if (!::strcmp(argv[i], "-blockiterations"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Iterations per region (1 - %d) expected.\n", BLOCKITERATIONS);
+         }
+         else
+         {
+            int pomiterations = atoi(argv[i]);
+            if (pomiterations < 1 || pomiterations > BLOCKITERATIONS)
+               printf("Iterations per region out of limit (1 - %d): %d.\n", BLOCKITERATIONS, pomiterations);
+            else
+               blockiterations = pomiterations;
+         }
+      }
+      else if (!::strcmp(argv[i], "-multirate"))
+      {
+         engine = ENGINE_NODE;
+         multirate = true;
+         if (i + 1 < argc && !::strcmp(argv[i + 1], "verify"))
+         {
+            multirateverify = true;
+            i++;
+         }
+      }
+      else if (!::strcmp(argv[i], "-trace"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Trace filename expected.\n");
+         }
+         else
+         {
+            if (!tracelog.Open(argv[i]))
+               printf("Couldn't open %s as trace.\n", argv[i]);
+         }
+      }
+      else if (!::strcmp(argv[i], "-vcd"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("VCD filename expected.\n");
+         }
+         else
+         {
+            if (!vcd.Open(argv[i]))
+               printf("Couldn't open %s as VCD.\n", argv[i]);
+         }
+      }
+      else if (!::strcmp(argv[i], "-vcdnodes"))
+      {
+         i++;
+         if (argc == i)
+            printf("Nodes (signal numbers or transistor coordinates x/y separated by commas) expected.\n");
+         else
+            vcd.AddNodes(argv[i]);
+      }
+      else if (!::strcmp(argv[i], "-buslog"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Bus log filename expected.\n");
+         }
+         else
+         {
+            if (!buslog.Open(argv[i]))
+               printf("Couldn't open %s as bus log.\n", argv[i]);
+         }
+      }
+      else if (!::strcmp(argv[i], "-nolines"))
+         samplelines = false;
+      else if (!::strcmp(argv[i], "-changes"))
+         changesonly = true;
+      else if (!::strcmp(argv[i], "-device"))
+      {
+         i++;
+         if (argc == i)
+            printf("Device (ram:ssss-eeee, rom:ssss-eeee, console:pp, timer:pp:cycles[:nmi|:vv]) expected.\n");
+         else
+            devicespecs.push_back(argv[i]);
+      }
+      else if (!::strcmp(argv[i], "-busbench"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Number of bus accesses expected.\n");
+         }
+         else
+         {
+            int pomaccesses = atoi(argv[i]);
+            if (pomaccesses < 1)
+               printf("Number of bus accesses out of limit: %d.\n", pomaccesses);
+            else
+               busbench = pomaccesses;
+         }
+      }
+      else if (!::strcmp(argv[i], "-stimulus"))
+      {
+         i++;
+         if (argc == i)
+            printf("Stimulus filename expected.\n");
+         else if (!stimulus.Load(argv[i]))
+            badinput = true;
+      }
+      else if (!::strcmp(argv[i], "-load"))
+      {
+         i++;
+         if (argc == i)
+            printf("Program (file@address, file.hex, file.s19, snapshot:file) expected.\n");
+         else if (!loader.Load(argv[i]))
+            badinput = true;
+      }
+      else if (!::strcmp(argv[i], "-savesnapshot"))
+      {
+         i++;
+         if (argc == i)
+            printf("Snapshot filename expected.\n");
+         else
+            savesnapshot = argv[i];
+      }
+      else if (!::strcmp(argv[i], "-stop"))
+      {
+         i++;
+         if (argc == i)
+            printf("Stop condition expected.\n");
+         else if (!stops.Add(argv[i]))
+            badinput = true;
+      }
+      else if (!::strcmp(argv[i], "-steady"))
+         steady = true;
+      else if (!::strcmp(argv[i], "-cycles"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Number of clock cycles (1 - 1000000) expected.\n");
+         }
+         else
+         {
+            int pomcycles = atoi(argv[i]);
+            if (pomcycles < 1 || pomcycles > 1000000)
+               printf("Number of clock cycles out of limit (1 - 1000000): %d.\n", pomcycles);
+            else
+               runcycles = pomcycles;
+         }
+      }
+      else if (!::strcmp(argv[i], "-converge"))
+         converge = true;
+      else if (!::strcmp(argv[i], "-autolog"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Adaptive clock log filename expected.\n");
+         }
+         else
+         {
+            adaptiveclock.logfile = fopen(argv[i], "w");
+            if (!adaptiveclock.logfile)
+               printf("Failed to open adaptive clock log file: %s\n", argv[i]);
+         }
+      }
+      else if (!::strcmp(argv[i], "-memfile"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Filename of memfile expected.\n");
+         }
+         else
+         {
+            i++;
+            if (argc == i)
+            {
+               printf("Expected destination address memfile.\n");
+            }
+            else
+            {
+               int pomaddress = atoi(argv[i]);
+               if (pomaddress < 0 || pomaddress > 65535)
+               {
+                  printf("Destination address out of limit (0 - 65535): %d.\n", pomaddress);
+                  badinput = true;
+               }
+               else if (!loader.LoadRaw(argv[i-1], pomaddress, 0, 0))
+                  badinput = true;
+            }
+         }
+      }
+      else if (!::strcmp(argv[i], "-batch"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Number of instances (1 - 1024) expected.\n");
+         }
+         else
+         {
+            int pomcopies = atoi(argv[i]);
+            if (pomcopies < 1 || pomcopies > 1024)
+               printf("Number of instances out of limit (1 - 1024): %d.\n", pomcopies);
+            else
+               batchcopies = pomcopies;
+         }
+      }
+      else if (!::strcmp(argv[i], "-lane"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Filename of lane memfile expected.\n");
+            badinput = true;
          }
          else
          {
-            if (outfile)
-               fclose(outfile);
-            outfile = ::fopen(argv[i], "wb");
-            if (!outfile)
-               printf("Couldn't open %s as outfile.\n", argv[i]);
+            i++;
+            if (argc == i)
+            {
+               printf("Expected destination address of lane memfile.\n");
+               badinput = true;
+            }
+            else
+            {
+               int pomaddress = atoi(argv[i]);
+               if (pomaddress < 0 || pomaddress > 65535)
+               {
+                  printf("Destination address out of limit (0 - 65535): %d.\n", pomaddress);
+                  badinput = true;
+               }
+               else
+               {
+                  lanefiles.push_back(argv[i - 1]);
+                  laneaddresses.push_back(pomaddress);
+               }
+            }
          }
       }
-      else if (!::strcmp(argv[i], "-locale"))
+      else if (!::strcmp(argv[i], "-farm"))
+      {
+         i++;
+         if (argc == i)
+            printf("Filename of job manifest expected.\n");
+         else
+            farmmanifest = argv[i];
+      }
+      else if (!::strcmp(argv[i], "-workers"))
       {
          i++;
          if (argc == i)
          {
-            printf("Locale specifier expected.\n");
+            printf("Number of workers (1 - 64) expected.\n");
          }
          else
          {
-            char *tmp = setlocale(LC_ALL, argv[i]);
-            if (!tmp)
-               printf("Couldn't set locale %s.\n", argv[i]);
+            int pomworkers = atoi(argv[i]);
+            if (pomworkers < 1 || pomworkers > 64)
+               printf("Number of workers out of limit (1 - 64): %d.\n", pomworkers);
+            else
+               farmworkers = pomworkers;
          }
       }
-      else if (!::strcmp(argv[i], "-divisor"))
+      else if (!::strcmp(argv[i], "-farmworker") && i + 3 < argc)
+      {
+         farmnetfd = atoi(argv[++i]);
+         farmjobsfd = atoi(argv[++i]);
+         farmworker = atoi(argv[++i]);
+      }
+      else if (!::strcmp(argv[i], "-engine"))
       {
          i++;
          if (argc == i)
          {
-            printf("Divisor value (100 - 10000) expected.\n");
+            printf("Engine name expected:");
+            for (int e = 0; e < ENGINE_COUNT; e++)
+               printf(" %s", enginenames[e]);
+            printf(".\n");
          }
          else
          {
-            int pomdivisor = atoi(argv[i]);
-            if (pomdivisor < 100 || pomdivisor > 10000)
-               printf("Divisor out of limit (100 - 10000): %d.\n", pomdivisor);
+            int e = 0;
+            while (e < ENGINE_COUNT && ::strcmp(argv[i], enginenames[e]))
+               e++;
+            if (e < ENGINE_COUNT)
+               engine = e;
             else
-               DIVISOR = pomdivisor;
+               printf("Unknown engine %s.\n", argv[i]);
          }
       }
-      else if (!::strcmp(argv[i], "-memfile"))
+      else if (!::strcmp(argv[i], "-calibrate"))
+      {
+         engine = ENGINE_NODE;
+         calibrate = true;
+      }
+      else if (!::strcmp(argv[i], "-threads"))
       {
          i++;
          if (argc == i)
          {
-            printf("Filename of memfile expected.\n");
+            printf("Number of threads (1 - 64) expected.\n");
          }
          else
          {
-            i++;
-            if (argc == i)
-            {
-               printf("Expected destination address memfile.\n");
-            }
+            int pomthreads = atoi(argv[i]);
+            if (pomthreads < 1 || pomthreads > 64)
+               printf("Number of threads out of limit (1 - 64): %d.\n", pomthreads);
             else
-            {
-               int pomaddress = atoi(argv[i]);
-               if (pomaddress < 0 || pomaddress > 65536)
-                  printf("Destination address out of limit (0 - 65535): %d.\n", pomaddress);
-               else
-               {
-                  FILE *memfile = ::fopen(argv[i-1], "rb");
-                  if (!memfile)
-                     printf("Couldn't open %s as memfile.\n", argv[i-1]);
-                  ::fseek(memfile, 0, SEEK_END);
-                  int filelen = ::ftell(memfile);
-                  ::fseek(memfile, 0, SEEK_SET);
-                  if (pomaddress + filelen > 65536)
-                  {
-                     printf("Memfile %s too long for specified destination address (%d). Only part will be read.\n", argv[i-1], pomaddress);
-                     filelen = 65536 - pomaddress;
-                  }
-                  if (::fread(&memory[pomaddress], 1, filelen, memfile) <= 0) {
-                     printf("Couldn't read %s as memfile.\n", argv[i-1]);
-                  }
-                  ::fclose(memfile);
-               }
-            }
+               threads = pomthreads;
+         }
+      }
+      else if (!::strcmp(argv[i], "-benchmark"))
+      {
+         i++;
+         if (argc == i)
+         {
+            printf("Number of benchmark iterations expected.\n");
+         }
+         else
+         {
+            int pomiterations = atoi(argv[i]);
+            if (pomiterations < 1)
+               printf("Number of benchmark iterations out of limit: %d.\n", pomiterations);
+            else
+               benchmark = pomiterations;
          }
       }
       else
@@ -1237,10 +7053,19 @@ int main(int argc, char *argv[])
          printf("Unknown switch %s.\n", argv[i]);
       }
    }
+   if (badinput)
+   {
+      printf("Input files, conditions or switches are wrong, exiting.\n");
+      return 1;
+   }
 
-#ifdef DMB_THREAD
-   threadList = new HANDLE[thread_count];
-#endif
+   // worker of the run farm gets the netlist from the parent, there is nothing to extract
+   if (farmnetfd >= 0)
+      return RunFarmWorker(farmnetfd, farmjobsfd, farmworker);
+   if (converge)
+      return RunConvergence(argc, argv);
+   if (busbench)
+      return BenchmarkBus(busbench, devicespecs);
 
    // Loads the layers to pombuffer[]
    CheckFile(argv[1], METAL);
@@ -1764,6 +7589,20 @@ int main(int argc, char *argv[])
          signals[i].connections[j].proportion = transistors[signals[i].connections[j].index].area / signals[i].signalarea;
    }
 
+   // the node netlist is the base of all the others, the tables of the other engines are built only when they run
+   // (the benchmark runs all of them)
+   BuildNodeNetlist();
+   if (multirate || benchmark)
+      BuildRegions();
+   if (engine == ENGINE_CSR || engine == ENGINE_SELL || benchmark)
+      BuildSpmvMatrix();
+   if (engine == ENGINE_COLORED || benchmark)
+      BuildColoring();
+   if (engine == ENGINE_BLOCKED || benchmark)
+      BuildBlocks(blocksize);
+   if (engine == ENGINE_FUSED || benchmark)
+      BuildFusedNetlist();
+
    if (verbous)
    {
       printf("---------------------\n");
@@ -1774,6 +7613,9 @@ int main(int argc, char *argv[])
       printf("Num of enhancement pull ups: %d\n", pullups_enh);
       printf("Num of pull downs: %d\n", pulldowns);
       printf("Num of diodes: %d\n", diodes);
+      if (engine == ENGINE_COLORED)
+         PrintColoring();
+      PrintFanout();
 
       printf("---------------------\n");
    }
@@ -1862,6 +7704,18 @@ int main(int argc, char *argv[])
    delete signals_poly;
    delete signals_metal;
 
+   if (benchmark)
+   {
+      unsigned int maxthreads = threads;
+      if (maxthreads < 2)
+         maxthreads = std::thread::hardware_concurrency();
+      if (maxthreads < 1)
+         maxthreads = 1;
+      RunBenchmark(benchmark, maxthreads);
+      return 0;
+   }
+
+   StartThreads(threads);
 
    // -------------------------------------------------------
    // -------------------------------------------------------
@@ -1880,9 +7734,9 @@ int main(int argc, char *argv[])
    bool pom_mreq = true;
    bool pom_iorq = true;
    bool pom_halt = true;
+   bool pom_m1 = true;
 
    int outcounter = 0;
-   bool justwasoutput = false;
 
    duration = GetTickCount() - duration;
    if (verbous)
@@ -2219,6 +8073,66 @@ int main(int argc, char *argv[])
 
 // transistors[FindTransistor(2088, 2241)].depletion = true;
 
+   BatchProbes probes;
+   probes.m1 = transistors[sig_m1].origgate;
+   for (int b = 0; b < 8; b++)
+   {
+      probes.pcl[b] = transistors[reg_pcl[b]].origgate;
+      probes.pch[b] = transistors[reg_pch[b]].origgate;
+   }
+
+   if (farmmanifest)
+   {
+      RunFarm(farmmanifest, farmworkers, argv, probes);
+      if (outfile)
+         ::fclose(outfile);
+      pool.Stop();
+      return 0;
+   }
+
+   // batch - the instances run in the lanes of the batch engine instead of the simulation below
+   if (batchcopies || lanefiles.size())
+   {
+      vector<BatchLane> lanes(batchcopies + lanefiles.size());
+      bool pomloaded = true;
+      for (unsigned int l = 0; l < lanefiles.size(); l++)
+      {
+         BatchLane &pomlane = lanes[batchcopies + l];
+         Loader pomloader(&pomlane.lanememory[0], pomlane.laneports);
+         if (!pomloader.LoadRaw(lanefiles[l], laneaddresses[l], 0, 0) || !pomloader.bytes)
+         {
+            printf("Couldn't read %s as lane memfile.\n", lanefiles[l]);
+            pomloaded = false;
+         }
+      }
+      if (!pomloaded)
+      {
+         if (outfile)
+            ::fclose(outfile);
+         pool.Stop();
+         return 1;
+      }
+      if (outfilename)
+      {
+         for (unsigned int l = 0; l < lanes.size(); l++)
+         {
+            char pomname[1024];
+            snprintf(pomname, sizeof(pomname), "%s.%u", outfilename, l);
+            lanes[l].outfile = ::fopen(pomname, "wb");
+         }
+      }
+
+      RunBatch(lanes, probes);
+
+      for (unsigned int l = 0; l < lanes.size(); l++)
+         if (lanes[l].outfile)
+            ::fclose(lanes[l].outfile);
+      if (outfile)
+         ::fclose(outfile);
+      pool.Stop();
+      return 0;
+   }
+
    // ======================================================================
    // ============================= Simulation =============================
    // ======================================================================
@@ -2228,469 +8142,228 @@ int main(int argc, char *argv[])
    printf("-------------------------------------------------------\n");
 
    int totcycles = 0;
+   bool clockhigh = false;
+   bool resetactive = true;
+   unsigned int lines = 0;
+   uint64_t lastpadhigh = 0, lastpadfloating = 0;
+   uint8_t lastaccess = 0; // the access of the last sample and its address - a different one starts a transaction
+   uint16_t lastaccessaddress = 0;
+   unsigned int lastcycle = 0;
+   int stopcode = STOP_NONE;
+   stops.start = GetTickCount();
+   unsigned int steadyfound = 0, steadyskipped = 0;
+
+   if (adaptiveclock.enabled)
+      adaptiveclock.Setup();
+   vcd.Start();
+   paddriver.Setup();
+   if (outfile)
+   {
+      ::fclose(outfile);
+      outfile = NULL;
+      if (!consolestream.Open(outfilename))
+         printf("Couldn't open %s as outfile.\n", outfilename);
+   }
+   bus.Setup(devicespecs, consolestream.active ? &consolestream : NULL);
+   {
+      unsigned int *pomregisters[] = { reg_pch, reg_pcl, reg_i, reg_r, reg_sph, reg_spl, reg_w, reg_z, reg_ixh, reg_ixl, reg_iyh, reg_iyl,
+         reg_h, reg_l, reg_h2, reg_l2, reg_d, reg_e, reg_d2, reg_e2, reg_b, reg_c, reg_b2, reg_c2, reg_a, reg_a2, reg_f, reg_f2 };
+      unsigned int pomstates[] = { sig_t1, sig_t2, sig_t3, sig_t4, sig_t5, sig_t6, sig_m1, sig_m2, sig_m3, sig_m4, sig_m5 };
+      vector<int> pombits(REGISTERGROUPS * 8, -1);
+      for (unsigned int g = 0; g < REG_T; g++)
+         for (unsigned int l = 0; l < 8; l++)
+            pombits[g * 8 + l] = pomregisters[g][l];
+      for (unsigned int l = 0; l < 6; l++)
+         pombits[REG_T * 8 + l] = pomstates[l];
+      for (unsigned int l = 0; l < 5; l++)
+         pombits[REG_M * 8 + l] = pomstates[6 + l];
+      BuildRegisterProbes(pombits);
+   }
+   if (adaptiveclock.enabled && (steady || runcycles))
+   {
+      printf("-steady and -cycles need the fixed DIVISOR clock, ignored.\n");
+      steady = false;
+      runcycles = 0;
+   }
+   if (uint64_t(runcycles) * 2 * DIVISOR >= 1000000000)
+   {
+      runcycles = 1000000000 / (2 * DIVISOR) - 1;
+      printf("Number of clock cycles limited to %u.\n", runcycles);
+   }
+
+   // the sample lines go to stdout thru the output thread, whatever was printed before goes first
+   if (samplelines && !tracelog.stream.active)
+   {
+      fflush(stdout);
+      stdoutstream.Open(1);
+   }
 
    // maximally 2000000 iterations
    for (unsigned int i = 0; i < 1000000000; i++)
    {
-      // Setting input pads
-      // I commented out several tests like test of READY, SID and HOLD pads
-      for (unsigned int j = 0; j < pads.size(); j++)
+      if (adaptiveclock.enabled)
       {
-         if (pads[j].type == PAD_INPUT)
+         clockhigh = adaptiveclock.clockhigh;
+         resetactive = adaptiveclock.halfperiods < 8;
+      }
+      else
+      {
+         if (runcycles && i >= runcycles * 2 * DIVISOR)
+            break;
+
+         // steady state gets checked at the rising clock edges after reset
+         if (steady && !steadyfound && !(i % (2 * DIVISOR)) && i >= DIVISOR * 8)
          {
-            if (pads[j].origsignal == PAD__RESET)
-            {
-               if (i < DIVISOR * 8)
-               {
-                  pads[j].SetInputSignal(SIG_GND);
-                  pom_rst = true;
-               }
-               else
-               {
-                  pads[j].SetInputSignal(SIG_VCC);
-                  pom_rst = false;
-               }
-            }
-            else if (pads[j].origsignal == PAD_CLK)
+            uint64_t pomhash = 14695981039346656037ULL;
+            int pombus[] = { lastadr, lastdata, pom_rd, pom_wr, pom_mreq, pom_iorq, pom_halt, lastaccess, lastaccessaddress };
+            for (unsigned int k = 0; k < sizeof(pombus) / sizeof(pombus[0]); k++)
+               pomhash = (pomhash ^ pombus[k]) * 1099511628211ULL;
+            if (SteadyCycle(HashDigitalState(stimulus.Hash(i / (2 * DIVISOR), bus.Hash(pomhash))), consoleoutput))
             {
-               int pom = i / DIVISOR;
-               if (pom & 1)
-                  pads[j].SetInputSignal(SIG_VCC);
+               steadyfound = i / (2 * DIVISOR);
+               char pomtext[128];
+               int pomlength = snprintf(pomtext, sizeof(pomtext), "Steady state: period %u clock cycles, confirmed at cycle %u\n", steadyperiod, steadyfound);
+               if (stdoutstream.active)
+                  stdoutstream.Write(pomtext, pomlength);
                else
-                  pads[j].SetInputSignal(SIG_GND);
-            }
-            else if (pads[j].origsignal == PAD__WAIT)
-            {
-                  pads[j].SetInputSignal(SIG_VCC);
-            }
-            else if (pads[j].origsignal == PAD__INT)
-            {
-                  pads[j].SetInputSignal(SIG_VCC);
+                  fputs(pomtext, stdout);
+               if (!runcycles)
+                  break;
+               steadyskipped = (runcycles - steadyfound) / steadyperiod * steadyperiod;
+               i += steadyskipped * 2 * DIVISOR;
+               stimulus.Skip(steadyskipped);
+               if (runcycles && i >= runcycles * 2 * DIVISOR)
+                  break;
             }
-            else if (pads[j].origsignal == PAD__NMI)
+         }
+
+         clockhigh = (i / DIVISOR) & 1;
+         resetactive = i < DIVISOR * 8;
+      }
+
+      // devices get a clock every clock cycle
+      unsigned int pomcycle = adaptiveclock.enabled ? adaptiveclock.halfperiods / 2 : i / (2 * DIVISOR);
+      if (pomcycle != lastcycle)
+      {
+         lastcycle = pomcycle;
+         bus.Clock(pomcycle);
+         if (stops.Any() && (stopcode = stops.Cycle(pomcycle, !pom_halt && !pom_rst)))
+            break;
+      }
+
+      // Setting input pads
+      // I commented out several tests like test of READY, SID and HOLD pads
+      {
+         const uint64_t pomcontrol = PADBIT(PAD__RESET) | PADBIT(PAD_CLK) | PADBIT(PAD__WAIT) | PADBIT(PAD__INT) | PADBIT(PAD__NMI) | PADBIT(PAD__BUSRQ);
+         const uint64_t pomdatabus = uint64_t(0xff) << PAD_D0;
+         uint64_t pomhigh = PADBIT(PAD__WAIT) | PADBIT(PAD__INT) | PADBIT(PAD__NMI) | PADBIT(PAD__BUSRQ);
+         uint64_t pomdriven = pomcontrol;
+         if (!resetactive)
+            pomhigh |= PADBIT(PAD__RESET);
+         if (clockhigh)
+            pomhigh |= PADBIT(PAD_CLK);
+         if (bus.intline)
+            pomhigh &= ~PADBIT(PAD__INT);
+         if (bus.nmiline)
+            pomhigh &= ~PADBIT(PAD__NMI);
+         if (bus.waitline)
+            pomhigh &= ~PADBIT(PAD__WAIT);
+         stimulus.Advance(pomcycle);
+         pomhigh = (pomhigh & ~stimulus.mask) | (stimulus.high & stimulus.mask);
+         pom_rst = !(pomhigh & PADBIT(PAD__RESET));
+
+         // we have to pull data bus up or down when memory, I/O or interrupt instruction is read
+         if (!pom_m1 && !pom_iorq && pom_rd) // interrupt acknowledge
+         {
+            pomdriven |= pomdatabus;
+            pomhigh |= uint64_t(bus.Acknowledge()) << PAD_D0;
+         }
+         else if (pom_rd)
+            bus.EndRead();
+         else
+         {
+            if (!pom_mreq) // memory is read
             {
-                  pads[j].SetInputSignal(SIG_VCC);
+               pomdriven |= pomdatabus;
+               pomhigh |= uint64_t(bus.Read(false, lastadr)) << PAD_D0;
             }
-            else if (pads[j].origsignal == PAD__BUSRQ)
+            else if (!pom_iorq) // I/O is read
             {
-                  pads[j].SetInputSignal(SIG_VCC);
+               pomdriven |= pomdatabus;
+               pomhigh |= uint64_t(bus.Read(true, lastadr)) << PAD_D0;
             }
-         }
-         else if (pads[j].type == PAD_BIDIRECTIONAL) // we have to pull data bus up or down when memory, I/O or interrupt instruction is read
-         {
+            else // the data bus stays as it was
             {
-               if (pom_rd) // nothing is read
-               {
-                  pads[j].SetInputSignal(SIG_FLOATING);
-               }
-               else
-               {
-                  if (!pom_mreq) // memory is read
-                  {
-                     if (pads[j].origsignal == PAD_D7)
-                     {
-                        if (memory[lastadr] & 0x80)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D6)
-                     {
-                        if (memory[lastadr] & 0x40)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D5)
-                     {
-                        if (memory[lastadr] & 0x20)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D4)
-                     {
-                        if (memory[lastadr] & 0x10)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D3)
-                     {
-                        if (memory[lastadr] & 0x08)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D2)
-                     {
-                        if (memory[lastadr] & 0x04)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D1)
-                     {
-                        if (memory[lastadr] & 0x02)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D0)
-                     {
-                        if (memory[lastadr] & 0x01)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                  }
-                  else if (!pom_iorq) // I/O is read
-                  {
-                     if (pads[j].origsignal == PAD_D7)
-                     {
-                        if (ports[lastadr & 0xff] & 0x80)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D6)
-                     {
-                        if (ports[lastadr & 0xff] & 0x40)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D5)
-                     {
-                        if (ports[lastadr & 0xff] & 0x20)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D4)
-                     {
-                        if (ports[lastadr & 0xff] & 0x10)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D3)
-                     {
-                        if (ports[lastadr & 0xff] & 0x08)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D2)
-                     {
-                        if (ports[lastadr & 0xff] & 0x04)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D1)
-                     {
-                        if (ports[lastadr & 0xff] & 0x02)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                     else if (pads[j].origsignal == PAD_D0)
-                     {
-                        if (ports[lastadr & 0xff] & 0x01)
-                           pads[j].SetInputSignal(SIG_VCC);
-                        else
-                           pads[j].SetInputSignal(SIG_GND);
-                     }
-                  }
-               }
+               pomdriven |= paddriver.lastdriven & pomdatabus;
+               pomhigh |= paddriver.lasthigh & pomdatabus;
             }
          }
-         else
-         {
-         // some other code here ...
-         }
+         paddriver.Drive(pomhigh, pomdriven);
       }
       // End of Setting input pads
 
       // Simulation itself
-      for (unsigned int j = 0; j < transistors.size(); j++)
-      {
-         transistors[j].Simulate();
-      }
-
-/*    DWORD threadID;
-      printf("--- Starting threads @%d\n", GetTickCount());
-      for (unsigned int t = 0; t < thread_count; t++)
-         threadList[t] = CreateThread(NULL, 0, ThreadSimulateTransistors, (LPVOID) t, NULL, &threadID);
-      WaitForMultipleObjects(thread_count, threadList, TRUE, INFINITE);
-      for (unsigned int t = 0; t < thread_count; t++)
-         CloseHandle(threadList[t]);
-   // WaitForSingleObject(threadList[0], INFINITE);
-   // WaitForSingleObject(threadList[1], INFINITE);
-      printf("--- Threads stopped @%d\n", GetTickCount());*/
-
-      for (unsigned int j = 0; j < signals.size(); j++)
-         if (!signals[j].ignore)
-            signals[j].Homogenize();
-      for (unsigned int j = 0; j < transistors.size(); j++)
-         transistors[j].Normalize();
+      SimulateIteration();
       // End of Simulation itself
 
-      // Reading output pads
-      if (!(i % (DIVISOR * 5)))
-{
-         printf("       : C// // // // AAAA AA                      \n");
-         printf("       : LRH MR RW MI 1111 11AA AAAA AAAA DDDD DDDD\n");
-         printf("       : KSL 1F DR QQ 5432 1098 7654 3210 7654 3210\n");
-      }
+      if (vcd.stream.active)
+         vcd.Sample(i);
 
-      if (!(i % (DIVISOR / 5))) // writes out every 100s cycle (for output to be not too verbous)
+      // Reading output pads - with the adaptive clock when the chip settled, otherwise every DIVISOR / 5 iterations
+      bool sample;
+      if (adaptiveclock.enabled)
+         sample = adaptiveclock.Step();
+      else
+         sample = !(i % (DIVISOR / 5));
+
+      if (sample) // writes out every 100s cycle (for output to be not too verbous)
       {
-         printf("%07d: ", i);
+         bool lastrd = pom_rd, lastmreq = pom_mreq, lastiorq = pom_iorq;
+         int lastbusadr = lastadr;
+         TraceRecord pomrecord;
+         ZeroMemory(&pomrecord, sizeof(pomrecord));
+         pomrecord.iteration = i;
          for (unsigned int j = 0; j < pads.size(); j++)
          {
-            int pom;
-            if (pads[j].type != PAD_INPUT)
-            {
-               if ((pads[j].type == PAD_BIDIRECTIONAL) && (pads[j].ReadInputStatus() != SIG_FLOATING))
-                  pom = pads[j].ReadInputStatus();
-               else
-                  pom = pads[j].ReadOutputStatus();
-            }
-            else
-            {
-               pom = pads[j].ReadInputStatus();
-            }
-            char pom2 = pom + '0';
-            if (pom == 3)
-               pom2 = '.';
-            else
-               pom2--;
-            if (pads[j].origsignal == PAD_CLK)
-               printf("%c", pom2);
-            if (pads[j].origsignal == PAD__RESET)
-               printf("%c", pom2);
-            if (pads[j].origsignal == PAD__HALT)
-            {
-               pom_halt = (pom2 == '1');
-               printf("%c ", pom2);
-            }
-            if (pads[j].origsignal == PAD__M1)
-               printf("%c", pom2);
-            if (pads[j].origsignal == PAD__RFSH)
-               printf("%c ", pom2);
-            if (pads[j].origsignal == PAD__RD)
-            {
-               pom_rd = (pom2 == '1');
-               printf("%c", pom2);
-            }
-            if (pads[j].origsignal == PAD__WR)
-            {
-               pom_wr = (pom2 == '1');
-               printf("%c ", pom2);
-            }
-            if (pads[j].origsignal == PAD__MREQ)
-            {
-               pom_mreq = (pom2 == '1');
-               printf("%c", pom2);
-            }
-            if (pads[j].origsignal == PAD__IORQ)
-            {
-               pom_iorq = (pom2 == '1');
-               printf("%c ", pom2);
-            }
-            if (pads[j].origsignal == PAD_A15)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x8000;
-               pomadr |= (pom2 == '1') ? 0x8000 : 0;
-            }
-            if (pads[j].origsignal == PAD_A14)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x4000;
-               pomadr |= (pom2 == '1') ? 0x4000 : 0;
-            }
-            if (pads[j].origsignal == PAD_A13)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x2000;
-               pomadr |= (pom2 == '1') ? 0x2000 : 0;
-            }
-            if (pads[j].origsignal == PAD_A12)
-            {
-               printf("%c ", pom2);
-               pomadr &= ~0x1000;
-               pomadr |= (pom2 == '1') ? 0x1000 : 0;
-            }
-            if (pads[j].origsignal == PAD_A11)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0800;
-               pomadr |= (pom2 == '1') ? 0x0800 : 0;
-            }
-            if (pads[j].origsignal == PAD_A10)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0400;
-               pomadr |= (pom2 == '1') ? 0x0400 : 0;
-            }
-            if (pads[j].origsignal == PAD_A9)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0200;
-               pomadr |= (pom2 == '1') ? 0x0200 : 0;
-            }
-            if (pads[j].origsignal == PAD_A8)
-            {
-               printf("%c ", pom2);
-               pomadr &= ~0x0100;
-               pomadr |= (pom2 == '1') ? 0x0100 : 0;
-            }
-            if (pads[j].origsignal == PAD_A7)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0080;
-               pomadr |= (pom2 == '1') ? 0x0080 : 0;
-            }
-            if (pads[j].origsignal == PAD_A6)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0040;
-               pomadr |= (pom2 == '1') ? 0x0040 : 0;
-            }
-            if (pads[j].origsignal == PAD_A5)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0020;
-               pomadr |= (pom2 == '1') ? 0x0020 : 0;
-            }
-            if (pads[j].origsignal == PAD_A4)
-            {
-               printf("%c ", pom2);
-               pomadr &= ~0x0010;
-               pomadr |= (pom2 == '1') ? 0x0010 : 0;
-            }
-            if (pads[j].origsignal == PAD_A3)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0008;
-               pomadr |= (pom2 == '1') ? 0x0008 : 0;
-
-            }
-            if (pads[j].origsignal == PAD_A2)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0004;
-               pomadr |= (pom2 == '1') ? 0x0004 : 0;
-            }
-            if (pads[j].origsignal == PAD_A1)
-            {
-               printf("%c", pom2);
-               pomadr &= ~0x0002;
-               pomadr |= (pom2 == '1') ? 0x0002 : 0;
-            }
-            if (pads[j].origsignal == PAD_A0)
-            {
-               printf("%c ", pom2);
-               pomadr &= ~0x0001;
-               pomadr |= (pom2 == '1') ? 0x0001 : 0;
-            }
-            if (pads[j].origsignal == PAD_D7)
-            {
-               printf("%c", pom2);
-               lastdata &= ~0x80;
-               lastdata |= (pom2 == '1') ? 0x80 : 0;
-            }
-            if (pads[j].origsignal == PAD_D6)
-            {
-               printf("%c", pom2);
-               lastdata &= ~0x40;
-               lastdata |= (pom2 == '1') ? 0x40 : 0;
-            }
-            if (pads[j].origsignal == PAD_D5)
-            {
-               printf("%c", pom2);
-               lastdata &= ~0x20;
-               lastdata |= (pom2 == '1') ? 0x20 : 0;
-            }
-            if (pads[j].origsignal == PAD_D4)
-            {
-               printf("%c ", pom2);
-               lastdata &= ~0x10;
-               lastdata |= (pom2 == '1') ? 0x10 : 0;
-            }
-            if (pads[j].origsignal == PAD_D3)
-            {
-               printf("%c", pom2);
-               lastdata &= ~0x08;
-               lastdata |= (pom2 == '1') ? 0x08 : 0;
-            }
-            if (pads[j].origsignal == PAD_D2)
-            {
-               printf("%c", pom2);
-               lastdata &= ~0x04;
-               lastdata |= (pom2 == '1') ? 0x04 : 0;
-            }
-            if (pads[j].origsignal == PAD_D1)
-            {
-               printf("%c", pom2);
-               lastdata &= ~0x02;
-               lastdata |= (pom2 == '1') ? 0x02 : 0;
-            }
-            if (pads[j].origsignal == PAD_D0)
-            {
-               printf("%c", pom2);
-               lastdata &= ~0x01;
-               lastdata |= (pom2 == '1') ? 0x01 : 0;
-            }
-         // End of if (pads[j].type == PAD_OUTPUT)
-         }
-
-         printf(" PC:%04x", GetRegVal(reg_pch) << 8 | GetRegVal(reg_pcl));
-         printf(" IR:%04x", GetRegVal(reg_i) << 8 | GetRegVal(reg_r));
-         printf(" SP:%04x", GetRegVal(reg_sph) << 8 | GetRegVal(reg_spl));
-         printf(" WZ:%04x", GetRegVal(reg_w) << 8 | GetRegVal(reg_z));
-         printf(" IX:%04x", GetRegVal(reg_ixh) << 8 | GetRegVal(reg_ixl));
-         printf(" IY:%04x", GetRegVal(reg_iyh) << 8 | GetRegVal(reg_iyl));
-         printf(" HL:%04x", GetRegVal(reg_h) << 8 | GetRegVal(reg_l));
-         printf(" HL':%04x", GetRegVal(reg_h2) << 8 | GetRegVal(reg_l2));
-         printf(" DE:%04x", GetRegVal(reg_d) << 8 | GetRegVal(reg_e));
-         printf(" DE':%04x", GetRegVal(reg_d2) << 8 | GetRegVal(reg_e2));
-         printf(" BC:%04x", GetRegVal(reg_b) << 8 | GetRegVal(reg_c));
-         printf(" BC':%04x", GetRegVal(reg_b2) << 8 | GetRegVal(reg_c2));
-         printf(" A:%02x", GetRegVal(reg_a));
-         printf(" A':%02x", GetRegVal(reg_a2));
-         printf(" F:%c", (GetRegVal(reg_f) & 0x80) ? L'S' : L'.');
-         printf("%c", (GetRegVal(reg_f) & 0x40) ? L'Z' : L'.');
-         printf("%c", (GetRegVal(reg_f) & 0x20) ? L'5' : L'.');
-         printf("%c", (GetRegVal(reg_f) & 0x10) ? L'H' : L'.');
-         printf("%c", (GetRegVal(reg_f) & 0x08) ? L'3' : L'.');
-         printf("%c", (GetRegVal(reg_f) & 0x04) ? L'V' : L'.');
-         printf("%c", (GetRegVal(reg_f) & 0x02) ? L'N' : L'.');
-         printf("%c", (GetRegVal(reg_f) & 0x01) ? L'C' : L'.');
-         printf(" F':%c", (GetRegVal(reg_f2) & 0x80) ? L'S' : L'.');
-         printf("%c", (GetRegVal(reg_f2) & 0x40) ? L'Z' : L'.');
-         printf("%c", (GetRegVal(reg_f2) & 0x20) ? L'5' : L'.');
-         printf("%c", (GetRegVal(reg_f2) & 0x10) ? L'H' : L'.');
-         printf("%c", (GetRegVal(reg_f2) & 0x08) ? L'3' : L'.');
-         printf("%c", (GetRegVal(reg_f2) & 0x04) ? L'V' : L'.');
-         printf("%c", (GetRegVal(reg_f2) & 0x02) ? L'N' : L'.');
-         printf("%c", (GetRegVal(reg_f2) & 0x01) ? L'C' : L'.');
-
-         printf(" T:%c", (transistors[sig_t1].IsOn()) ? '1' : '.');
-         printf("%c", (transistors[sig_t2].IsOn()) ? '2' : '.');
-         printf("%c", (transistors[sig_t3].IsOn()) ? '3' : '.');
-         printf("%c", (transistors[sig_t4].IsOn()) ? '4' : '.');
-         printf("%c", (transistors[sig_t5].IsOn()) ? '5' : '.');
-         printf("%c", (transistors[sig_t6].IsOn()) ? '6' : '.');
-
-         printf(" M:%c", (transistors[sig_m1].IsOn()) ? '1' : '.');
-         printf("%c", (transistors[sig_m2].IsOn()) ? '2' : '.');
-         printf("%c", (transistors[sig_m3].IsOn()) ? '3' : '.');
-         printf("%c", (transistors[sig_m4].IsOn()) ? '4' : '.');
-         printf("%c", (transistors[sig_m5].IsOn()) ? '5' : '.');
+            int pom = PadLevel(pads[j]);
+            if (pom == SIG_FLOATING)
+               pomrecord.padfloating |= uint64_t(1) << pads[j].origsignal;
+            else if (pom == SIG_VCC)
+               pomrecord.padhigh |= uint64_t(1) << pads[j].origsignal;
+         }
+         pom_halt = pomrecord.Pad(PAD__HALT) == '1';
+         pom_rd = pomrecord.Pad(PAD__RD) == '1';
+         pom_wr = pomrecord.Pad(PAD__WR) == '1';
+         pom_mreq = pomrecord.Pad(PAD__MREQ) == '1';
+         pom_iorq = pomrecord.Pad(PAD__IORQ) == '1';
+         pom_m1 = pomrecord.Pad(PAD__M1) == '1';
+         pomadr = 0;
+         for (int k = 0; k < 16; k++)
+            pomadr |= (pomrecord.Pad(PAD_A0 + k) == '1') ? (1 << k) : 0;
+         lastdata = 0;
+         for (int k = 0; k < 8; k++)
+            lastdata |= (pomrecord.Pad(PAD_D0 + k) == '1') ? (1 << k) : 0;
+
+         RegisterFile pomregisters;
+         bool pomchanged = SnapshotRegisters(pomregisters);
+         pomrecord.pc = pomregisters.Pair(REG_PCH);
+         pomrecord.ir = pomregisters.Pair(REG_I);
+         pomrecord.sp = pomregisters.Pair(REG_SPH);
+         pomrecord.wz = pomregisters.Pair(REG_W);
+         pomrecord.ix = pomregisters.Pair(REG_IXH);
+         pomrecord.iy = pomregisters.Pair(REG_IYH);
+         pomrecord.hl = pomregisters.Pair(REG_H);
+         pomrecord.hl2 = pomregisters.Pair(REG_H2);
+         pomrecord.de = pomregisters.Pair(REG_D);
+         pomrecord.de2 = pomregisters.Pair(REG_D2);
+         pomrecord.bc = pomregisters.Pair(REG_B);
+         pomrecord.bc2 = pomregisters.Pair(REG_B2);
+         pomrecord.a = pomregisters.values[REG_A];
+         pomrecord.a2 = pomregisters.values[REG_A2];
+         pomrecord.f = pomregisters.values[REG_F];
+         pomrecord.f2 = pomregisters.values[REG_F2];
+         pomrecord.tstates = pomregisters.values[REG_T];
+         pomrecord.mstates = pomregisters.values[REG_M];
 
       // printf(" T2:%c", (transistors[sig_trap2].IsOn()) ? 'X' : '.');
       // printf(" U:%c", (transistors[sig_trap2_up].IsOn()) ? 'X' : '.');
@@ -2708,8 +8381,8 @@ int main(int argc, char *argv[])
       // printf(" R3>>% 6.1f|% 6.1f|% 6.1f", transistors[sig_r3].gatecharge, transistors[sig_r3].draincharge, transistors[sig_r3].sourcecharge);
       // printf(" Rx>>% 5.2f|% 5.2f|% 5.2f", transistors[sig_r3].resist, transistors[sig_r3].resist, transistors[sig_r3].resist);
 
-         if (!pom_rd && !pom_mreq && transistors[sig_m1].IsOn())
-            printf(" ***** OPCODE FETCH: %04x[%02x]", pomadr, memory[pomadr]);
+         if (!pom_rd && !pom_mreq && (pomrecord.mstates & 1))
+            pomrecord.events |= TRACE_FETCH;
 
          if (!pom_mreq || !pom_iorq)
          {
@@ -2718,65 +8391,132 @@ int main(int argc, char *argv[])
             {
                if (!pom_wr)
                {
+                  // the device gets the data when the strobe goes up
+                  bus.Write(pom_mreq, lastadr, lastdata);
                   if (!pom_mreq)
-                  {
-                     memory[lastadr] = lastdata;
-                     printf(" MEMORY WRITE: %04x[%02x]", lastadr, lastdata);
-                  }
+                     pomrecord.events |= TRACE_MEMWRITE;
                   if (!pom_iorq)
-                  {
-                     ports[lastadr & 0xff] = lastdata;
-                     printf(" I/O WRITE: %04x[%02x]", lastadr, lastdata);
-                     if (!(lastadr & 0xff))
-                        justwasoutput = true;
-                  }
-               }
-               else
-               {
-                  if (justwasoutput)
-                  {
-                     justwasoutput = false;
-                     if (outfile)
-                        fputc(ports[0], outfile);
-                  }
+                     pomrecord.events |= TRACE_IOWRITE;
                }
                if (!pom_rd)
                {
-                  if (!pom_mreq && !transistors[sig_m1].IsOn())
-                  {
-                     printf(" MEMORY READ: %04x[%02x]", lastadr, memory[lastadr]);
-                  }
+                  if (!pom_mreq && !(pomrecord.mstates & 1))
+                     pomrecord.events |= TRACE_MEMREAD;
                   if (!pom_iorq)
-                  {
-                     printf(" I/O READ: %04x[%02x]", lastadr, memory[lastadr]);
-                  }
+                     pomrecord.events |= TRACE_IOREAD;
                }
             }
          }
 
-         printf("\n");
+         if (pom_rst || pom_wr || (pom_mreq && pom_iorq))
+            bus.EndWrite();
+
+         pomrecord.address = pomadr;
+         pomrecord.data = lastdata;
+         pomrecord.memdata = memory[pomadr];
+         // with -changes only the lines where a register, a pad or the bus changed
+         if (!changesonly || pomchanged || pomrecord.events || pomrecord.padhigh != lastpadhigh || pomrecord.padfloating != lastpadfloating)
+         {
+            if (tracelog.stream.active)
+               tracelog.Push(pomrecord);
+            else if (samplelines && stdoutstream.active)
+            {
+               char pomtext[TRACELINE];
+               if (!(lines++ % 25))
+                  stdoutstream.Write(traceheader, sizeof(traceheader) - 1);
+               stdoutstream.Write(pomtext, FormatTraceRecord(pomtext, pomrecord));
+            }
+            else if (samplelines)
+            {
+               if (!(lines++ % 25))
+                  PrintTraceHeader(stdout);
+               PrintTraceRecord(stdout, pomrecord);
+            }
+         }
+         lastpadhigh = pomrecord.padhigh;
+         lastpadfloating = pomrecord.padfloating;
+         bool pomstarts = pomrecord.Access() && (pomrecord.Access() != lastaccess || pomrecord.address != lastaccessaddress);
+         lastaccess = pomrecord.Access();
+         lastaccessaddress = pomrecord.address;
+         if (buslog.stream.active)
+            buslog.Sample(pomcycle, pomrecord, pomstarts);
+         if (pomstarts && !stimulus.triggers.empty())
+            stimulus.Access(pomcycle, pomrecord);
+         if (pomstarts && stops.Any() && (stopcode = stops.Access(pomrecord)))
+            break;
+
+         if (calibrate)
+            CalibrateSample();
+
+         // the data bus gets driven differently from now on, so the chip has to settle again
+         if (adaptiveclock.enabled)
+            adaptiveclock.Sampled(pom_rd != lastrd || pom_mreq != lastmreq || pom_iorq != lastiorq || (!pom_rd && lastadr != lastbusadr));
 
          if (!pom_halt && !pom_rst)
             outcounter++;
          else
             outcounter = 0;
-         if (outcounter >= 150)
+         if (outcounter >= (adaptiveclock.enabled ? 30 : 150) && !runcycles && !stops.halt) // 15 clock cycles in HALT
             break;
 
       }
       totcycles = i;
    }
 
+   stdoutstream.Close();
+   if (stopcode)
+      printf("Stopped: %s at cycle %u (exit code %d)\n", stops.reason, lastcycle, stopcode);
+   tracelog.Close();
+   vcd.Close();
+   buslog.Close();
+   consolestream.Close();
+   outputwriter.Stop();
+   if (savesnapshot)
+      SaveSnapshot(savesnapshot);
    duration = GetTickCount() - duration;
    printf("---------------------\n");
    printf("Duration: %" PRId64 "ms\n", duration);
-   printf("Speed of simulation: %.2fHz\n", (double(totcycles) / 2.0) / double(duration) * 1000.0 / double(DIVISOR));
+   if (adaptiveclock.enabled)
+      adaptiveclock.PrintSummary(duration);
+   else
+      printf("Speed of simulation: %.2fHz\n", (double(totcycles - steadyskipped * 2 * DIVISOR) / 2.0) / double(duration) * 1000.0 / double(DIVISOR));
+   if (verbous)
+   {
+      printf("Pad driver: %" PRIu64 " pad level changes in %u iterations, %u stimulus lines applied\n", paddriver.changes, totcycles + 1,
+         stimulus.applied);
+      bus.PrintSummary();
+   }
+   if (steady)
+   {
+      if (!steadyfound)
+         printf("Steady state: not found in %u clock cycles\n", totcycles / (2 * DIVISOR));
+      else if (!runcycles)
+         printf("Steady state: stopped at cycle %u\n", steadyfound);
+      else
+         printf("Steady state: %u of %u clock cycles skipped (%.1f%%), %u simulated\n", steadyskipped, runcycles,
+            100.0 * steadyskipped / runcycles, runcycles - steadyskipped);
+   }
+   if (calibrate)
+      PrintCalibration();
+   if (multirate)
+   {
+      PrintMultirate();
+      unsigned int *pomregisters[] = { reg_a, reg_f, reg_b, reg_c, reg_d, reg_e, reg_d2, reg_e2, reg_h, reg_l, reg_h2, reg_l2, reg_w, reg_z,
+         reg_sph, reg_spl, reg_ixh, reg_ixl, reg_iyh, reg_iyl, reg_i, reg_a2, reg_f2, reg_b2, reg_c2 };
+      vector<unsigned int> pomfile, pomrefresh;
+      for (unsigned int k = 0; k < sizeof(pomregisters) / sizeof(pomregisters[0]); k++)
+         for (int b = 0; b < 8; b++)
+            pomfile.push_back(transistors[pomregisters[k][b]].origgate);
+      for (int b = 0; b < 8; b++)
+         pomrefresh.push_back(transistors[reg_r[b]].origgate);
+      printf("Register file cells stepped in %.1f%% of the iterations, refresh counter in %.1f%%\n", 100.0 * RegionRate(pomfile), 100.0 * RegionRate(pomrefresh));
+   }
 
    if (outfile)
       ::fclose(outfile);
-#ifdef DMB_THREAD
-   delete threadList;
-#endif
+   if (adaptiveclock.logfile)
+      ::fclose(adaptiveclock.logfile);
+   pool.Stop();
 
-   return 0;
+   return stopcode;
 }